@@ -0,0 +1,858 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+#include "common.h"
+#include "packets.h"
+#include "parser.h"
+#include "timer.h"
+#include "metrics.h"
+
+/*
+ * Load generator for the chat server.
+ *
+ * Opens many TLS sessions from a single process, spread over a few threads each running its own epoll loop. The
+ * benchmark has three phases : all the users join the server, then chat for a while, each sending messages at a fixed
+ * rate to the lobby or to a room, and finally leave. Users may also leave and join again during the chat phase.
+ *
+ * Messages hold the time they were sent, so that the delivery latency is measured by the users receiving them, in the
+ * same process. The results are printed as JSON on stdout.
+ */
+
+// Biggest packet accepted from the server : the list of users grows with the number of connected clients
+#define MAX_IN_PACKET (64 * 1024 * 1024)
+
+// Maximum number of events handled per epoll_wait call
+#define MAX_EVENTS 256
+
+// Maximum number of reads from a connection per event, so that a busy connection does not hold up the others
+#define READ_BUDGET 16
+
+// Default number of users, threads, and connections being established at once by a thread
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_THREADS 1
+#define DEFAULT_PENDING 64
+
+// Default number of messages sent per second by each user, length of the messages, and time spent chatting (seconds)
+#define DEFAULT_RATE 1
+#define DEFAULT_SIZE 64
+#define DEFAULT_DURATION 10
+
+// Maximum time for all the users to join, and time given to the messages sent at the end of the chat phase to be
+// delivered (milliseconds)
+#define CONNECT_TIMEOUT 30000
+#define DRAIN_TIME 2000
+
+// Time between two checks of the phase by a thread without any event (milliseconds)
+#define PHASE_POLL_INTERVAL 10
+
+// Start of the messages of the benchmark, followed by the time they were sent (microseconds)
+#define BENCH_PREFIX "bench "
+
+enum phase {
+    PH_CONNECT,     // Users join
+    PH_CHAT,        // Users send messages
+    PH_DRAIN,       // Users stop sending, the last messages are delivered
+    PH_STOP         // Users leave
+};
+
+enum session_state {
+    S_IDLE,         // Not connected yet
+    S_CONNECTING,   // Waiting for the TCP connection
+    S_HANDSHAKE,    // TLS handshake
+    S_ACCEPT,       // Waiting for PA_CONNACCEPT
+    S_JOINING,      // Username sent, waiting for the users list
+    S_JOINED,       // Connected user
+    S_CLOSED        // Connection failed or lost
+};
+
+// A simulated user
+struct session {
+    struct worker *worker;
+    uint32_t index;             // Index among all the users
+    uint32_t gen;               // Number of connections made
+    enum session_state state;
+    bool settled;               // Whether the first connection joined or failed
+    int fd;
+    SSL *ssl;
+    SSL_SESSION *resume;        // TLS session to resume on the next connection, if enabled
+    uint32_t room;
+    uint32_t events;            // Events the connection is registered for
+    struct parser in;
+    char *out;                  // Data waiting to be written
+    size_t out_len;
+    size_t out_cap;
+    uint64_t started;           // Time the connection was started (microseconds)
+    uint64_t next_send;         // Time of the next message (microseconds)
+    struct timer timer;         // Expires at next_send
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    struct timer_wheel timers;
+    enum phase phase;           // Last phase seen
+    struct session *sessions;
+    uint32_t nb_sessions;
+    uint32_t next_connect;      // Next session to connect during the connect phase
+    uint32_t pending;           // Connections being established
+    uint32_t next_churn;        // Next session to reconnect
+    struct timer churn;
+    // Results
+    struct histogram handshake; // Time from connect to the end of the TLS handshake (microseconds)
+    struct histogram join;      // Time from connect to the users list (microseconds)
+    struct histogram latency;   // Time from sending a message to receiving it (microseconds)
+    uint64_t joined;
+    uint64_t failed;
+    uint64_t lost;
+    uint64_t reconnects;
+    uint64_t resumed;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t sys;
+};
+
+// Configuration
+char *host = NULL;
+char *port = DEFAULT_PORT_STR;
+long nb_clients = DEFAULT_CLIENTS;
+long nb_threads = DEFAULT_THREADS;
+long max_pending = DEFAULT_PENDING;
+long nb_rooms = 0;
+double msg_rate = DEFAULT_RATE;
+long msg_size = DEFAULT_SIZE;
+long duration = DEFAULT_DURATION;
+double churn_rate = 0;
+bool resume_sessions = false;
+
+struct sockaddr_storage server_addr;
+socklen_t server_addr_len;
+SSL_CTX *ssl_ctx;
+
+struct worker *workers;
+
+_Atomic enum phase phase = PH_CONNECT;
+uint64_t chat_start;
+
+// Users whose first connection joined or failed
+atomic_long settled = 0;
+
+void print_usage(char *progName) {
+    printf("Usage : %s [-n clients] [-t threads] [-p max_pending] [-R rooms] [-r msg_rate] [-s msg_size] [-d duration_s] [-x reconnects_per_s] [-S] host [port]\n", progName);
+}
+
+// Monotonic time in microseconds
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long raise_fd_limit() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) != 0) return 1024;
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) != 0) getrlimit(RLIMIT_NOFILE, &lim);
+    return lim.rlim_cur;
+}
+
+void init_ssl_ctx() {
+
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx == NULL) {
+        perror("Unable to create SSL context");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Use cchat CA for certificate verification
+    if (!SSL_CTX_load_verify_locations(ssl_ctx, "ssl/ca-cert.pem", NULL)) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+}
+
+void resolve_server() {
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s\n", gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+}
+
+void watch(struct session *s, uint32_t events) {
+    if (events == s->events) return;
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(s->worker->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->events = events;
+}
+
+// Count a user whose first connection is over, so that the chat phase starts once all of them are
+void settle(struct session *s) {
+    if (s->settled) return;
+    s->settled = true;
+    atomic_fetch_add(&settled, 1);
+}
+
+void close_session(struct session *s, enum session_state state) {
+
+    struct worker *w = s->worker;
+
+    if (s->state >= S_CONNECTING && s->state <= S_JOINING) w->pending--;
+    timer_cancel(&w->timers, &s->timer);
+
+    if (s->ssl != NULL) {
+        if (s->state == S_JOINED && resume_sessions) {
+            if (s->resume != NULL) SSL_SESSION_free(s->resume);
+            s->resume = SSL_get1_session(s->ssl);
+        }
+        SSL_shutdown(s->ssl);
+        SSL_free(s->ssl);
+        s->ssl = NULL;
+        ERR_clear_error();
+    }
+
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+
+    s->state = state;
+    s->out_len = 0;
+    parser_destroy(&s->in);
+
+}
+
+void fail_session(struct session *s) {
+    if (s->state == S_JOINED) {
+        s->worker->lost++;
+    } else {
+        s->worker->failed++;
+    }
+    close_session(s, S_CLOSED);
+    settle(s);
+}
+
+// Write the data waiting to be sent. Returns false if the connection failed.
+bool flush_session(struct session *s) {
+
+    while (s->out_len > 0) {
+
+        int n = SSL_write(s->ssl, s->out, s->out_len);
+
+        if (n <= 0) {
+            int err = SSL_get_error(s->ssl, n);
+            if (err == SSL_ERROR_WANT_WRITE) break;
+            if (err == SSL_ERROR_WANT_READ) break;
+            return false;
+        }
+
+        memmove(s->out, s->out + n, s->out_len - n);
+        s->out_len -= n;
+
+    }
+
+    watch(s, EPOLLIN | (s->out_len > 0 ? EPOLLOUT : 0));
+    return true;
+
+}
+
+void session_send(struct session *s, const void *data, size_t len) {
+
+    if (s->out_len + len > s->out_cap) {
+        s->out_cap = (s->out_len + len) * 2;
+        s->out = realloc(s->out, s->out_cap);
+    }
+
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+
+    if (!flush_session(s)) fail_session(s);
+
+}
+
+// Start the next connection of a user
+void connect_session(struct session *s) {
+
+    struct worker *w = s->worker;
+
+    s->gen++;
+    s->started = now_us();
+    s->events = EPOLLOUT;
+    s->state = S_CONNECTING;
+    w->pending++;
+
+    s->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->fd == -1) {
+        perror("Error while creating socket");
+        fail_session(s);
+        return;
+    }
+
+    int nodelay = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (connect(s->fd, (struct sockaddr *) &server_addr, server_addr_len) == -1 && errno != EINPROGRESS) {
+        fail_session(s);
+        return;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = s->events;
+    ev.data.ptr = s;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev);
+
+}
+
+// Start connections during the connect phase, up to max_pending at once
+void connect_more(struct worker *w) {
+    while (w->phase == PH_CONNECT && w->next_connect < w->nb_sessions && w->pending < max_pending) {
+        connect_session(&w->sessions[w->next_connect++]);
+    }
+}
+
+void handshake_session(struct session *s) {
+
+    int ret = SSL_connect(s->ssl);
+
+    if (ret == 1) {
+        histogram_record(&s->worker->handshake, now_us() - s->started);
+        if (SSL_session_reused(s->ssl)) s->worker->resumed++;
+        parser_init(&s->in, MAX_IN_PACKET);
+        s->state = S_ACCEPT;
+        watch(s, EPOLLIN);
+        return;
+    }
+
+    switch (SSL_get_error(s->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            watch(s, EPOLLIN);
+            return;
+        case SSL_ERROR_WANT_WRITE:
+            watch(s, EPOLLOUT);
+            return;
+        default:
+            fail_session(s);
+            return;
+    }
+
+}
+
+// The TCP connection is established, or failed
+void connected_session(struct session *s) {
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        fail_session(s);
+        return;
+    }
+
+    s->ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(s->ssl, s->fd);
+    SSL_set1_host(s->ssl, SSL_SERVER_HOSTNAME);
+    if (s->resume != NULL) SSL_set_session(s->ssl, s->resume);
+
+    s->state = S_HANDSHAKE;
+    handshake_session(s);
+
+}
+
+void send_username(struct session *s) {
+
+    char username[MAX_USERNAME_LENGTH + 1];
+    int username_len = snprintf(username, sizeof(username), "b%u_%u", s->index, s->gen);
+
+    uint32_t packet[2] = {htonl(PA_USERNAME), htonl(username_len + 1)};
+    char hello[sizeof(packet) + sizeof(username)];
+    memcpy(hello, packet, sizeof(packet));
+    memcpy(hello + sizeof(packet), username, username_len + 1);
+
+    s->state = S_JOINING;
+    session_send(s, hello, sizeof(packet) + username_len + 1);
+
+}
+
+void send_message(struct session *s, uint64_t now) {
+
+    char msg[MAX_MSG_LENGTH];
+    int len = snprintf(msg, sizeof(msg), BENCH_PREFIX "%lu ", now);
+    while (len < msg_size) msg[len++] = 'x';
+    msg[len++] = '\0';
+
+    uint32_t header[4] = {htonl(PA_MSG), htonl(s->room), 0, htonl(len)};
+    char packet[sizeof(header) + MAX_MSG_LENGTH];
+    memcpy(packet, header, sizeof(header));
+    memcpy(packet + sizeof(header), msg, len);
+
+    s->worker->sent++;
+    session_send(s, packet, sizeof(header) + len);
+
+}
+
+// Schedule the next message of a user, at a fixed rate from `from` (microseconds)
+void schedule_message(struct session *s, uint64_t from) {
+    s->next_send = from;
+    timer_schedule(&s->worker->timers, &s->timer, s->next_send / 1000);
+}
+
+// Start sending messages, at a random point of the first interval so that the users do not all send at once
+void start_chatting(struct session *s, uint64_t now) {
+    uint64_t interval = 1000000 / msg_rate;
+    schedule_message(s, now + (uint64_t) rand() % (interval + 1));
+}
+
+void joined_session(struct session *s) {
+
+    struct worker *w = s->worker;
+
+    histogram_record(&w->join, now_us() - s->started);
+    w->pending--;
+    w->joined++;
+    s->state = S_JOINED;
+    settle(s);
+
+    if (s->room != LOBBY_ROOM) {
+        uint32_t packet[2] = {htonl(PA_JOINROOM), htonl(s->room)};
+        session_send(s, packet, sizeof(packet));
+        if (s->state != S_JOINED) return;
+    }
+
+    if (w->phase == PH_CHAT && msg_rate > 0) start_chatting(s, now_us());
+
+}
+
+void receive_message(struct session *s, struct packet *p) {
+
+    if (p->len < sizeof(BENCH_PREFIX) || strncmp(p->data, BENCH_PREFIX, sizeof(BENCH_PREFIX) - 1) != 0) return;
+
+    uint64_t sent = strtoull(p->data + sizeof(BENCH_PREFIX) - 1, NULL, 10);
+    uint64_t now = now_us();
+
+    s->worker->received++;
+    histogram_record(&s->worker->latency, now > sent ? now - sent : 0);
+
+}
+
+// Handle a packet. Returns false if the connection was closed.
+bool handle_packet(struct session *s, struct packet *p) {
+
+    switch (p->pa_num) {
+
+        case PA_CONNACCEPT:
+            if (s->state != S_ACCEPT) return true;
+            send_username(s);
+            break;
+
+        case PA_PRESENCE:
+            if (s->state != S_JOINING) return true;
+            joined_session(s);
+            break;
+
+        case PA_ERRMAXCONN:
+        case PA_ERRNAME:
+            fail_session(s);
+            return false;
+
+        case PA_MSG:
+        case PA_DM:
+            receive_message(s, p);
+            break;
+
+        case PA_SYS:
+            s->worker->sys++;
+            break;
+
+        case PA_PING: {
+            uint32_t packet[3] = {htonl(PA_PONG), htonl(p->version >> 32), htonl(p->version & UINT32_MAX)};
+            session_send(s, packet, sizeof(packet));
+            break;
+        }
+
+        // The lists of users, their updates and the history are not needed
+        default:
+            break;
+
+    }
+
+    return s->state != S_CLOSED;
+
+}
+
+void read_session(struct session *s) {
+
+    for (int i = 0; i < READ_BUDGET; i++) {
+
+        size_t space;
+        char *buff = parser_space(&s->in, &space);
+
+        int n = SSL_read(s->ssl, buff, space);
+
+        if (n <= 0) {
+            int err = SSL_get_error(s->ssl, n);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) break;
+            fail_session(s);
+            return;
+        }
+
+        parser_commit(&s->in, n);
+
+        struct packet p;
+        int res;
+        while ((res = parser_next(&s->in, &p)) > 0) {
+            if (!handle_packet(s, &p)) return;
+        }
+
+        if (res < 0) {
+            fprintf(stderr, "Invalid packet received by user %u\n", s->index);
+            fail_session(s);
+            return;
+        }
+
+    }
+
+}
+
+void handle_event(struct session *s, uint32_t events) {
+
+    switch (s->state) {
+
+        case S_CONNECTING:
+            connected_session(s);
+            break;
+
+        case S_HANDSHAKE:
+            handshake_session(s);
+            break;
+
+        case S_ACCEPT:
+        case S_JOINING:
+        case S_JOINED:
+            if ((events & EPOLLOUT) && !flush_session(s)) {
+                fail_session(s);
+                break;
+            }
+            if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) read_session(s);
+            break;
+
+        default:
+            break;
+
+    }
+
+}
+
+void handle_timer(struct timer *t, void *arg) {
+
+    struct worker *w = arg;
+
+    if (t == &w->churn) {
+
+        // Reconnect the next connected user
+        for (uint32_t i = 0; i < w->nb_sessions; i++) {
+            struct session *s = &w->sessions[w->next_churn];
+            w->next_churn = (w->next_churn + 1) % w->nb_sessions;
+            if (s->state != S_JOINED) continue;
+            close_session(s, S_IDLE);
+            w->reconnects++;
+            connect_session(s);
+            break;
+        }
+
+        timer_schedule(&w->timers, &w->churn, now_us() / 1000 + 1000 * nb_threads / churn_rate);
+        return;
+
+    }
+
+    struct session *s = (struct session *) ((char *) t - offsetof(struct session, timer));
+    if (w->phase != PH_CHAT || s->state != S_JOINED) return;
+
+    uint64_t now = now_us();
+    send_message(s, now);
+    if (s->state == S_JOINED) schedule_message(s, s->next_send + 1000000 / msg_rate);
+
+}
+
+// Follow the phase set by the main thread
+void update_phase(struct worker *w) {
+
+    enum phase p = atomic_load(&phase);
+    if (p == w->phase) return;
+    w->phase = p;
+
+    if (p == PH_CHAT) {
+        uint64_t now = now_us();
+        if (msg_rate > 0) {
+            for (uint32_t i = 0; i < w->nb_sessions; i++) {
+                if (w->sessions[i].state == S_JOINED) start_chatting(&w->sessions[i], now);
+            }
+        }
+        if (churn_rate > 0) timer_schedule(&w->timers, &w->churn, now / 1000 + 1000 * nb_threads / churn_rate);
+    }
+
+    if (p == PH_DRAIN) timer_cancel(&w->timers, &w->churn);
+
+}
+
+void *worker_loop(void *arg) {
+
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now = now_us() / 1000;
+
+    connect_more(w);
+
+    while (true) {
+
+        update_phase(w);
+        if (w->phase == PH_STOP) break;
+
+        int64_t timeout = timer_next(&w->timers, now);
+        if (timeout < 0 || timeout > PHASE_POLL_INTERVAL) timeout = PHASE_POLL_INTERVAL;
+
+        int nfds = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        if (nfds == -1 && errno != EINTR) {
+            perror("Error while polling");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nfds; i++) handle_event(events[i].data.ptr, events[i].events);
+
+        now = now_us() / 1000;
+        timer_advance(&w->timers, now, handle_timer, w);
+        connect_more(w);
+
+    }
+
+    // Leave
+    for (uint32_t i = 0; i < w->nb_sessions; i++) {
+        struct session *s = &w->sessions[i];
+        if (s->state != S_IDLE && s->state != S_CLOSED) close_session(s, S_CLOSED);
+        if (s->resume != NULL) SSL_SESSION_free(s->resume);
+        free(s->out);
+    }
+
+    return NULL;
+
+}
+
+void init_worker(struct worker *w, uint32_t first, uint32_t count) {
+
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epoll_fd == -1) {
+        perror("Error while creating epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    timer_wheel_init(&w->timers, now_us() / 1000);
+    w->phase = PH_CONNECT;
+    w->sessions = calloc(count, sizeof(struct session));
+    w->nb_sessions = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct session *s = &w->sessions[i];
+        s->worker = w;
+        s->index = first + i;
+        s->fd = -1;
+        s->room = nb_rooms > 0 ? 1 + s->index % nb_rooms : LOBBY_ROOM;
+    }
+
+}
+
+void print_latency(const char *name, struct histogram *h, bool last) {
+
+    uint64_t count = histogram_count(h);
+
+    printf("    \"%s\": {\"count\": %lu, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}%s\n",
+           name, count, count > 0 ? h->sum / 1000.0 / count : 0,
+           histogram_quantile(h, 0.5) / 1000.0, histogram_quantile(h, 0.9) / 1000.0,
+           histogram_quantile(h, 0.99) / 1000.0, histogram_quantile(h, 0.999) / 1000.0,
+           histogram_quantile(h, 1) / 1000.0, last ? "" : ",");
+
+}
+
+void print_results(double connect_time, double chat_time) {
+
+    struct worker *total = calloc(1, sizeof(struct worker));
+
+    for (int i = 0; i < nb_threads; i++) {
+        struct worker *w = &workers[i];
+        histogram_merge(&total->handshake, &w->handshake);
+        histogram_merge(&total->join, &w->join);
+        histogram_merge(&total->latency, &w->latency);
+        total->joined += w->joined;
+        total->failed += w->failed;
+        total->lost += w->lost;
+        total->reconnects += w->reconnects;
+        total->resumed += w->resumed;
+        total->sent += w->sent;
+        total->received += w->received;
+        total->sys += w->sys;
+    }
+
+    printf("{\n");
+    printf("  \"config\": {\"host\": \"%s\", \"port\": \"%s\", \"clients\": %ld, \"threads\": %ld, \"max_pending\": %ld, "
+           "\"rooms\": %ld, \"msg_rate\": %g, \"msg_size\": %ld, \"duration\": %ld, \"reconnects_per_s\": %g, \"resume\": %s},\n",
+           host, port, nb_clients, nb_threads, max_pending, nb_rooms, msg_rate, msg_size, duration, churn_rate,
+           resume_sessions ? "true" : "false");
+
+    // The joins and their times include the reconnections of the chat phase
+    printf("  \"connect\": {\n");
+    printf("    \"joined\": %lu,\n    \"failed\": %lu,\n    \"resumed\": %lu,\n    \"seconds\": %.3f,\n    \"joins_per_s\": %.1f,\n",
+           total->joined, total->failed, total->resumed, connect_time,
+           connect_time > 0 ? (nb_clients - total->failed) / connect_time : 0);
+    print_latency("handshake_ms", &total->handshake, false);
+    print_latency("join_ms", &total->join, true);
+    printf("  },\n");
+
+    printf("  \"chat\": {\n");
+    printf("    \"seconds\": %.3f,\n    \"sent\": %lu,\n    \"received\": %lu,\n    \"sent_per_s\": %.1f,\n    \"received_per_s\": %.1f,\n",
+           chat_time, total->sent, total->received, total->sent / chat_time, total->received / chat_time);
+    printf("    \"fanout\": %.2f,\n    \"system_messages\": %lu,\n    \"lost\": %lu,\n    \"reconnects\": %lu,\n",
+           total->sent > 0 ? (double) total->received / total->sent : 0, total->sys, total->lost, total->reconnects);
+    print_latency("latency_ms", &total->latency, true);
+    printf("  }\n");
+    printf("}\n");
+
+    free(total);
+
+}
+
+void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:p:R:r:s:d:x:S")) != -1) {
+        switch (opt) {
+            case 'n':
+                nb_clients = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                nb_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                max_pending = strtol(optarg, NULL, 10);
+                break;
+            case 'R':
+                nb_rooms = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                msg_rate = strtod(optarg, NULL);
+                break;
+            case 's':
+                msg_size = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = strtol(optarg, NULL, 10);
+                break;
+            case 'x':
+                churn_rate = strtod(optarg, NULL);
+                break;
+            case 'S':
+                resume_sessions = true;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || nb_clients <= 0 || nb_threads <= 0 || nb_threads > nb_clients || max_pending <= 0
+        || nb_rooms < 0 || nb_rooms > UINT32_MAX - 1 || msg_rate < 0 || msg_size < 0 || msg_size >= MAX_MSG_LENGTH
+        || duration <= 0 || churn_rate < 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    host = argv[optind];
+    if (optind + 1 < argc) port = argv[optind + 1];
+
+    // Writing to a connection closed by the server must not kill the benchmark
+    signal(SIGPIPE, SIG_IGN);
+    long fd_limit = raise_fd_limit();
+    if (nb_clients > fd_limit - 16) {
+        fprintf(stderr, "Not enough file descriptors for %ld clients (limit %ld)\n", nb_clients, fd_limit);
+        return EXIT_FAILURE;
+    }
+
+    init_ssl_ctx();
+    resolve_server();
+    srand(time(NULL));
+
+    workers = calloc(nb_threads, sizeof(struct worker));
+    for (long i = 0; i < nb_threads; i++) {
+        uint32_t first = nb_clients * i / nb_threads;
+        init_worker(&workers[i], first, nb_clients * (i + 1) / nb_threads - first);
+    }
+
+    uint64_t start = now_us();
+
+    for (long i = 0; i < nb_threads; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+    }
+
+    // Chat once all the users joined or failed to
+    while (atomic_load(&settled) < nb_clients && now_us() - start < CONNECT_TIMEOUT * 1000ULL) sleep_ms(1);
+
+    chat_start = now_us();
+    double connect_time = (chat_start - start) / 1e6;
+    if (atomic_load(&settled) < nb_clients) fprintf(stderr, "Some users did not join in time\n");
+    atomic_store(&phase, PH_CHAT);
+
+    sleep_ms(duration * 1000);
+    double chat_time = (now_us() - chat_start) / 1e6;
+    atomic_store(&phase, PH_DRAIN);
+
+    sleep_ms(DRAIN_TIME);
+    atomic_store(&phase, PH_STOP);
+
+    for (long i = 0; i < nb_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    print_results(connect_time, chat_time);
+
+    SSL_CTX_free(ssl_ctx);
+    return EXIT_SUCCESS;
+
+}
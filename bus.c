@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "bus.h"
+
+int bus_init(struct bus *b) {
+    atomic_init(&b->head, NULL);
+    b->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return b->event_fd == -1 ? -1 : 0;
+}
+
+void bus_push(struct bus *b, struct bus_node *n, bool wake) {
+
+    struct bus_node *head = atomic_load_explicit(&b->head, memory_order_relaxed);
+
+    do {
+        n->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&b->head, &head, n, memory_order_release, memory_order_relaxed));
+
+    // Only the first node pushed after the consumer emptied the bus needs to wake it up
+    if (wake && head == NULL) {
+        uint64_t one = 1;
+        if (write(b->event_fd, &one, sizeof(one))) {}
+    }
+
+}
+
+void bus_wake(struct bus *b) {
+    uint64_t one = 1;
+    if (write(b->event_fd, &one, sizeof(one))) {}
+}
+
+void bus_clear_wakeup(struct bus *b) {
+    uint64_t count;
+    if (read(b->event_fd, &count, sizeof(count))) {}
+}
+
+struct bus_node *bus_take(struct bus *b) {
+
+    struct bus_node *n = atomic_exchange_explicit(&b->head, NULL, memory_order_acquire);
+
+    // Nodes are stacked, reverse them to get them in the order they were pushed
+    struct bus_node *first = NULL;
+    while (n != NULL) {
+        struct bus_node *next = n->next;
+        n->next = first;
+        first = n;
+        n = next;
+    }
+
+    return first;
+
+}
@@ -0,0 +1,39 @@
+#ifndef DEF_BUS
+#define DEF_BUS
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+ * Lock-free queue with multiple producers and a single consumer, used to pass messages between threads.
+ * Nodes are intrusive : embed a `struct bus_node` as the first member of the message structure.
+ */
+
+struct bus_node {
+    struct bus_node *next;
+};
+
+struct bus {
+    _Atomic(struct bus_node *) head;
+    int event_fd;   // Readable when the consumer has to be woken up
+};
+
+// Initialize an empty bus. Returns -1 if the wake up file descriptor could not be created.
+int bus_init(struct bus *b);
+
+/*
+ * Push a node on the bus. If `wake` is true and the bus was empty, the consumer is woken up through its `event_fd`.
+ * The consumer must call bus_clear_wakeup before bus_take so that no wake up is lost.
+ */
+void bus_push(struct bus *b, struct bus_node *n, bool wake);
+
+// Wake up the consumer without pushing anything, for it to notice a change outside of the bus
+void bus_wake(struct bus *b);
+
+// Consume the pending wake up notification of the bus
+void bus_clear_wakeup(struct bus *b);
+
+// Take all the nodes pushed on the bus, in the order they were pushed. Returns NULL if the bus is empty.
+struct bus_node *bus_take(struct bus *b);
+
+#endif
@@ -24,16 +24,54 @@
 #include "gui.h"
 #include "packets.h"
 #include "client.h"
+#include "clients.h"
+#include "parser.h"
+#include "compress.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Biggest packet accepted from the server : the list of users grows with the number of connected clients
+#define MAX_IN_PACKET (64 * 1024 * 1024)
+
+// Time between two pings to the server, and time after which the connection is considered lost if a ping is not
+// answered (milliseconds)
+#define PING_INTERVAL 10000
+#define PING_TIMEOUT 30000
 
 Socket sock;
 SSL_CTX *ssl_ctx;
 int sock_fd;
 uint32_t client_id;
 
+// Data received from the server
+struct parser in;
+
+// Packets of the last PA_COMPRESSED packet received, handled before the next packets
+struct parser unpacked;
+z_stream inflater;
+
+// File keeping the TLS session with the server, to resume it on the next connection. Empty if there is none.
+char session_path[PATH_MAX] = "";
+
+// File keeping the list of users received on the last connection, to only get the changes since then on the next one
+char presence_path[PATH_MAX] = "";
+
+// Users of the lobby, that is all the connected users
 struct client *clients = NULL;
 
+// Room messages are sent to, and its other members if it is not the lobby
+uint32_t current_room = LOBBY_ROOM;
+struct client *room_members = NULL;
+
+// Time the last ping was sent, and time the first unanswered ping was sent, 0 if none (microseconds)
+uint64_t last_ping = 0;
+uint64_t pending_ping = 0;
+
 char information_message[1024];
 char msg_buff[MAX_MSG_LENGTH + 1];
 
@@ -41,6 +79,68 @@ void print_usage(char *progName) {
     printf("Usage : %s USERNAME HOST [port]\n", progName);
 }
 
+// Sessions and lists of users are saved in ~/.cchat, one file per server
+void init_session_path(char *host, char *port) {
+
+    char *home = getenv("HOME");
+    if (home == NULL) return;
+
+    char dir[PATH_MAX];
+    int len = snprintf(dir, sizeof(dir), "%s/.cchat", home);
+    if (len < 0 || len >= (int) sizeof(dir)) return;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return;
+
+    len = snprintf(session_path, sizeof(session_path), "%s/session_%s_%s.pem", dir, host, port);
+    if (len < 0 || len >= (int) sizeof(session_path)) session_path[0] = '\0';
+
+    len = snprintf(presence_path, sizeof(presence_path), "%s/users_%s_%s", dir, host, port);
+    if (len < 0 || len >= (int) sizeof(presence_path)) presence_path[0] = '\0';
+
+}
+
+// Called by OpenSSL when the server sends a new session ticket
+int save_session(SSL *ssl, SSL_SESSION *session) {
+
+    (void) ssl;
+
+    if (session_path[0] == '\0' || !SSL_SESSION_is_resumable(session)) return 0;
+
+    // The session holds the keys of the connection, only the user may read it
+    int fd = open(session_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return 0;
+
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    PEM_write_SSL_SESSION(f, session);
+    fclose(f);
+
+    // We did not keep a reference to the session
+    return 0;
+
+}
+
+// Offer the session saved by the previous connection, if any
+void load_session(SSL *ssl) {
+
+    if (session_path[0] == '\0') return;
+
+    FILE *f = fopen(session_path, "r");
+    if (f == NULL) return;
+
+    SSL_SESSION *session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+    fclose(f);
+
+    if (session != NULL) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+
+}
+
 Socket init_socket(char *host, char *port) {
 
     // Create new SSL context    
@@ -60,6 +160,11 @@ Socket init_socket(char *host, char *port) {
     // Abort connection if handshake fails
     SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
 
+    // Save the sessions sent by the server to resume them later
+    init_session_path(host, port);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, save_session);
+
     struct addrinfo *res = NULL;
 
     struct addrinfo hints = {0};
@@ -107,6 +212,8 @@ Socket init_socket(char *host, char *port) {
         goto exit;
     }
     
+    load_session(ssl);
+
     /* Now do SSL connect with server */
     if (SSL_connect(ssl) != 1) {
         
@@ -177,11 +284,7 @@ void throw(const char *format, ...) {
 
 char *get_client_name(uint32_t id) {
 
-    struct client *c = clients;
-
-    while(c != NULL && c->id != id) {
-        c = c->next;
-    }
+    struct client *c = find_client_id(clients, id);
 
     if (c == NULL) {
         print_system_msg("[ERROR] Unknown user id %d", id);
@@ -192,157 +295,571 @@ char *get_client_name(uint32_t id) {
 
 }
 
-void handle_client_message() {
+void handle_client_message(struct packet *p) {
 
-    uint32_t id;
-    SSL_read(sock, &id, sizeof(uint32_t));
-    id = ntohl(id);
+    if (p->len >= sizeof(msg_buff)) {
+        throw("Error while receiving message : packet too large (got %d, buffer is %d)", p->len, sizeof(msg_buff));
+    }
 
-    uint32_t len;
-    SSL_read(sock, &len, sizeof(uint32_t));
-    len = ntohl(len);
+    memcpy(msg_buff, p->data, p->len);
+    msg_buff[p->len] = '\0';
 
-    if (len >= sizeof(msg_buff)) {
-        close_socket();
-        throw("Error while receiving message : packet too large (got %d, buffer is %d)", len, sizeof(msg_buff));
+    // Messages of the lobby are still received while in a room
+    if (p->room == current_room) {
+        print_user_msg("%s : %s", get_client_name(p->id), msg_buff);
+    } else if (p->room == LOBBY_ROOM) {
+        print_user_msg("[lobby] %s : %s", get_client_name(p->id), msg_buff);
+    } else {
+        print_user_msg("[#%u] %s : %s", p->room, get_client_name(p->id), msg_buff);
     }
 
-    uint32_t nSSL_read = SSL_read(sock, msg_buff, len);
+    send_notification(get_client_name(p->id), msg_buff);
 
-    if (nSSL_read != len) {
-        close_socket();
-        throw("Error while receiving message : packet size does not match");
-    }    
+}
+
+void handle_direct_message(struct packet *p) {
+
+    if (p->len >= sizeof(msg_buff)) {
+        throw("Error while receiving message : packet too large (got %d, buffer is %d)", p->len, sizeof(msg_buff));
+    }
+
+    memcpy(msg_buff, p->data, p->len);
+    msg_buff[p->len] = '\0';
 
-    print_user_msg("%s : %s", get_client_name(id), msg_buff);
+    print_direct_msg("[from %s] %s", get_client_name(p->id), msg_buff);
 
-    send_notification(get_client_name(id), msg_buff);
+    send_notification(get_client_name(p->id), msg_buff);
 
 }
 
-void handle_system_message() {
+// Print the last messages of a room we joined, without notifications as they were already sent
+void handle_history(struct packet *p) {
 
-    uint32_t len;
-    SSL_read(sock, &len, sizeof(uint32_t));
-    len = ntohl(len);
+    if (p->room == LOBBY_ROOM) {
+        print_system_msg("Last %u messages :", p->id);
+    } else {
+        print_system_msg("Last %u messages of room #%u :", p->id, p->room);
+    }
 
-    if (len >= sizeof(msg_buff)) {
-        close_socket();
-        throw("Error while receiving message : packet too large (got %d, buffer is %d)", len, sizeof(msg_buff));
+    size_t off = 0;
+    uint32_t id;
+    uint32_t name_len;
+    uint32_t msg_len;
+    char *name;
+    char *msg;
+
+    // The sender may have left since, the history carries its name
+    while (packet_next_msg(p, &off, &id, &name, &name_len, &msg, &msg_len)) {
+        if (msg_len >= sizeof(msg_buff)) msg_len = sizeof(msg_buff) - 1;
+        memcpy(msg_buff, msg, msg_len);
+        msg_buff[msg_len] = '\0';
+        print_user_msg("%s : %s", name, msg_buff);
     }
 
-    uint32_t nSSL_read = SSL_read(sock, msg_buff, len);
+}
 
-    if (nSSL_read != len) {
-        close_socket();
-        throw("Error while receiving message : packet size does not match");
-    }    
+void handle_system_message(struct packet *p) {
+
+    if (p->len >= sizeof(msg_buff)) {
+        throw("Error while receiving message : packet too large (got %d, buffer is %d)", p->len, sizeof(msg_buff));
+    }
+
+    memcpy(msg_buff, p->data, p->len);
+    msg_buff[p->len] = '\0';
 
     print_user_msg("%s", msg_buff);
 
     send_notification("CChat", msg_buff);
 }
 
-void handle_new_client() {
+/*
+ * Save the list of users with its version, as the PA_PRESENCE packet to send on the next connection followed by the
+ * PA_USRLIST packet of the users.
+ */
+void save_presence(uint32_t instance, uint64_t version) {
 
-    struct client *c = malloc(sizeof(struct client));
-    SSL_read(sock, &c->id, sizeof(uint32_t));
-    c->id = ntohl(c->id);
-    
+    if (presence_path[0] == '\0') return;
+
+    int fd = open(presence_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return;
+
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        return;
+    }
+
+    uint32_t count = 0;
+    for (struct client *c = clients; c != NULL; c = c->next) count++;
+
+    uint32_t header[7] = {htonl(PA_PRESENCE), htonl(instance), htonl(version >> 32), htonl(version),
+                          htonl(PA_USRLIST), htonl(LOBBY_ROOM), htonl(count)};
+    fwrite(header, sizeof(header), 1, f);
+
+    for (struct client *c = clients; c != NULL; c = c->next) {
+        uint32_t name_len = strlen(c->name) + 1;
+        uint32_t user[2] = {htonl(c->id), htonl(name_len)};
+        fwrite(user, sizeof(user), 1, f);
+        fwrite(c->name, name_len, 1, f);
+    }
+
+    fclose(f);
+
+}
+
+/*
+ * Load the list of users saved by the last connection, and write in `packet` the PA_PRESENCE packet telling its version
+ * to the server. Returns the size of the packet, 0 if there is no list saved.
+ */
+size_t load_presence(char *packet) {
+
+    if (presence_path[0] == '\0') return 0;
+
+    int fd = open(presence_path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct parser saved;
+    parser_init(&saved, MAX_IN_PACKET);
+
+    size_t len;
+    ssize_t n;
+
+    while (true) {
+        char *space = parser_space(&saved, &len);
+        if ((n = read(fd, space, len)) <= 0) break;
+        parser_commit(&saved, n);
+    }
+
+    close(fd);
+
+    struct packet version, list;
+    size_t packet_len = 0;
+
+    if (parser_next(&saved, &version) == 1 && version.pa_num == PA_PRESENCE
+        && parser_next(&saved, &list) == 1 && list.pa_num == PA_USRLIST) {
+
+        size_t off = 0;
+        uint32_t id;
+        uint32_t name_len;
+        char *name;
+
+        while (packet_next_user(&list, &off, &id, &name, &name_len)) {
+            add_client(&clients, id, name, name_len);
+        }
+
+        uint32_t presence_packet[4] = {htonl(PA_PRESENCE), htonl(version.id), htonl(version.version >> 32), htonl(version.version)};
+        memcpy(packet, presence_packet, sizeof(presence_packet));
+        packet_len = sizeof(presence_packet);
+
+    }
+
+    parser_destroy(&saved);
+    return packet_len;
+
+}
+
+// Users displayed : the members of the current room
+struct client *displayed_users() {
+    return current_room == LOBBY_ROOM ? clients : room_members;
+}
+
+void handle_new_client(struct packet *p) {
+
+    if (p->room == LOBBY_ROOM) {
+
+        struct client *c = add_client(&clients, p->id, p->data, p->len);
+
+        display_userlist(displayed_users());
+        print_system_msg("%s joined the chat !", c->name);
+        send_notification(c->name, "joined the chat !");
+
+    } else if (p->room == current_room) {
+
+        struct client *c = add_client(&room_members, p->id, p->data, p->len);
+
+        display_userlist(displayed_users());
+        print_system_msg("%s joined the room !", c->name);
+        send_notification(c->name, "joined the room !");
+
+    }
+
+}
+
+void handle_client_leave(struct packet *p) {
+
+    if (p->room != LOBBY_ROOM && p->room != current_room) return;
+
+    // A user leaving the lobby left the chat, and so every room
+    struct client *member = remove_client(&room_members, p->id);
+    struct client *c = member;
+
+    if (p->room == LOBBY_ROOM) {
+        c = remove_client(&clients, p->id);
+        if (member != NULL) {
+            free(member->name);
+            free(member);
+        }
+    }
+
+    if (c == NULL) {
+        print_system_msg("[ERROR] Error while removing client %d from list", p->id);
+        return;
+    }
+
+    print_system_msg(p->room == LOBBY_ROOM ? "%s left the chat !" : "%s left the room !", c->name);
+    display_userlist(displayed_users());
+
+    send_notification(c->name, p->room == LOBBY_ROOM ? "left the chat !" : "left the room !");
+
+    free(c->name);
+    free(c);
+
+}
+
+/*
+ * Apply the users who joined and left the lobby at once, with a single redraw of the list of users. Users leaving the
+ * lobby leave the current room too. Nothing is displayed if `quiet`, before the interface is initialized.
+ */
+void handle_user_update(struct packet *p, bool quiet) {
+
+    size_t off = 0;
+    uint32_t id;
     uint32_t username_len;
-    SSL_read(sock, &username_len, sizeof(uint32_t));
-    username_len = ntohl(username_len);
-    
-    c->name = malloc(sizeof(char) * username_len);
-    SSL_read(sock, c->name, username_len);
-    
-    c->next = clients;
-    clients = c;
+    char *name;
+    uint32_t joined = 0;
+    uint32_t left = 0;
+    char last[MAX_USERNAME_LENGTH + 1] = "";
 
-    display_userlist(clients);
-    print_system_msg("%s joined the chat !", c->name);
-    send_notification(c->name, "joined the chat !");
+    while (packet_next_user(p, &off, &id, &name, &username_len)) {
+
+        // Users who left have an empty name, and are listed before the ones who joined
+        if (username_len == 0) {
+
+            struct client *member = remove_client(&room_members, id);
+            if (member != NULL) {
+                free(member->name);
+                free(member);
+            }
+
+            // Our own previous connection may be leaving, which is not in the list
+            struct client *c = remove_client(&clients, id);
+            if (c == NULL) continue;
+
+            if (!quiet) print_system_msg("%s left the chat !", c->name);
+            snprintf(last, sizeof(last), "%s", c->name);
+            left++;
+
+            free(c->name);
+            free(c);
+
+        } else {
+
+            struct client *c = add_client(&clients, id, name, username_len);
+
+            if (!quiet) print_system_msg("%s joined the chat !", c->name);
+            snprintf(last, sizeof(last), "%s", c->name);
+            joined++;
+
+        }
+
+    }
+
+    if (quiet || joined + left == 0) return;
+
+    display_userlist(displayed_users());
+
+    if (joined + left == 1) {
+        send_notification(last, joined == 1 ? "joined the chat !" : "left the chat !");
+    } else {
+        snprintf(information_message, sizeof(information_message), "%u users joined the chat and %u left it.", joined, left);
+        send_notification("CChat", information_message);
+    }
 
 }
 
-void handle_client_leave() {
+// Members of a room the user joined
+void handle_user_list(struct packet *p) {
+
+    // Answer to a room the user already left
+    if (p->room != current_room) return;
+
+    free_clients(&room_members);
 
+    size_t off = 0;
     uint32_t id;
-    SSL_read(sock, &id, sizeof(uint32_t));
-    id = ntohl(id);
+    uint32_t username_len;
+    char *name;
+
+    while (packet_next_user(p, &off, &id, &name, &username_len)) {
+        add_client(&room_members, id, name, username_len);
+    }
+
+    display_userlist(displayed_users());
+    print_system_msg("You joined room #%u, with %u other users.", p->room, p->id);
+
+}
+
+// Find a connected user by its name, or NULL if no user has this name
+struct client *find_client(const char *name) {
 
-    // Remove client from list
     struct client *c = clients;
-    struct client *next = c->next;
 
-    if (c->id == id) {
-        clients = next;
-    } else {
+    while (c != NULL && strcmp(c->name, name) != 0) {
+        c = c->next;
+    }
 
-        while(next != NULL && next->id != id) {
-            c = next;
-            next = next->next;
-        }
+    return c;
+
+}
+
+// Send a message to a single user, "/msg NAME MESSAGE"
+void send_direct_message(char *args) {
+
+    char *msg = strchr(args, ' ');
+    if (msg == NULL || msg[1] == '\0') {
+        print_system_msg("Usage : /msg USERNAME MESSAGE");
+        return;
+    }
+    *msg++ = '\0';
+
+    struct client *c = find_client(args);
+    if (c == NULL) {
+        print_system_msg("Unknown user %s", args);
+        return;
+    }
+
+    int msg_len = strlen(msg) + 1;
+
+    uint32_t msg_packet[3] = {htonl(PA_DM), htonl(c->id), htonl(msg_len)};
+    SSL_write(sock, msg_packet, sizeof(msg_packet));
+    SSL_write(sock, msg, msg_len);
+
+    print_direct_msg("[to %s] %s", c->name, msg);
+
+}
+
+// Monotonic time in microseconds
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Send a PA_PING or PA_PONG packet with its token
+void send_ping(uint32_t pa_num, uint64_t token) {
+    uint32_t packet[3] = {htonl(pa_num), htonl(token >> 32), htonl(token & UINT32_MAX)};
+    SSL_write(sock, packet, sizeof(packet));
+}
+
+// Our pings hold the time they were sent. Any answer tells the server is still there.
+void handle_pong(struct packet *p) {
+    pending_ping = 0;
+    display_rtt((now_us() - p->version) / 1000.0);
+}
+
+void send_room_packet(uint32_t pa_num, uint32_t room) {
+    uint32_t packet[2] = {htonl(pa_num), htonl(room)};
+    SSL_write(sock, packet, sizeof(packet));
+}
+
+// Move to another room, leaving the current one. The lobby is never left.
+void change_room(uint32_t room) {
+
+    if (room == current_room) return;
+
+    if (current_room != LOBBY_ROOM) send_room_packet(PA_LEAVEROOM, current_room);
+    if (room != LOBBY_ROOM) send_room_packet(PA_JOINROOM, room);
+
+    current_room = room;
+    free_clients(&room_members);
+    display_userlist(displayed_users());
+
+    if (room == LOBBY_ROOM) print_system_msg("Back to the lobby.");
+
+}
+
+/*
+ * Handle the commands typed by the user : "/join ROOM", "/leave" and "/msg USERNAME MESSAGE".
+ * Returns false if the input is a message to send.
+ */
+bool handle_command(char *input) {
+
+    if (strcmp(input, "/leave") == 0) {
+        change_room(LOBBY_ROOM);
+        return true;
+    }
 
-        if (next == NULL) {
-            print_system_msg("[ERROR] Error while removing client %d from list", id);
-            return;
+    if (strncmp(input, "/msg ", 5) == 0) {
+        send_direct_message(input + 5);
+        return true;
+    }
+
+    if (strncmp(input, "/join ", 6) == 0) {
+
+        char *endptr;
+        unsigned long room = strtoul(input + 6, &endptr, 10);
+
+        if (endptr == input + 6 || *endptr != '\0' || room > UINT32_MAX) {
+            print_system_msg("Usage : /join ROOM, where ROOM is a number (0 for the lobby)");
+        } else {
+            change_room(room);
         }
 
-        c->next = next->next;
-        c = next;
+        return true;
 
     }
 
-    print_system_msg("%s left the chat !", c->name);
-    display_userlist(clients);
+    return false;
 
-    send_notification(c->name, "left the chat !");
+}
 
-    free(c->name);
-    free(c);
+// Read the data available from the server. Returns false if the connection is closed.
+bool receive_data() {
+
+    size_t space;
+    char *buff = parser_space(&in, &space);
+
+    int nread = SSL_read(sock, buff, space);
+    if (nread <= 0) return false;
+
+    parser_commit(&in, nread);
+    return true;
 
 }
 
-void handle_receive() {
+/*
+ * Parse the next complete packet received, like parser_next. Compressed packets are replaced by the packets they hold.
+ */
+int next_packet(struct packet *p) {
+
+    int res = parser_next(&unpacked, p);
+    if (res != 0) return res;
+
+    // A compressed packet only holds complete packets
+    if (parser_pending(&unpacked) > 0) return -1;
+    parser_release(&unpacked);
+
+    res = parser_next(&in, p);
+    if (res <= 0 || p->pa_num != PA_COMPRESSED) return res;
+
+    if (p->id > MAX_IN_PACKET) return -1;
+    char *out = parser_reserve(&unpacked, p->id);
+    if (!decompress_packet(&inflater, p->data, p->len, out, p->id)) return -1;
+    parser_commit(&unpacked, p->id);
 
-    uint32_t resp;
-    size_t nread = 0;
+    res = parser_next(&unpacked, p);
+    return res == 0 ? -1 : res;
 
-    nread = SSL_read(sock, &resp, sizeof(uint32_t));
-    resp = ntohl(resp);
+}
+
+/*
+ * Wait for the next packet from the server, used before the chat is displayed.
+ * The packet is valid until the next read from the server.
+ */
+void receive_packet(struct packet *p) {
+
+    int res;
 
-    if (nread != sizeof(uint32_t)) {
+    while ((res = next_packet(p)) == 0) {
+        if (!receive_data()) {
+            fprintf(stderr, "Server connection lost.\n");
+            close_socket();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (res < 0) {
+        fprintf(stderr, "Error : invalid packet received.\n");
         close_socket();
-        throw("Error while reading packet number (read %d instead of %d)", nread, sizeof(uint32_t));
+        exit(EXIT_FAILURE);
     }
 
-    switch (resp) {
+}
 
-        case PA_MSG:
-            handle_client_message();
-            return;
+void invalid_packet(uint32_t pa_num) {
+    print_system_msg("[ERROR] Wrong packet received : %d. Quitting in 5 seconds ...", pa_num);
+    sleep(5);
+    destroy_gui();
+    close_socket();
+    fprintf(stderr, "Error : wrong packet received.\n");
+    exit(EXIT_SUCCESS);
+}
 
-        case PA_SYS:
-            handle_system_message();
-            return;
-        
-        case PA_USRJOIN:
-            handle_new_client();
-            return;
+// Handle all the complete packets received
+void handle_packets() {
 
-        case PA_USRLEAVE:
-            handle_client_leave();
-            return;
-        
-        default:
-            print_system_msg("[ERROR] Wrong packet received : %d. Quitting in 5 seconds ...", resp);
+    struct packet p;
+    int res;
+
+    while ((res = next_packet(&p)) > 0) {
+
+        switch (p.pa_num) {
+
+            case PA_MSG:
+                handle_client_message(&p);
+                break;
+
+            case PA_DM:
+                handle_direct_message(&p);
+                break;
+
+            case PA_SYS:
+                handle_system_message(&p);
+                break;
+
+            case PA_USRJOIN:
+                handle_new_client(&p);
+                break;
+
+            case PA_USRLEAVE:
+                handle_client_leave(&p);
+                break;
+
+            case PA_USRLIST:
+                handle_user_list(&p);
+                break;
+
+            case PA_USRUPDATE:
+                handle_user_update(&p, false);
+                break;
+
+            case PA_HISTORY:
+                handle_history(&p);
+                break;
+
+            case PA_PING:
+                send_ping(PA_PONG, p.version);
+                break;
+
+            case PA_PONG:
+                handle_pong(&p);
+                break;
+
+            default:
+                invalid_packet(p.pa_num);
+        }
+
+    }
+
+    if (res < 0) invalid_packet(p.pa_num);
+
+}
+
+void handle_receive() {
+
+    // Records already decrypted by OpenSSL are not reported by poll, read them too
+    do {
+        if (!receive_data()) {
+            print_system_msg("Connection lost. Quitting in 5 seconds ...");
             sleep(5);
             destroy_gui();
             close_socket();
-            fprintf(stderr, "Error : wrong packet received.\n");
+            fprintf(stderr, "Server connection lost.\n");
             exit(EXIT_SUCCESS);
-    }
+        }
+    } while (SSL_pending(sock) > 0);
+
+    handle_packets();
 
 }
 
@@ -376,80 +893,84 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    uint32_t resp;
-    SSL_read(sock, &resp, sizeof(uint32_t));
-    resp = ntohl(resp);
+    parser_init(&in, MAX_IN_PACKET);
+    parser_init(&unpacked, MAX_IN_PACKET);
+    decompress_init(&inflater);
+
+    struct packet p;
+    receive_packet(&p);
 
-    if (resp == PA_ERRMAXCONN) {
+    if (p.pa_num == PA_ERRMAXCONN) {
         printf("Server refused connection : max number of connections reached.");
         return EXIT_SUCCESS;
     }
 
-    if (resp != PA_CONNACCEPT) {
-        printf("Error while SSL_reading server response : got packet number %d\n", resp);
+    if (p.pa_num != PA_CONNACCEPT) {
+        printf("Error while SSL_reading server response : got packet number %d\n", p.pa_num);
         return EXIT_FAILURE;
     }
 
-    // Send username information
+    // Send username information, after the capabilities of the server we support : large packets may be compressed,
+    // and after the version of the list of users we had, if any.
+    // All the packets are written at once, so that the username is not held back until the server acknowledges the first.
+    uint32_t caps = p.id & (CAP_DEFLATE | CAP_DICT);
+    uint32_t caps_packet[2] = {htonl(PA_CAPS), htonl(caps)};
     uint32_t username_packet[2] = {htonl(PA_USERNAME), htonl(username_length + 1)};
-    SSL_write(sock, username_packet, 2 * sizeof(uint32_t));
-    SSL_write(sock, username, username_length + 1);
+    char hello[sizeof(caps_packet) + 4 * sizeof(uint32_t) + sizeof(username_packet) + MAX_USERNAME_LENGTH + 1];
+
+    size_t hello_len = sizeof(caps_packet);
+    memcpy(hello, caps_packet, sizeof(caps_packet));
+    hello_len += load_presence(hello + hello_len);
+    memcpy(hello + hello_len, username_packet, sizeof(username_packet));
+    memcpy(hello + hello_len + sizeof(username_packet), username, username_length + 1);
+    SSL_write(sock, hello, hello_len + sizeof(username_packet) + username_length + 1);
 
 
     // Read server response
-    SSL_read(sock, &resp, sizeof(uint32_t));
-    resp = ntohl(resp);
+    receive_packet(&p);
 
-    switch (resp) {
+    switch (p.pa_num) {
         case PA_ERRNAME:
             printf("Error : Username alSSL_ready taken\n");
             return EXIT_FAILURE;
         
         case PA_USERID:
-            SSL_read(sock, &client_id, sizeof(uint32_t));
-            client_id = ntohl(client_id);
+            client_id = p.id;
             break;
         
         default:
-            printf("Invalid response from server : %d\n", resp);
+            printf("Invalid response from server : %d\n", p.pa_num);
             return EXIT_FAILURE;
     }
 
-    // Read users list
-
-    SSL_read(sock, &resp, sizeof(uint32_t));
-    resp = ntohl(resp);
-
-    if (resp != PA_USRLIST) {
-        printf("Error while SSL_reading user list : %d\n", resp);
-        return EXIT_FAILURE;
-    }
-
-    uint32_t num_clients;
-    SSL_read(sock, &num_clients, sizeof(uint32_t));
-    num_clients = ntohl(num_clients);
+    // Read users list : the whole list, or the users who joined and left since the version of the list we had,
+    // until the version of the list we got
+    for (receive_packet(&p); p.pa_num != PA_PRESENCE; receive_packet(&p)) {
 
-    for (uint32_t i = 0; i < num_clients; i++) {
+        if (p.pa_num == PA_USRLIST && p.room == LOBBY_ROOM) {
 
-        uint32_t id;
-        uint32_t username_len;
-
-        struct client *c = malloc(sizeof(struct client));
+            free_clients(&clients);
 
-        SSL_read(sock, &id, sizeof(uint32_t));
-        SSL_read(sock, &username_len, sizeof(uint32_t));
-        id = ntohl(id);
-        username_len = ntohl(username_len);
+            size_t off = 0;
+            uint32_t id;
+            uint32_t username_len;
+            char *name;
 
-        c->id = id;
-        c->name = malloc(sizeof(char) * username_len);
-        SSL_read(sock, c->name, username_len);
+            while (packet_next_user(&p, &off, &id, &name, &username_len)) {
+                add_client(&clients, id, name, username_len);
+            }
 
-        c->next = clients;
-        clients = c;
+        } else if (p.pa_num == PA_USRUPDATE && p.room == LOBBY_ROOM) {
+            handle_user_update(&p, true);
+        } else {
+            printf("Error while SSL_reading user list : %d\n", p.pa_num);
+            return EXIT_FAILURE;
+        }
 
     }
 
+    save_presence(p.id, p.version);
+
     init_gui(MAX_MSG_LENGTH - 1);
 
     // Init notifications
@@ -459,9 +980,13 @@ int main(int argc, char* argv[]) {
 
     display_userlist(clients);
 
-    sprintf(information_message, "Connected to %s on port %s as %s !\n", argv[2], (port == -1 ? DEFAULT_PORT_STR : argv[3]), argv[1]);
+    sprintf(information_message, "Connected to %s on port %s as %s%s !\n", argv[2], (port == -1 ? DEFAULT_PORT_STR : argv[3]), argv[1],
+            SSL_session_reused(sock) ? " (session resumed)" : "");
     print_system_msg(information_message);
 
+    // Packets received along with the user list
+    handle_packets();
+
     struct pollfd *fds = malloc(sizeof(struct pollfd) * 2);
 
     fds[0].fd = STDIN_FILENO;
@@ -474,7 +999,25 @@ int main(int argc, char* argv[]) {
 
     while (true) {
 
-        poll_res = poll(fds, 2, -1);
+        // Ping the server regularly, to show the round-trip time and to notice when the connection is lost
+        uint64_t now = now_us();
+
+        if (pending_ping != 0 && now - pending_ping >= PING_TIMEOUT * 1000ULL) {
+            print_system_msg("Connection lost. Quitting in 5 seconds ...");
+            sleep(5);
+            destroy_gui();
+            close_socket();
+            fprintf(stderr, "Server connection lost : ping timed out.\n");
+            return EXIT_SUCCESS;
+        }
+
+        if (now - last_ping >= PING_INTERVAL * 1000ULL) {
+            send_ping(PA_PING, now);
+            last_ping = now;
+            if (pending_ping == 0) pending_ping = now;
+        }
+
+        poll_res = poll(fds, 2, (last_ping + PING_INTERVAL * 1000ULL - now) / 1000 + 1);
 
         if (poll_res < 0 && errno != EINTR) {
             destroy_gui();
@@ -498,11 +1041,11 @@ int main(int argc, char* argv[]) {
 
             char *msg = process_input();
 
-            if (msg != NULL) {
+            if (msg != NULL && !handle_command(msg)) {
 
                 int msg_len = strlen(msg) + 1;
 
-                uint32_t msg_packet[3] = {htonl(PA_MSG), 0, htonl(msg_len)};
+                uint32_t msg_packet[4] = {htonl(PA_MSG), htonl(current_room), 0, htonl(msg_len)};
                 SSL_write(sock, msg_packet, sizeof(msg_packet));
                 SSL_write(sock, msg, msg_len);
 
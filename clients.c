@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <string.h>
+#include "clients.h"
+
+struct client *add_client(struct client **list, uint32_t id, const char *name, uint32_t name_len) {
+
+    struct client *c = malloc(sizeof(struct client));
+    c->id = id;
+    c->name = malloc(sizeof(char) * (name_len + 1));
+    memcpy(c->name, name, name_len);
+    c->name[name_len] = '\0';
+
+    c->next = *list;
+    *list = c;
+
+    return c;
+
+}
+
+struct client *remove_client(struct client **list, uint32_t id) {
+
+    struct client **prev = list;
+
+    while (*prev != NULL && (*prev)->id != id) {
+        prev = &(*prev)->next;
+    }
+
+    struct client *c = *prev;
+    if (c != NULL) *prev = c->next;
+
+    return c;
+
+}
+
+struct client *find_client_id(struct client *list, uint32_t id) {
+
+    struct client *c = list;
+
+    while (c != NULL && c->id != id) {
+        c = c->next;
+    }
+
+    return c;
+
+}
+
+void free_clients(struct client **list) {
+    while (*list != NULL) {
+        struct client *c = *list;
+        *list = c->next;
+        free(c->name);
+        free(c);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef DEF_CLIENTS
+#define DEF_CLIENTS
+
+#include <stdint.h>
+#include "client.h"
+
+// Add a user to a list of clients
+struct client *add_client(struct client **list, uint32_t id, const char *name, uint32_t name_len);
+
+// Remove a user from a list of clients. Returns the user, to be freed by the caller, or NULL if it is not in the list.
+struct client *remove_client(struct client **list, uint32_t id);
+
+// Find a user of a list of clients by its id, or NULL if it is not in the list
+struct client *find_client_id(struct client *list, uint32_t id);
+
+void free_clients(struct client **list);
+
+#endif
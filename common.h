@@ -4,6 +4,9 @@
 #define MAX_USERNAME_LENGTH 16
 #define MAX_MSG_LENGTH 256
 
+// Room every connected user is in
+#define LOBBY_ROOM 0
+
 #define UTF8_SEQUENCE_MAXLEN 6
 
 #define SSL_SERVER_HOSTNAME "cchat"
@@ -0,0 +1,67 @@
+#include <string.h>
+#include "compress.h"
+
+/*
+ * Preset dictionary. Deflate refers to its end with the shortest distances, so the most common strings come last :
+ * username parts, then chat phrases, then the lengths of the strings of the lists of users and of the history.
+ */
+static const char dict[] =
+    "alexandrebenjaminchristopherelizabethjenniferjonathanmargaretmichaelnicholasstephanievictoriawilliam"
+    "annabobcarolchrisdaviddavedanemmaericfrankgracehannahjackjamesjohnjuliekatelauraleolucasmariemax"
+    "nathanoliviapaulpierrerachelsamsarahsophietomthomasadminbotdevtestguestplayergamerdarkshadowmaster"
+    "ninjakingqueenwolfdragoncatdogfoxcoolprorealofficial_x_123_01_99_2000_42"
+    "https://www..com.org.fr.io/ :) :( :D ;) xD <3 ^^ lol mdr ok okay yes yeah no nope thanks thank you "
+    "please sorry welcome hello hi hey everyone guys all good morning good night bye see you later "
+    "what do you think? how are you? I'm fine I think I don't know it's that is this the and of to in for on "
+    "with have just not but you are we can will was at be what when where why who how\n"
+    "\0\0\0\x04\0\0\0\x05\0\0\0\x06\0\0\0\x07\0\0\0\x08\0\0\0\x09\0\0\0\x0a\0\0\0\x0b\0\0\0\x0c\0\0\0\x0d"
+    "\0\0\0\x0e\0\0\0\x0f\0\0\0\x10\0\0\0\x14\0\0\0\x20\0\0\0\x40\0\0\0\x80\0\0\0\x00";
+
+void compress_init(z_stream *zs) {
+    memset(zs, 0, sizeof(z_stream));
+    deflateInit(zs, COMPRESS_LEVEL);
+}
+
+void decompress_init(z_stream *zs) {
+    memset(zs, 0, sizeof(z_stream));
+    inflateInit(zs);
+}
+
+size_t compress_bound(size_t len) {
+    return compressBound(len);
+}
+
+size_t compress_packet(z_stream *zs, bool use_dict, const char *data, size_t len, char *out) {
+
+    deflateReset(zs);
+    if (use_dict) deflateSetDictionary(zs, (const Bytef *) dict, sizeof(dict) - 1);
+
+    zs->next_in = (Bytef *) data;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *) out;
+    zs->avail_out = compress_bound(len);
+
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END || zs->total_out >= len) return 0;
+    return zs->total_out;
+
+}
+
+bool decompress_packet(z_stream *zs, const char *data, size_t len, char *out, size_t out_len) {
+
+    inflateReset(zs);
+
+    zs->next_in = (Bytef *) data;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *) out;
+    zs->avail_out = out_len;
+
+    // The stream tells if it was compressed with the dictionary
+    int ret = inflate(zs, Z_FINISH);
+    if (ret == Z_NEED_DICT) {
+        if (inflateSetDictionary(zs, (const Bytef *) dict, sizeof(dict) - 1) != Z_OK) return false;
+        ret = inflate(zs, Z_FINISH);
+    }
+
+    return ret == Z_STREAM_END && zs->total_out == out_len && zs->avail_in == 0;
+
+}
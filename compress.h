@@ -0,0 +1,35 @@
+#ifndef DEF_COMPRESS
+#define DEF_COMPRESS
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+/*
+ * Compression of the large packets, such as the list of users or the history of a room, for the clients supporting it.
+ *
+ * Packets are compressed one at a time with deflate, in the zlib format. A preset dictionary of common username parts
+ * and chat phrases, built into both the client and the server, may be used : it mostly helps the packets too short for
+ * deflate to find much repetition in them.
+ */
+
+// Compression level, favoring speed as a list of users is compressed for every user joining
+#define COMPRESS_LEVEL 1
+
+void compress_init(z_stream *zs);
+
+void decompress_init(z_stream *zs);
+
+// Size of the buffer needed to compress `len` bytes
+size_t compress_bound(size_t len);
+
+/*
+ * Compress a packet into `out`, of compress_bound(len) bytes.
+ * Returns the size of the compressed packet, or 0 if it would not be smaller than the packet.
+ */
+size_t compress_packet(z_stream *zs, bool dict, const char *data, size_t len, char *out);
+
+// Decompress a packet of `out_len` bytes. Returns false if the data is invalid or does not have this size.
+bool decompress_packet(z_stream *zs, const char *data, size_t len, char *out, size_t out_len);
+
+#endif
@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "epoch.h"
+
+#define ACTIVE 1u
+
+struct epoch_garbage {
+    void *ptr;
+    void (*free_fn)(void *);
+    uint64_t epoch;
+    struct epoch_garbage *next;
+};
+
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(struct epoch_thread *) threads = NULL;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void epoch_register(struct epoch_thread *t) {
+
+    atomic_init(&t->state, 0);
+    t->garbage = NULL;
+    t->garbage_last = NULL;
+
+    pthread_mutex_lock(&register_lock);
+    t->next = atomic_load_explicit(&threads, memory_order_relaxed);
+    atomic_store_explicit(&threads, t, memory_order_release);
+    pthread_mutex_unlock(&register_lock);
+
+}
+
+void epoch_enter(struct epoch_thread *t) {
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    atomic_store_explicit(&t->state, (epoch << 1) | ACTIVE, memory_order_relaxed);
+    // The thread must be seen as active before it reads any shared pointer
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(struct epoch_thread *t) {
+    atomic_store_explicit(&t->state, 0, memory_order_release);
+}
+
+void epoch_retire(struct epoch_thread *t, void *ptr, void (*free_fn)(void *)) {
+
+    struct epoch_garbage *g = malloc(sizeof(struct epoch_garbage));
+    g->ptr = ptr;
+    g->free_fn = free_fn;
+    g->epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+    g->next = NULL;
+
+    if (t->garbage_last != NULL) t->garbage_last->next = g;
+    else t->garbage = g;
+    t->garbage_last = g;
+
+}
+
+// The global epoch can advance once every active thread observed it
+static void try_advance() {
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+
+    for (struct epoch_thread *t = atomic_load_explicit(&threads, memory_order_acquire); t != NULL; t = t->next) {
+        uint64_t state = atomic_load_explicit(&t->state, memory_order_acquire);
+        if ((state & ACTIVE) && (state >> 1) != epoch) return;
+    }
+
+    atomic_compare_exchange_strong_explicit(&global_epoch, &epoch, epoch + 1, memory_order_acq_rel, memory_order_relaxed);
+
+}
+
+void epoch_poll(struct epoch_thread *t) {
+
+    if (t->garbage == NULL) return;
+
+    try_advance();
+
+    // Readers that could see an object retired during epoch E are all gone once the global epoch reached E + 2
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+
+    while (t->garbage != NULL && t->garbage->epoch + 2 <= epoch) {
+        struct epoch_garbage *g = t->garbage;
+        t->garbage = g->next;
+        g->free_fn(g->ptr);
+        free(g);
+    }
+
+    if (t->garbage == NULL) t->garbage_last = NULL;
+
+}
@@ -0,0 +1,39 @@
+#ifndef DEF_EPOCH
+#define DEF_EPOCH
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Epoch-based memory reclamation.
+ *
+ * Threads reading shared structures without a lock do it inside critical sections (epoch_enter / epoch_exit).
+ * Writers unlink objects from the shared structures, then retire them : a retired object is only freed once every
+ * thread that could still be reading it left its critical section, which is detected by advancing a global epoch.
+ * Each thread using the structures must be registered, and must call epoch_poll regularly to free its retired objects.
+ */
+
+struct epoch_garbage;
+
+struct epoch_thread {
+    atomic_uint_fast64_t state;         // Epoch observed when entering the current critical section, shifted, plus an active bit
+    struct epoch_garbage *garbage;      // Objects retired by the thread, oldest first
+    struct epoch_garbage *garbage_last;
+    struct epoch_thread *next;
+};
+
+// Register a thread. Must be called before the thread enters a critical section.
+void epoch_register(struct epoch_thread *t);
+
+void epoch_enter(struct epoch_thread *t);
+
+void epoch_exit(struct epoch_thread *t);
+
+// Free `ptr` with `free_fn` once no thread can be reading it anymore
+void epoch_retire(struct epoch_thread *t, void *ptr, void (*free_fn)(void *));
+
+// Try to advance the global epoch, and free the objects retired by the thread that are not reachable anymore
+void epoch_poll(struct epoch_thread *t);
+
+#endif
@@ -0,0 +1,28 @@
+#include <stdlib.h>
+#include <string.h>
+#include "frame.h"
+
+struct frame *frame_alloc(uint32_t pa_num, size_t len) {
+    struct frame *f = malloc(sizeof(struct frame) + len);
+    atomic_init(&f->refs, 1);
+    f->pa_num = pa_num;
+    f->count = 1;
+    f->len = len;
+    return f;
+}
+
+struct frame *frame_new(uint32_t pa_num, const void *header, size_t header_len, const void *payload, size_t payload_len) {
+    struct frame *f = frame_alloc(pa_num, header_len + payload_len);
+    memcpy(f->data, header, header_len);
+    if (payload_len > 0) memcpy(f->data + header_len, payload, payload_len);
+    return f;
+}
+
+struct frame *frame_ref(struct frame *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    return f;
+}
+
+void frame_release(struct frame *f) {
+    if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) free(f);
+}
@@ -0,0 +1,33 @@
+#ifndef DEF_FRAME
+#define DEF_FRAME
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Encoded packet, ready to be written to a connection.
+ * A frame is immutable once built and reference counted, so that the same frame can be queued on every connection
+ * it is sent to.
+ */
+struct frame {
+    atomic_int refs;
+    uint32_t pa_num;
+    uint32_t count;     // Number of packets in the frame, more than one for a batch of messages
+    size_t len;
+    char data[];
+};
+
+// Allocate a frame of `len` bytes, to be filled by the caller. The caller holds the only reference.
+struct frame *frame_alloc(uint32_t pa_num, size_t len);
+
+// Build a frame made of a header followed by a payload
+struct frame *frame_new(uint32_t pa_num, const void *header, size_t header_len, const void *payload, size_t payload_len);
+
+// Take a new reference on a frame
+struct frame *frame_ref(struct frame *f);
+
+// Release a reference, the frame is freed with its last reference
+void frame_release(struct frame *f);
+
+#endif
@@ -189,6 +189,7 @@ void init_gui(int msg_maxlength) {
         use_default_colors();
         start_color();
         init_pair(1, COLOR_BLUE, -1);
+        init_pair(2, COLOR_MAGENTA, -1);
     }
 
     chat_win = subwin(stdscr, LINES - 5, COLS - 18, 1, 1);
@@ -247,6 +248,18 @@ void print_system_msg(char *msg, ...) {
     wrefresh(input_win);
 }
 
+void print_direct_msg(char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    wattron(chat_win, COLOR_PAIR(2));
+    wprintw(chat_win, "\n");
+    vw_printw(chat_win, msg, args);
+    wattroff(chat_win, COLOR_PAIR(2));
+    wrefresh(chat_win);
+    wmove(input_win, 0, cursor_pos);
+    wrefresh(input_win);
+}
+
 void display_userlist(struct client *clients) {
 
     wclear(users_win);
@@ -266,6 +279,18 @@ void display_userlist(struct client *clients) {
 
 }
 
+void display_rtt(double rtt) {
+
+    // Written over the bottom border of the chat window
+    for (int i = 2; i < 24 && i < COLS - 17; i++) mvaddwstr(LINES - 4, i, L"═");
+    mvprintw(LINES - 4, 2, " Ping : %.1f ms ", rtt);
+
+    refresh();
+    wmove(input_win, 0, cursor_pos);
+    wrefresh(input_win);
+
+}
+
 /*
  * Processes input from the user. If the user submitted its input by pressing ENTER, returns a buffer containing the message, otherwise returns NULL.
 */
@@ -12,6 +12,15 @@
 void init_gui();
 void destroy_gui();
 
+// Line being typed, kept as a zipper : the characters left of the cursor, and the ones right of it
+void init_zipper(int max_length);
+void zip_move_left();
+void zip_move_right();
+void zip_add_char(int ch);
+void zip_del_char();
+void zip_del_char_right();
+void zip_clear();
+
 /*
  * Processes input from the user. If the user submitted its input by pressing ENTER, returns a buffer containing the message, otherwise returns NULL.
 */
@@ -23,6 +32,12 @@ void print_user_msg(char *msg, ...);
 // Print a system message in the chat window
 void print_system_msg(char *msg, ...);
 
+// Print a direct message, sent or received, in the chat window
+void print_direct_msg(char *msg, ...);
+
 void display_userlist(struct client *clients);
 
+// Display the round-trip time to the server (milliseconds)
+void display_rtt(double rtt);
+
 #endif
\ No newline at end of file
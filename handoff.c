@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "handoff.h"
+
+static int set_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+
+    struct sockaddr_un addr;
+    if (set_address(&addr, path) != 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    // Only the user running the server may take it over
+    unlink(path);
+    mode_t mask = umask(0077);
+    int res = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+
+    if (res != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+
+}
+
+int handoff_connect(const char *path) {
+
+    struct sockaddr_un addr;
+    if (set_address(&addr, path) != 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+
+}
+
+static int send_iov(int sock, struct iovec *iov, int iovcnt, int fd) {
+
+    union {
+        struct cmsghdr header;
+        char buff[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buff;
+        msg.msg_controllen = sizeof(control.buff);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+
+    return n == -1 ? -1 : 0;
+
+}
+
+int handoff_send(int sock, const void *rec, size_t len, int fd) {
+    struct iovec iov = {(void *) rec, len};
+    return send_iov(sock, &iov, 1, fd);
+}
+
+int handoff_send_data(int sock, uint32_t type, const char *data, size_t len) {
+
+    const size_t chunk = HANDOFF_MAX_RECORD - sizeof(struct handoff_data);
+
+    for (size_t off = 0; off < len; off += chunk) {
+        struct iovec iov[2] = {
+            {&type, sizeof(type)},
+            {(void *) (data + off), len - off < chunk ? len - off : chunk}
+        };
+        if (send_iov(sock, iov, 2, -1) != 0) return -1;
+    }
+
+    return 0;
+
+}
+
+ssize_t handoff_recv(int sock, void *rec, size_t len, int *fd) {
+
+    union {
+        struct cmsghdr header;
+        char buff[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct iovec iov = {rec, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buff;
+    msg.msg_controllen = sizeof(control.buff);
+
+    *fd = -1;
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    if (n < 0) return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    // A truncated record would be misread
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return n;
+
+}
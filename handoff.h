@@ -0,0 +1,86 @@
+#ifndef DEF_HANDOFF
+#define DEF_HANDOFF
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "common.h"
+#include "tickets.h"
+
+/*
+ * Hand-off of a running server to a new process replacing it, without closing its connections.
+ *
+ * The running server listens on a Unix socket. A new server started with the same socket path connects to it and
+ * sends a HO_HELLO record : the running server stops serving, sends it its state as a sequence of records, along with
+ * its listening sockets and the connections of its users, then exits. The new server takes over the sockets, then
+ * listens on the path in turn for the next restart.
+ *
+ * The state is sent as HO_TICKETS, a HO_LISTENER per listening socket, a HO_CLIENT or HO_GONE per user, each HO_CLIENT
+ * followed by the HO_INPUT and HO_OUTPUT records of its connection, and finally HO_END.
+ *
+ * Records are the datagrams of a SOCK_SEQPACKET socket, each carrying at most one file descriptor. Both processes must
+ * run the same version of the server, as records are sent as they are in memory.
+ */
+
+// Changed whenever the records change
+#define HANDOFF_VERSION 1
+
+// Largest record, data is split in records of at most this size
+#define HANDOFF_MAX_RECORD (32 * 1024)
+
+enum handoff_type {
+    HO_HELLO,       // Version of the new process
+    HO_TICKETS,     // Keys of the TLS session tickets
+    HO_LISTENER,    // Listening socket
+    HO_CLIENT,      // Connection of a user, with its id, name and rooms
+    HO_GONE,        // User whose connection could not be handed off, without a socket
+    HO_INPUT,       // Data received from the last user but not handled yet
+    HO_OUTPUT,      // Data queued for the last user but not written yet
+    HO_END,         // Last record
+};
+
+struct handoff_hello {
+    uint32_t type;
+    uint32_t version;
+};
+
+struct handoff_tickets {
+    uint32_t type;
+    unsigned char keys[TICKET_KEYS_SIZE];
+};
+
+// Connection of a user, followed by the ids of the rooms it joined
+struct handoff_client {
+    uint32_t type;
+    uint32_t id;
+    uint32_t caps;
+    char name[MAX_USERNAME_LENGTH + 1];
+    uint32_t nb_rooms;
+    uint32_t rooms[];
+};
+
+// HO_INPUT or HO_OUTPUT
+struct handoff_data {
+    uint32_t type;
+    char data[];
+};
+
+// Listen for a new process on the Unix socket at `path`, removing a previous socket. Returns -1 on failure.
+int handoff_listen(const char *path);
+
+// Connect to the server listening at `path`. Returns -1 if none is running.
+int handoff_connect(const char *path);
+
+// Send a record, with a file descriptor or -1. Returns -1 on failure.
+int handoff_send(int sock, const void *rec, size_t len, int fd);
+
+// Send a record of type HO_INPUT or HO_OUTPUT, split if it is too large. Returns -1 on failure.
+int handoff_send_data(int sock, uint32_t type, const char *data, size_t len);
+
+/*
+ * Receive a record in `rec`, of at most `len` bytes, and in `fd` its file descriptor or -1.
+ * Returns the length of the record, 0 if the other process closed the connection, or -1 on failure.
+ */
+ssize_t handoff_recv(int sock, void *rec, size_t len, int *fd);
+
+#endif
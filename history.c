@@ -0,0 +1,75 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+void history_init(struct history *h, uint32_t size) {
+    h->size = size;
+    atomic_init(&h->head, 0);
+    h->entries = size == 0 ? NULL : calloc(size, sizeof(struct history_entry *));
+}
+
+void history_destroy(struct history *h) {
+    for (uint32_t i = 0; i < h->size; i++) {
+        struct history_entry *e = atomic_load_explicit(&h->entries[i], memory_order_relaxed);
+        if (e != NULL) history_free_entry(e);
+    }
+    free(h->entries);
+    h->entries = NULL;
+    h->size = 0;
+}
+
+struct history_entry *history_add(struct history *h, struct frame *f, const char *name, uint64_t *n) {
+
+    *n = atomic_fetch_add_explicit(&h->head, 1, memory_order_relaxed);
+    if (h->size == 0) return NULL;
+
+    struct history_entry *e = malloc(sizeof(struct history_entry));
+    e->n = *n;
+    e->frame = frame_ref(f);
+    strncpy(e->name, name, MAX_USERNAME_LENGTH);
+    e->name[MAX_USERNAME_LENGTH] = '\0';
+
+    // Two writers may race for the same slot if the history wraps around meanwhile : the newer message must win, as
+    // readers wait for each slot to hold the message they expect or a newer one
+    _Atomic(struct history_entry *) *slot = &h->entries[e->n % h->size];
+    struct history_entry *old = atomic_load_explicit(slot, memory_order_acquire);
+    do {
+        if (old != NULL && old->n > e->n) return e;
+    } while (!atomic_compare_exchange_weak_explicit(slot, &old, e, memory_order_acq_rel, memory_order_acquire));
+
+    return old;
+
+}
+
+void history_free_entry(void *entry) {
+    struct history_entry *e = entry;
+    frame_release(e->frame);
+    free(e);
+}
+
+uint32_t history_read(struct history *h, struct history_entry **entries, uint64_t *head) {
+
+    *head = atomic_load_explicit(&h->head, memory_order_acquire);
+    if (h->size == 0) return 0;
+
+    uint64_t first = *head > h->size ? *head - h->size : 0;
+    uint32_t count = 0;
+
+    for (uint64_t n = first; n < *head; n++) {
+
+        // The slot still holds an older message while the writer of this one is adding it, which does not take long
+        struct history_entry *e;
+        while ((e = atomic_load_explicit(&h->entries[n % h->size], memory_order_acquire)) == NULL || e->n < n) {
+            sched_yield();
+        }
+
+        // A newer message replaced it meanwhile : the ones read before are not among the last messages anymore either
+        if (e->n == n) entries[count++] = e;
+        else count = 0;
+
+    }
+
+    return count;
+
+}
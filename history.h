@@ -0,0 +1,56 @@
+#ifndef DEF_HISTORY
+#define DEF_HISTORY
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "common.h"
+#include "frame.h"
+
+/*
+ * Ring of the last messages sent to a room, replayed to the users joining it.
+ *
+ * Entries keep a reference to the frame of the message as it was broadcast, so that adding a message does not copy it.
+ * Any thread may add messages, and readers do not take any lock : entries are published atomically, and each of them
+ * knows its position in the history so that a reader can tell an entry that was replaced while it was reading.
+ * An entry replaced by a new message may still be read, so it must only be freed once no reader can see it anymore
+ * (see epoch.h), and writers and readers must be in an epoch critical section.
+ *
+ * Every message added gets the next position, even when the history keeps nothing, so that a client replayed the
+ * messages before a position can be sent the following ones live.
+ */
+
+struct history_entry {
+    uint64_t n;                                 // Position of the message in the history
+    struct frame *frame;                        // PA_MSG
+    char name[MAX_USERNAME_LENGTH + 1];         // Name of the sender, which may leave before the message is replayed
+};
+
+struct history {
+    uint32_t size;
+    atomic_uint_fast64_t head;                  // Number of messages ever added
+    _Atomic(struct history_entry *) *entries;
+};
+
+// Create an empty history keeping the last `size` messages. A history of size 0 keeps nothing.
+void history_init(struct history *h, uint32_t size);
+
+// Free the history and its entries. No other thread may be using it.
+void history_destroy(struct history *h);
+
+/*
+ * Add a message to the history, taking a new reference on its frame, and get its position in `n`.
+ * Returns the entry it replaced, or the new one if a newer message already took its place, to be freed with
+ * history_free_entry once no reader can see it, or NULL.
+ */
+struct history_entry *history_add(struct history *h, struct frame *f, const char *name, uint64_t *n);
+
+void history_free_entry(void *entry);
+
+/*
+ * Get the last messages of the history, oldest first and without gaps, in `entries` which must have room for h->size
+ * entries, and in `head` the position of the first message not read. Messages being added concurrently before `head`
+ * are waited for. Returns the number of entries.
+ */
+uint32_t history_read(struct history *h, struct history_entry **entries, uint64_t *head);
+
+#endif
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "metrics.h"
+
+struct metric_info {
+    const char *name;
+    const char *help;
+    double scale;           // Divides the values recorded by a histogram to print them in the unit of its name
+};
+
+static const struct metric_info counters[METRIC_COUNTERS] = {
+    [M_CONNECTIONS] = {"cchat_connections_total", "TCP connections accepted.", 1},
+    [M_HANDSHAKES] = {"cchat_handshakes_total", "TLS handshakes completed.", 1},
+    [M_HANDSHAKE_FAILURES] = {"cchat_handshake_failures_total", "TLS handshakes failed.", 1},
+    [M_TIMEOUTS] = {"cchat_timeouts_total", "Connections closed by a timeout.", 1},
+    [M_MESSAGES_IN] = {"cchat_messages_received_total", "Messages received from the clients.", 1},
+    [M_MESSAGES_OUT] = {"cchat_messages_sent_total", "Messages queued to the clients.", 1},
+    [M_BYTES_IN] = {"cchat_received_bytes_total", "Bytes received from the clients.", 1},
+    [M_BYTES_OUT] = {"cchat_sent_bytes_total", "Bytes written to the clients.", 1},
+    [M_FLOOD_DROPPED] = {"cchat_flood_dropped_total", "Packets dropped because their client sent too much.", 1},
+    [M_FLOOD_PAUSED] = {"cchat_flood_paused_total", "Times clients sending too much were paused.", 1},
+    [M_FLOOD_DISCONNECTED] = {"cchat_flood_disconnected_total", "Clients disconnected for sending too much.", 1},
+};
+
+static const struct metric_info gauges[METRIC_GAUGES] = {
+    [G_CLIENTS] = {"cchat_clients", "Connected users.", 1},
+    [G_QUEUED_BYTES] = {"cchat_queued_bytes", "Bytes waiting to be written to the clients.", 1},
+};
+
+static const struct metric_info histograms[METRIC_HISTOGRAMS] = {
+    [H_HANDSHAKE] = {"cchat_handshake_seconds", "Time from accepting a connection to the end of its TLS handshake.", 1e6},
+    [H_FANOUT] = {"cchat_fanout_seconds", "Time to queue a broadcast to the clients of a thread.", 1e9},
+    [H_QUEUE_DEPTH] = {"cchat_queue_depth_bytes", "Bytes queued for a client after a packet is sent to it.", 1},
+    [H_LOCK_WAIT] = {"cchat_presence_lock_wait_seconds", "Time waited for the lock of the joins and leaves.", 1e9},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static _Atomic(struct metrics *) threads = NULL;
+
+void metrics_register(struct metrics *m) {
+    memset(m, 0, sizeof(struct metrics));
+    m->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &m->next, m));
+}
+
+static size_t bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+           + ((value >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Highest value of a bucket
+static uint64_t bucket_max(size_t i) {
+    if (i < HISTOGRAM_SUB_BUCKETS) return i;
+    int shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+    return ((HISTOGRAM_SUB_BUCKETS + i % HISTOGRAM_SUB_BUCKETS) << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t value) {
+    atomic_uint_fast64_t *count = &h->counts[bucket_index(value)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void histogram_merge(struct histogram *to, struct histogram *from) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+        atomic_store_explicit(&to->counts[i], atomic_load_explicit(&to->counts[i], memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    uint64_t sum = atomic_load_explicit(&from->sum, memory_order_relaxed);
+    atomic_store_explicit(&to->sum, atomic_load_explicit(&to->sum, memory_order_relaxed) + sum, memory_order_relaxed);
+}
+
+uint64_t histogram_count(struct histogram *h) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) total += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    return total;
+}
+
+uint64_t histogram_quantile(struct histogram *h, double q) {
+
+    uint64_t total = histogram_count(h);
+    if (total == 0) return 0;
+
+    // Smallest bucket holding at least this part of the values
+    uint64_t rank = q * total;
+    if (rank == 0) rank = 1;
+    size_t i = 0;
+    for (uint64_t seen = h->counts[0]; seen < rank; seen += h->counts[++i]);
+
+    return bucket_max(i);
+
+}
+
+static void print_header(FILE *out, const struct metric_info *info, const char *type) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, type);
+}
+
+// Print a histogram of all the threads as a summary, with a few quantiles
+static void print_histogram(FILE *out, enum metric_histogram histogram) {
+
+    const struct metric_info *info = &histograms[histogram];
+    struct histogram *h = calloc(1, sizeof(struct histogram));
+
+    for (struct metrics *m = atomic_load(&threads); m != NULL; m = m->next) {
+        histogram_merge(h, &m->histograms[histogram]);
+    }
+
+    uint64_t total = histogram_count(h);
+    print_header(out, info, "summary");
+
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        if (total == 0) {
+            fprintf(out, "%s{quantile=\"%g\"} NaN\n", info->name, quantiles[q]);
+        } else {
+            fprintf(out, "%s{quantile=\"%g\"} %g\n", info->name, quantiles[q], histogram_quantile(h, quantiles[q]) / info->scale);
+        }
+    }
+
+    fprintf(out, "%s_sum %g\n%s_count %lu\n", info->name, h->sum / info->scale, info->name, total);
+    free(h);
+
+}
+
+void metrics_print(FILE *out) {
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        uint64_t total = 0;
+        for (struct metrics *m = atomic_load(&threads); m != NULL; m = m->next) {
+            total += atomic_load_explicit(&m->counters[i], memory_order_relaxed);
+        }
+        print_header(out, &counters[i], "counter");
+        fprintf(out, "%s %lu\n", counters[i].name, total);
+    }
+
+    for (int i = 0; i < METRIC_GAUGES; i++) {
+        int64_t total = 0;
+        for (struct metrics *m = atomic_load(&threads); m != NULL; m = m->next) {
+            total += atomic_load_explicit(&m->gauges[i], memory_order_relaxed);
+        }
+        print_header(out, &gauges[i], "gauge");
+        fprintf(out, "%s %ld\n", gauges[i].name, total);
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) print_histogram(out, i);
+
+}
+
+int metrics_listen(const char *path) {
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    // Only the user running the server may read the metrics
+    unlink(path);
+    mode_t mask = umask(0077);
+    int res = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+
+    if (res != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+
+}
+
+void metrics_serve(int listen_fd) {
+
+    char *text = NULL;
+    size_t len = 0;
+
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+
+        // The metrics are printed once for all the connections pending
+        if (text == NULL) {
+            FILE *out = open_memstream(&text, &len);
+            metrics_print(out);
+            fclose(out);
+        }
+
+        // The text is much smaller than the buffer of the socket, so it is written at once
+        if (write(fd, text, len) < 0) perror("Error while writing metrics");
+        close(fd);
+
+    }
+
+    free(text);
+
+}
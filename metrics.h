@@ -0,0 +1,105 @@
+#ifndef DEF_METRICS
+#define DEF_METRICS
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Counters, gauges and latency histograms of the server.
+ *
+ * Each thread records into its own set of metrics, which only it writes : recording is a relaxed load and store,
+ * without any lock or atomic read-modify-write. Readers add up the sets of all the threads, and may see a value
+ * updated by a thread a bit late, but never a torn one.
+ *
+ * Histograms are log-linear, as HDR histograms : each power of 2 is split in HISTOGRAM_SUB_BUCKETS buckets, so that
+ * values are kept with a relative error under 1 / HISTOGRAM_SUB_BUCKETS whatever their magnitude.
+ *
+ * The metrics are printed in the Prometheus text format.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+enum metric_counter {
+    M_CONNECTIONS,          // TCP connections accepted
+    M_HANDSHAKES,           // TLS handshakes completed
+    M_HANDSHAKE_FAILURES,   // TLS handshakes failed
+    M_TIMEOUTS,             // Connections closed by a timeout
+    M_MESSAGES_IN,          // Messages received from the clients
+    M_MESSAGES_OUT,         // Messages queued to the clients
+    M_BYTES_IN,             // Bytes received from the clients
+    M_BYTES_OUT,            // Bytes written to the clients
+    M_FLOOD_DROPPED,        // Packets dropped because their client sent too much
+    M_FLOOD_PAUSED,         // Times clients sending too much were paused
+    M_FLOOD_DISCONNECTED,   // Clients disconnected for sending too much
+    METRIC_COUNTERS
+};
+
+enum metric_gauge {
+    G_CLIENTS,              // Connected users
+    G_QUEUED_BYTES,         // Bytes waiting to be written to the clients
+    METRIC_GAUGES
+};
+
+enum metric_histogram {
+    H_HANDSHAKE,            // Time from accepting a connection to the end of the TLS handshake (microseconds)
+    H_FANOUT,               // Time to queue a broadcast or a batch to the clients of a thread (nanoseconds)
+    H_QUEUE_DEPTH,          // Bytes queued for a client after a packet is sent to it
+    H_LOCK_WAIT,            // Time waited for presence_lock (nanoseconds)
+    METRIC_HISTOGRAMS
+};
+
+struct histogram {
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t sum;
+};
+
+// Metrics of a thread
+struct metrics {
+    atomic_uint_fast64_t counters[METRIC_COUNTERS];
+    atomic_int_fast64_t gauges[METRIC_GAUGES];
+    struct histogram histograms[METRIC_HISTOGRAMS];
+    struct metrics *next;
+};
+
+// Register the metrics of a thread, starting from 0. Must be called before the thread records anything.
+void metrics_register(struct metrics *m);
+
+static inline void metrics_add(struct metrics *m, enum metric_counter counter, uint64_t n) {
+    atomic_uint_fast64_t *v = &m->counters[counter];
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metrics_gauge(struct metrics *m, enum metric_gauge gauge, int64_t delta) {
+    atomic_int_fast64_t *v = &m->gauges[gauge];
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+// Record a value in a histogram written by a single thread
+void histogram_record(struct histogram *h, uint64_t value);
+
+// Add the values of a histogram to another one, which only the calling thread writes
+void histogram_merge(struct histogram *to, struct histogram *from);
+
+// Number of values of a histogram
+uint64_t histogram_count(struct histogram *h);
+
+// Value under which a part `q` of the values of a histogram are, up to its relative error. 0 if it is empty.
+uint64_t histogram_quantile(struct histogram *h, double q);
+
+static inline void metrics_record(struct metrics *m, enum metric_histogram histogram, uint64_t value) {
+    histogram_record(&m->histograms[histogram], value);
+}
+
+// Print the metrics of all the threads added up
+void metrics_print(FILE *out);
+
+// Create the Unix socket the metrics are served on, removing a previous socket at this path. Returns -1 on failure.
+int metrics_listen(const char *path);
+
+// Accept the pending connections of the metrics socket, and write the metrics to them before closing them
+void metrics_serve(int listen_fd);
+
+#endif
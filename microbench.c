@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ncurses.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include "common.h"
+#include "packets.h"
+#include "parser.h"
+#include "frame.h"
+#include "names.h"
+#include "registry.h"
+#include "clients.h"
+#include "gui.h"
+
+/*
+ * Microbenchmarks of the hot paths of the client and the server.
+ *
+ * Each benchmark times `runs` batches of operations, after a warm-up batch used to size them so that a batch takes
+ * about `batch_time`. The median time per operation over the batches is reported, with the median absolute deviation
+ * and the fastest batch : unlike the mean, they are hardly moved by the batches slowed down by the rest of the system.
+ *
+ * Results may be saved to a file, and compared to the ones of a previous build : a benchmark whose median is slower
+ * than the saved one by more than `threshold` percent, and by more than 3 deviations of both runs, is a regression.
+ */
+
+// Default number of batches timed per benchmark, time of a batch (milliseconds) and slowdown of a regression (percent)
+#define DEFAULT_RUNS 15
+#define DEFAULT_BATCH_TIME 20
+#define DEFAULT_THRESHOLD 10
+
+#define MAX_RUNS 1000
+
+// Sizes of the data sets : users connected to the server, users listed by the client, and characters of a long line
+#define NB_NAMES 10000
+#define NB_CLIENTS 10000
+#define NB_LIST 1000
+#define LINE_LENGTH 1000
+
+// Length of the messages and number of packets decoded at once
+#define MSG_LENGTH 64
+#define DECODE_PACKETS 256
+
+struct benchmark {
+    const char *name;
+    void (*setup)();
+    void (*run)(uint64_t ops);
+};
+
+struct result {
+    char name[64];
+    double median;      // Nanoseconds per operation
+    double mad;         // Median absolute deviation
+};
+
+int runs = DEFAULT_RUNS;
+long batch_time = DEFAULT_BATCH_TIME;
+double threshold = DEFAULT_THRESHOLD;
+
+// Results are written here, the standard output being used by the GUI
+FILE *out;
+
+// Keeps the results of the operations benchmarked, so that they are not optimized away
+volatile uint64_t sink;
+
+// Pseudo-random order in which the benchmarks go through their data sets
+uint32_t order[NB_CLIENTS];
+
+// Monotonic time in nanoseconds
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void shuffle(uint32_t *a, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) a[i] = i;
+    for (uint32_t i = n - 1; i > 0; i--) {
+        uint32_t j = rand() % (i + 1);
+        uint32_t t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+// Packets
+
+char msg[MSG_LENGTH];
+char packets[DECODE_PACKETS * (4 * sizeof(uint32_t) + MSG_LENGTH)];
+struct parser parser;
+
+void setup_packets() {
+
+    memset(msg, 'x', MSG_LENGTH - 1);
+    msg[MSG_LENGTH - 1] = '\0';
+
+    uint32_t header[4] = {htonl(PA_MSG), htonl(LOBBY_ROOM), htonl(42), htonl(MSG_LENGTH)};
+    for (int i = 0; i < DECODE_PACKETS; i++) {
+        char *p = packets + i * (sizeof(header) + MSG_LENGTH);
+        memcpy(p, header, sizeof(header));
+        memcpy(p + sizeof(header), msg, MSG_LENGTH);
+    }
+
+    parser_init(&parser, PARSER_READ_SIZE);
+
+}
+
+// Build the frame of a message, as the server does for each message it receives
+void bench_encode(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        uint32_t header[4] = {htonl(PA_MSG), htonl(LOBBY_ROOM), htonl(i), htonl(MSG_LENGTH)};
+        struct frame *f = frame_new(PA_MSG, header, sizeof(header), msg, MSG_LENGTH);
+        sink += f->len;
+        frame_release(f);
+    }
+}
+
+// Parse messages read in a single read, as the client does
+void bench_decode(uint64_t ops) {
+
+    struct packet p;
+
+    for (uint64_t i = 0; i < ops; i += DECODE_PACKETS) {
+        char *buff = parser_reserve(&parser, sizeof(packets));
+        memcpy(buff, packets, sizeof(packets));
+        parser_commit(&parser, sizeof(packets));
+        while (parser_next(&parser, &p) > 0) sink += p.id;
+    }
+
+}
+
+// Usernames
+
+struct names names;
+char usernames[NB_NAMES][MAX_USERNAME_LENGTH + 1];
+char free_names[NB_NAMES][MAX_USERNAME_LENGTH + 1];
+
+void setup_names() {
+    names_init(&names, NB_NAMES + 1);
+    for (uint32_t i = 0; i < NB_NAMES; i++) {
+        snprintf(usernames[i], sizeof(usernames[i]), "user%u", i);
+        snprintf(free_names[i], sizeof(free_names[i]), "free%u", i);
+        names_add(&names, usernames[i], i);
+    }
+}
+
+// Check that a username is not taken, when it is
+void bench_names_taken(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) sink += names_add(&names, usernames[order[i % NB_NAMES]], 0);
+}
+
+// Take a free username, and release it as the user leaves
+void bench_names_free(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        const char *name = free_names[order[i % NB_NAMES]];
+        sink += names_add(&names, name, 0);
+        names_remove(&names, name);
+    }
+}
+
+void bench_names_lookup(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) sink += names_lookup(&names, usernames[order[i % NB_NAMES]]);
+}
+
+// Registry
+
+struct registry registry;
+struct client registered[NB_CLIENTS];
+uint32_t ids[NB_CLIENTS];
+
+void setup_registry() {
+    registry_init(&registry, 0);
+    for (uint32_t i = 0; i < NB_CLIENTS; i++) {
+        registered[i].id = i;
+        ids[i] = registry_add(&registry, &registered[i]);
+    }
+}
+
+void bench_registry_get(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) sink += registry_get(&registry, ids[order[i % NB_CLIENTS]])->id;
+}
+
+// Go through the connected clients of a reactor and give each of them a reference on a frame, as a broadcast does
+void bench_registry_fanout(uint64_t ops) {
+
+    struct frame *f = frame_new(PA_MSG, msg, MSG_LENGTH, NULL, 0);
+
+    for (uint64_t i = 0; i < ops; i++) {
+        struct client *c = registry.active[i % registry.count];
+        sink += c->id;
+        frame_ref(f);
+    }
+
+    for (uint64_t i = 0; i < ops; i++) frame_release(f);
+    frame_release(f);
+
+}
+
+// Go through the slots of a registry, as another thread does
+void bench_registry_slots(uint64_t ops) {
+
+    uint32_t nb_slots = registry_nb_slots(&registry);
+
+    for (uint64_t i = 0; i < ops; i++) {
+        uint32_t id;
+        struct client *c = registry_slot_client(&registry, i % nb_slots, &id);
+        if (c != NULL) sink += id;
+    }
+
+}
+
+// List of users of the client
+
+struct client *list = NULL;
+
+void setup_list() {
+    char name[MAX_USERNAME_LENGTH + 1];
+    for (uint32_t i = 0; i < NB_LIST; i++) {
+        int len = snprintf(name, sizeof(name), "user%u", i);
+        add_client(&list, i, name, len);
+    }
+}
+
+// Find the name of the sender of each message received, as get_client_name does
+void bench_list_find(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) sink += (uintptr_t) find_client_id(list, order[i % NB_CLIENTS] % NB_LIST)->name;
+}
+
+// Input line
+
+void setup_zipper() {
+    init_zipper(LINE_LENGTH);
+}
+
+// Type long lines
+void bench_zip_add(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        if (i % LINE_LENGTH == 0) zip_clear();
+        zip_add_char('a' + i % 26);
+    }
+}
+
+// Move the cursor from one end of a long line to the other
+void bench_zip_move(uint64_t ops) {
+
+    zip_clear();
+    for (int i = 0; i < LINE_LENGTH; i++) zip_add_char('a' + i % 26);
+
+    for (uint64_t i = 0; i < ops; i++) {
+        if ((i / LINE_LENGTH) % 2 == 0) {
+            zip_move_left();
+        } else {
+            zip_move_right();
+        }
+    }
+
+}
+
+// Keys typed to the GUI : a long line is typed, the cursor moved to its start and back to its end, and the line submitted
+#define LINE_KEYS (3 * LINE_LENGTH + 1)
+int keys_fd = -1;
+char line_keys[LINE_LENGTH * 7 + 1];
+size_t line_keys_len = 0;
+int next_key = 0;
+
+/*
+ * Start the GUI as the client does, reading keys from a pipe and drawing to /dev/null. The results are written to a copy
+ * of the standard output.
+ */
+void setup_gui() {
+
+    int fds[2];
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (pipe(fds) != 0 || null_fd == -1) {
+        perror("Error while redirecting the GUI");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(out);
+    dup2(fds[0], STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    close(fds[0]);
+    close(null_fd);
+    keys_fd = fds[1];
+
+    // The arrow keys are read from terminfo. A line of keys fits in the pipe.
+    setenv("TERM", "xterm", 1);
+    init_gui(LINE_LENGTH);
+
+    const char *left = tigetstr("kcub1");
+    const char *right = tigetstr("kcuf1");
+    if (left == NULL || left == (char *) -1 || right == NULL || right == (char *) -1) {
+        fprintf(stderr, "Unknown arrow keys\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < LINE_LENGTH; i++) line_keys[line_keys_len++] = 'a' + i % 26;
+    for (int i = 0; i < LINE_LENGTH; i++) {
+        memcpy(line_keys + line_keys_len, left, strlen(left));
+        line_keys_len += strlen(left);
+    }
+    for (int i = 0; i < LINE_LENGTH; i++) {
+        memcpy(line_keys + line_keys_len, right, strlen(right));
+        line_keys_len += strlen(right);
+    }
+    line_keys[line_keys_len++] = '\n';
+
+}
+
+// Handle a key typed while editing a long line, drawing the line
+void bench_process_input(uint64_t ops) {
+
+    for (uint64_t i = 0; i < ops; i++) {
+
+        // Type the keys of the next line once the previous one was submitted
+        for (size_t written = 0; next_key == 0 && written < line_keys_len;) {
+            ssize_t n = write(keys_fd, line_keys + written, line_keys_len - written);
+            if (n < 0) {
+                perror("Error while typing keys");
+                exit(EXIT_FAILURE);
+            }
+            written += n;
+        }
+
+        char *line = process_input();
+        if (line != NULL) {
+            sink += strlen(line);
+            free(line);
+        }
+
+        next_key = (next_key + 1) % LINE_KEYS;
+
+    }
+
+}
+
+struct benchmark benchmarks[] = {
+    {"packet/encode_msg", setup_packets, bench_encode},
+    {"packet/decode_msg", setup_packets, bench_decode},
+    {"names/add_taken_10k", setup_names, bench_names_taken},
+    {"names/add_remove_10k", setup_names, bench_names_free},
+    {"names/lookup_10k", setup_names, bench_names_lookup},
+    {"registry/get_10k", setup_registry, bench_registry_get},
+    {"registry/fanout_10k", setup_registry, bench_registry_fanout},
+    {"registry/slots_10k", setup_registry, bench_registry_slots},
+    {"clients/find_id_1k", setup_list, bench_list_find},
+    {"gui/zip_add_char_1k", setup_zipper, bench_zip_add},
+    {"gui/zip_move_1k", setup_zipper, bench_zip_move},
+    {"gui/process_input_1k", setup_gui, bench_process_input},
+};
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+double median(double *values, int n) {
+    qsort(values, n, sizeof(double), compare_doubles);
+    return n % 2 == 1 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Time a benchmark, filling its result
+void measure(struct benchmark *b, struct result *r) {
+
+    static bool done_setup[sizeof(benchmarks) / sizeof(benchmarks[0])];
+    size_t index = b - benchmarks;
+    if (!done_setup[index]) {
+        b->setup();
+        for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+            if (benchmarks[i].setup == b->setup) done_setup[i] = true;
+        }
+    }
+
+    // Warm up, doubling the batch until it takes long enough to be sized
+    uint64_t ops = 1;
+    uint64_t elapsed;
+    while (true) {
+        uint64_t start = now_ns();
+        b->run(ops);
+        elapsed = now_ns() - start;
+        if (elapsed >= (uint64_t) batch_time * 100000) break;
+        ops *= 2;
+    }
+    ops = ops * batch_time * 1000000 / elapsed + 1;
+
+    double times[MAX_RUNS];
+    for (int i = 0; i < runs; i++) {
+        uint64_t start = now_ns();
+        b->run(ops);
+        times[i] = (double) (now_ns() - start) / ops;
+    }
+
+    // Sorts the times, the fastest batch is the first one
+    r->median = median(times, runs);
+    double fastest = times[0];
+
+    double deviations[MAX_RUNS];
+    for (int i = 0; i < runs; i++) deviations[i] = times[i] > r->median ? times[i] - r->median : r->median - times[i];
+    r->mad = median(deviations, runs);
+
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    fprintf(out, "%-28s %12.1f ns/op  ± %5.1f%%  min %12.1f  (%d x %lu ops)\n", b->name, r->median,
+            100 * r->mad / r->median, fastest, runs, ops);
+    fflush(out);
+
+}
+
+void save_results(const char *path, struct result *results, int n) {
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("Error while saving results");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) fprintf(f, "%s %f %f\n", results[i].name, results[i].median, results[i].mad);
+    fclose(f);
+
+}
+
+// Compare the results to saved ones. Returns the number of regressions.
+int compare_results(const char *path, struct result *results, int n) {
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("Error while reading saved results");
+        exit(EXIT_FAILURE);
+    }
+
+    int regressions = 0;
+    struct result saved;
+
+    fprintf(out, "\nCompared to %s :\n", path);
+
+    while (fscanf(f, "%63s %lf %lf", saved.name, &saved.median, &saved.mad) == 3) {
+
+        for (int i = 0; i < n; i++) {
+
+            if (strcmp(results[i].name, saved.name) != 0) continue;
+
+            double change = 100 * (results[i].median - saved.median) / saved.median;
+            bool regression = change > threshold && results[i].median - saved.median > 3 * (results[i].mad + saved.mad);
+            bool improvement = -change > threshold && saved.median - results[i].median > 3 * (results[i].mad + saved.mad);
+            if (regression) regressions++;
+
+            fprintf(out, "%-28s %+7.1f%%%s\n", saved.name, change,
+                    regression ? "  REGRESSION" : improvement ? "  improvement" : "");
+
+        }
+
+    }
+
+    fclose(f);
+    return regressions;
+
+}
+
+void print_usage(char *progName) {
+    printf("Usage : %s [-r runs] [-t batch_time_ms] [-s save_file] [-c compare_file] [-T threshold_percent] [filter]\n", progName);
+}
+
+int main(int argc, char *argv[]) {
+
+    char *save_path = NULL;
+    char *compare_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:s:c:T:")) != -1) {
+        switch (opt) {
+            case 'r':
+                runs = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                batch_time = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                save_path = optarg;
+                break;
+            case 'c':
+                compare_path = optarg;
+                break;
+            case 'T':
+                threshold = strtod(optarg, NULL);
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (runs <= 0 || runs > MAX_RUNS || batch_time <= 0 || threshold < 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Only the benchmarks whose name contains the filter are run
+    const char *filter = optind < argc ? argv[optind] : "";
+
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    srand(42);
+    shuffle(order, NB_CLIENTS);
+
+    size_t nb_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    struct result *results = calloc(nb_benchmarks, sizeof(struct result));
+    int n = 0;
+
+    for (size_t i = 0; i < nb_benchmarks; i++) {
+        if (strstr(benchmarks[i].name, filter) == NULL) continue;
+        measure(&benchmarks[i], &results[n++]);
+    }
+
+    if (keys_fd != -1) destroy_gui();
+
+    if (save_path != NULL) save_results(save_path, results, n);
+
+    int regressions = compare_path != NULL ? compare_results(compare_path, results, n) : 0;
+    free(results);
+    fclose(out);
+
+    return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
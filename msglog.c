@@ -0,0 +1,490 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "msglog.h"
+
+// Records are aligned on 8 bytes, so that they can be read in place
+#define RECORD_ALIGN 8
+
+static uint64_t realtime_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a of the record after its checksum, padding included
+static uint32_t checksum(const struct msglog_record *rec) {
+    const unsigned char *p = (const unsigned char *) rec + 2 * sizeof(uint32_t);
+    const unsigned char *end = (const unsigned char *) rec + rec->size;
+    uint32_t h = 2166136261u;
+    for (; p < end; p++) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+// Check that the record at `offset` of a segment is complete, as a torn write leaves a partial one
+static bool valid_record(const char *data, uint64_t offset) {
+    if (offset + sizeof(struct msglog_record) > MSGLOG_SEGMENT_SIZE) return false;
+    const struct msglog_record *rec = (const struct msglog_record *) (data + offset);
+    return rec->size >= sizeof(struct msglog_record) && rec->size % RECORD_ALIGN == 0
+        && offset + rec->size <= MSGLOG_SEGMENT_SIZE
+        && (uint64_t) rec->name_len + rec->msg_len <= rec->size - sizeof(struct msglog_record)
+        && rec->checksum == checksum(rec);
+}
+
+static void path(char *buff, size_t len, const char *dir, uint64_t number, const char *ext) {
+    snprintf(buff, len, "%s/%016" PRIx64 ".%s", dir, number, ext);
+}
+
+// Delete a sealed segment and its index
+static void remove_segment(struct msglog *log, uint64_t number) {
+    const char *exts[] = {"log", "idx"};
+    for (int i = 0; i < 2; i++) {
+        char name[PATH_MAX];
+        path(name, sizeof(name), log->dir, number, exts[i]);
+        if (unlink(name) == -1 && errno != ENOENT) fprintf(stderr, "Could not remove %s : %s\n", name, strerror(errno));
+    }
+}
+
+static int open_file(const char *dir, uint64_t number, const char *ext, int flags) {
+    char name[PATH_MAX];
+    path(name, sizeof(name), dir, number, ext);
+    int fd = open(name, O_RDWR | O_CREAT | flags, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s : %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void *map_file(int fd, size_t len) {
+    void *data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map message log : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+// Map a segment and its index. Segments are created with their full size, the records are followed by zeros.
+static void map_segment(struct msglog *log, struct msglog_segment *seg, int *fd, int *index_fd) {
+
+    *fd = open_file(log->dir, seg->number, "log", 0);
+    *index_fd = open_file(log->dir, seg->number, "idx", O_APPEND);
+
+    struct stat st;
+    if (fstat(*fd, &st) == -1 || (st.st_size < MSGLOG_SEGMENT_SIZE && ftruncate(*fd, MSGLOG_SEGMENT_SIZE) == -1)) {
+        fprintf(stderr, "Could not allocate message log segment : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    seg->data = map_file(*fd, MSGLOG_SEGMENT_SIZE);
+
+    // An entry may have been partly written
+    seg->index_count = fstat(*index_fd, &st) == -1 ? 0 : st.st_size / sizeof(struct msglog_index_entry);
+    seg->index = seg->index_count == 0 ? NULL : map_file(*index_fd, seg->index_count * sizeof(struct msglog_index_entry));
+
+}
+
+static int compare_segments(const void *a, const void *b) {
+    uint64_t na = ((const struct msglog_segment *) a)->number;
+    uint64_t nb = ((const struct msglog_segment *) b)->number;
+    return (na > nb) - (na < nb);
+}
+
+// Find the segments of the log, in order
+static void list_segments(struct msglog *log) {
+
+    DIR *d = opendir(log->dir);
+    if (d == NULL) {
+        fprintf(stderr, "Could not open message log directory %s : %s\n", log->dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    size_t cap = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(d)) != NULL) {
+
+        uint64_t number;
+        char ext[4];
+        if (sscanf(entry->d_name, "%16" SCNx64 ".%3s", &number, ext) != 2 || strcmp(ext, "log")) continue;
+
+        if (log->nb_segments == cap) {
+            cap = cap == 0 ? 16 : 2 * cap;
+            log->segments = realloc(log->segments, cap * sizeof(struct msglog_segment));
+        }
+        memset(&log->segments[log->nb_segments], 0, sizeof(struct msglog_segment));
+        log->segments[log->nb_segments++].number = number;
+
+    }
+
+    closedir(d);
+    qsort(log->segments, log->nb_segments, sizeof(struct msglog_segment), compare_segments);
+
+}
+
+/*
+ * Find the end of the records of the last segment, from its last indexed record. The index is written along with the
+ * records, so its last entries may point to records that were not.
+ */
+static void recover(struct msglog *log, struct msglog_segment *seg) {
+
+    while (seg->index_count > 0 && !valid_record(seg->data, seg->index[seg->index_count - 1].offset)) {
+        seg->index_count--;
+    }
+
+    uint64_t offset = seg->index_count > 0 ? seg->index[seg->index_count - 1].offset : 0;
+    while (valid_record(seg->data, offset)) offset += ((struct msglog_record *) (seg->data + offset))->size;
+
+    // Truncating the segment clears what is left of a torn write, so that the next records are not mixed with it
+    if (ftruncate(log->fd, offset) == -1 || ftruncate(log->fd, MSGLOG_SEGMENT_SIZE) == -1
+        || ftruncate(log->index_fd, seg->index_count * sizeof(struct msglog_index_entry)) == -1) {
+        fprintf(stderr, "Could not truncate message log : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    log->end = offset;
+    log->next_index = seg->index_count > 0
+        ? (seg->index[seg->index_count - 1].offset / MSGLOG_INDEX_INTERVAL + 1) * MSGLOG_INDEX_INTERVAL : 0;
+
+}
+
+void msglog_open(struct msglog *log, const char *dir, long sync_interval, size_t max_segments) {
+
+    memset(log, 0, sizeof(struct msglog));
+    log->dir = strdup(dir);
+    log->sync_interval = sync_interval;
+    log->max_segments = max_segments;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&log->lock, NULL);
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Could not create message log directory %s : %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    list_segments(log);
+
+    if (log->nb_segments == 0) {
+        log->segments = calloc(1, sizeof(struct msglog_segment));
+        log->nb_segments = 1;
+    }
+
+    // The limit may have been lowered since the segments were written
+    if (max_segments > 0 && log->nb_segments > max_segments) {
+        size_t extra = log->nb_segments - max_segments;
+        for (size_t i = 0; i < extra; i++) remove_segment(log, log->segments[i].number);
+        memmove(log->segments, log->segments + extra, max_segments * sizeof(struct msglog_segment));
+        log->nb_segments = max_segments;
+    }
+    log->oldest = log->segments[0].number;
+
+    // Sealed segments are only read, their files do not need to stay open once mapped
+    for (size_t i = 0; i < log->nb_segments; i++) {
+        int fd, index_fd;
+        map_segment(log, &log->segments[i], &fd, &index_fd);
+        if (i == log->nb_segments - 1) {
+            log->fd = fd;
+            log->index_fd = index_fd;
+        } else {
+            close(fd);
+            close(index_fd);
+        }
+    }
+
+    recover(log, &log->segments[log->nb_segments - 1]);
+
+}
+
+// Write records to the active segment, and index the ones starting a new block
+static void write_records(struct msglog *log, const char *buff, size_t len) {
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(log->fd, buff + written, len - written, log->end + written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            fprintf(stderr, "Error while writing message log : %s\n", strerror(errno));
+            return;
+        }
+        written += n;
+    }
+
+    for (size_t off = 0; off < len; off += ((const struct msglog_record *) (buff + off))->size) {
+
+        uint64_t offset = log->end + off;
+        if (offset < log->next_index) continue;
+
+        struct msglog_index_entry entry = {offset};
+        if (write(log->index_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+            fprintf(stderr, "Error while writing message log index : %s\n", strerror(errno));
+        }
+        log->next_index = (offset / MSGLOG_INDEX_INTERVAL + 1) * MSGLOG_INDEX_INTERVAL;
+
+    }
+
+    log->end += len;
+
+}
+
+static void sync_log(struct msglog *log) {
+    if (fdatasync(log->fd) == -1 || fdatasync(log->index_fd) == -1) {
+        fprintf(stderr, "Error while syncing message log : %s\n", strerror(errno));
+    }
+}
+
+// Seal the active segment and start the next one
+static void new_segment(struct msglog *log) {
+
+    sync_log(log);
+    close(log->fd);
+    close(log->index_fd);
+
+    uint64_t number = log->segments[log->nb_segments - 1].number + 1;
+    log->segments[log->nb_segments - 1].number = number;
+
+    log->fd = open_file(log->dir, number, "log", 0);
+    log->index_fd = open_file(log->dir, number, "idx", O_APPEND);
+    if (ftruncate(log->fd, MSGLOG_SEGMENT_SIZE) == -1) {
+        fprintf(stderr, "Could not allocate message log segment : %s\n", strerror(errno));
+    }
+
+    log->end = 0;
+    log->next_index = 0;
+
+    while (log->max_segments > 0 && number - log->oldest >= log->max_segments) remove_segment(log, log->oldest++);
+
+}
+
+// Append a batch of records, starting a new segment when the next record does not fit in the active one
+static void write_batch(struct msglog *log, char *buff, size_t len) {
+
+    size_t start = 0;
+
+    for (size_t off = 0; off < len; off += ((struct msglog_record *) (buff + off))->size) {
+
+        struct msglog_record *rec = (struct msglog_record *) (buff + off);
+        rec->checksum = checksum(rec);
+
+        // The segment must keep room for the size of the next record, which marks its end
+        if (log->end + (off - start) + rec->size + RECORD_ALIGN > MSGLOG_SEGMENT_SIZE) {
+            write_records(log, buff + start, off - start);
+            new_segment(log);
+            start = off;
+        }
+
+    }
+
+    write_records(log, buff + start, len - start);
+
+}
+
+/*
+ * Write the records copied by the reactors. Records are written in batches of everything copied while the previous
+ * batch was being written and synced, and synced once the oldest record not synced yet is `sync_interval` old.
+ */
+static void *writer_loop(void *arg) {
+
+    struct msglog *log = arg;
+    char *batch = NULL;
+    size_t batch_cap = 0;
+    bool dirty = false;
+    uint64_t sync_deadline = 0;
+
+    pthread_mutex_lock(&log->lock);
+
+    while (true) {
+
+        while (log->pending_len == 0 && !log->stopping && !(dirty && monotonic_ms() >= sync_deadline)) {
+            if (!dirty) {
+                pthread_cond_wait(&log->cond, &log->lock);
+                continue;
+            }
+            struct timespec ts = {sync_deadline / 1000, (sync_deadline % 1000) * 1000000};
+            pthread_cond_timedwait(&log->cond, &log->lock, &ts);
+        }
+
+        // Reactors keep copying their records to the other buffer while this one is written
+        char *buff = log->pending;
+        size_t len = log->pending_len;
+        size_t cap = log->pending_cap;
+        log->pending = batch;
+        log->pending_cap = batch_cap;
+        log->pending_len = 0;
+        batch = buff;
+        batch_cap = cap;
+
+        uint64_t dropped = log->dropped;
+        log->dropped = 0;
+
+        pthread_mutex_unlock(&log->lock);
+
+        if (dropped > 0) fprintf(stderr, "Message log is too slow, %" PRIu64 " messages were not saved\n", dropped);
+
+        if (len > 0) {
+            write_batch(log, batch, len);
+            if (!dirty) sync_deadline = monotonic_ms() + log->sync_interval;
+            dirty = true;
+        }
+
+        if (dirty && monotonic_ms() >= sync_deadline) {
+            sync_log(log);
+            dirty = false;
+        }
+
+        pthread_mutex_lock(&log->lock);
+
+        // Everything copied before the log was stopped is written
+        if (log->stopping && log->pending_len == 0) break;
+
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    if (dirty) sync_log(log);
+    free(batch);
+
+    return NULL;
+
+}
+
+void msglog_start(struct msglog *log) {
+
+    // Only the writer uses the log from now on, and it writes to the files
+    for (size_t i = 0; i < log->nb_segments; i++) {
+        struct msglog_segment *seg = &log->segments[i];
+        munmap(seg->data, MSGLOG_SEGMENT_SIZE);
+        if (seg->index != NULL) munmap(seg->index, seg->index_count * sizeof(struct msglog_index_entry));
+        seg->data = NULL;
+        seg->index = NULL;
+    }
+
+    // The writer only needs the number of the active segment
+    log->segments[0] = log->segments[log->nb_segments - 1];
+    log->nb_segments = 1;
+
+    pthread_create(&log->writer, NULL, writer_loop, log);
+
+}
+
+void msglog_stop(struct msglog *log) {
+
+    pthread_mutex_lock(&log->lock);
+    log->stopping = true;
+    pthread_cond_signal(&log->cond);
+    pthread_mutex_unlock(&log->lock);
+
+    pthread_join(log->writer, NULL);
+
+}
+
+void msglog_append(struct msglog *log, uint32_t room, uint32_t client_id, const char *name, const char *msg, uint32_t msg_len) {
+
+    uint32_t name_len = strlen(name) + 1;
+    size_t size = (sizeof(struct msglog_record) + name_len + msg_len + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1);
+    uint64_t time = realtime_ms();
+
+    pthread_mutex_lock(&log->lock);
+
+    if (log->pending_len + size > MSGLOG_MAX_PENDING) {
+        log->dropped++;
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+
+    if (log->pending_len + size > log->pending_cap) {
+        log->pending_cap = log->pending_cap == 0 ? 64 * 1024 : 2 * log->pending_cap;
+        log->pending = realloc(log->pending, log->pending_cap);
+    }
+
+    // The checksum is computed by the writer, out of the lock
+    struct msglog_record *rec = (struct msglog_record *) (log->pending + log->pending_len);
+    rec->size = size;
+    rec->time = time;
+    rec->room = room;
+    rec->client_id = client_id;
+    rec->name_len = name_len;
+    rec->msg_len = msg_len;
+    memcpy(rec->data, name, name_len);
+    memcpy(rec->data + name_len, msg, msg_len);
+    memset(rec->data + name_len + msg_len, 0, size - sizeof(struct msglog_record) - name_len - msg_len);
+
+    if (log->pending_len == 0) pthread_cond_signal(&log->cond);
+    log->pending_len += size;
+
+    pthread_mutex_unlock(&log->lock);
+
+}
+
+void msglog_seek_back(struct msglog *log, struct msglog_cursor *cur, uint64_t bytes) {
+
+    // Segments are not all full, the position is only an approximation of the size of the log
+    uint64_t end = (log->nb_segments - 1) * (uint64_t) MSGLOG_SEGMENT_SIZE + log->end;
+    uint64_t target = end > bytes ? end - bytes : 0;
+
+    cur->segment = target / MSGLOG_SEGMENT_SIZE;
+    cur->offset = 0;
+
+    // Last indexed record before the target
+    struct msglog_segment *seg = &log->segments[cur->segment];
+    uint64_t offset = target % MSGLOG_SEGMENT_SIZE;
+    size_t lo = 0, hi = seg->index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (seg->index[mid].offset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > 0) cur->offset = seg->index[lo - 1].offset;
+
+}
+
+const struct msglog_record *msglog_next(struct msglog *log, struct msglog_cursor *cur) {
+
+    while (cur->segment < log->nb_segments) {
+
+        bool last = cur->segment == log->nb_segments - 1;
+        const char *data = log->segments[cur->segment].data;
+
+        // A damaged record ends its segment
+        if ((last && cur->offset >= log->end) || (!last && !valid_record(data, cur->offset))) {
+            if (last) return NULL;
+            cur->segment++;
+            cur->offset = 0;
+            continue;
+        }
+
+        const struct msglog_record *rec = (const struct msglog_record *) (data + cur->offset);
+        cur->offset += rec->size;
+        return rec;
+
+    }
+
+    return NULL;
+
+}
+
+const char *msglog_name(const struct msglog_record *rec) {
+    return rec->data;
+}
+
+const char *msglog_msg(const struct msglog_record *rec) {
+    return rec->data + rec->name_len;
+}
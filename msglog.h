@@ -0,0 +1,118 @@
+#ifndef DEF_MSGLOG
+#define DEF_MSGLOG
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Append-only log of the messages sent to the rooms, kept on disk so that their history survives a restart.
+ *
+ * The log is a directory of segments of MSGLOG_SEGMENT_SIZE bytes, each one a file holding records one after the
+ * other and ending with a record of size 0. Beside each segment, a sparse index holds the position of the first record
+ * of every block of MSGLOG_INDEX_INTERVAL bytes, so that a position in the log is found without reading the records
+ * before it.
+ *
+ * The log is only read when the server starts, to replay the last messages into the histories : segments are
+ * memory-mapped until the log is started, and records are aligned so that they are read in place. Once started, the
+ * histories in memory serve the clients, and only the segment being written is kept open.
+ *
+ * The log keeps at most `max_segments` segments : the writer deletes the oldest one when it starts a new segment
+ * beyond that, and so does opening the log with a lower limit than before.
+ *
+ * Reactors only copy their records into a buffer : a writer thread appends them to the log in batches, and syncs the
+ * log to disk at most every `sync_interval` milliseconds (after every batch if 0). Records still in the buffer or not
+ * synced yet are lost if the server crashes. Records of a batch only partly written are discarded when the log is
+ * opened again.
+ */
+
+#define MSGLOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define MSGLOG_INDEX_INTERVAL (64 * 1024)
+
+// Records waiting to be written are dropped beyond this size, if the disk cannot keep up
+#define MSGLOG_MAX_PENDING (16 * 1024 * 1024)
+
+// Message sent to a room, followed by the name of its sender and by the message, both null-terminated
+struct msglog_record {
+    uint32_t size;          // Size of the record, including the padding to the next one, 0 at the end of a segment
+    uint32_t checksum;      // Checksum of the rest of the record
+    uint64_t time;          // Time at which the message was sent (milliseconds since the epoch)
+    uint32_t room;
+    uint32_t client_id;
+    uint32_t name_len;
+    uint32_t msg_len;
+    char data[];
+};
+
+struct msglog_index_entry {
+    uint64_t offset;        // Position of the record in its segment
+};
+
+struct msglog_segment {
+    uint64_t number;
+    char *data;                             // Mapped segment
+    struct msglog_index_entry *index;       // Mapped index, only of the segments sealed before the log was opened
+    size_t index_count;
+};
+
+// Position of a record in the log
+struct msglog_cursor {
+    size_t segment;         // Rank of the segment in the log
+    uint64_t offset;
+};
+
+struct msglog {
+    char *dir;
+    long sync_interval;
+    size_t max_segments;    // 0 for no limit
+    uint64_t oldest;        // Number of the oldest segment kept
+
+    // Segments found when the log was opened, the last one being written to
+    struct msglog_segment *segments;
+    size_t nb_segments;
+
+    // Active segment, only used by the writer once the log is started
+    int fd;
+    int index_fd;
+    uint64_t end;           // Size of the records of the active segment
+    uint64_t next_index;    // Records starting from this offset of the active segment start a block not indexed yet
+
+    // Records copied by the reactors, waiting to be written
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    uint64_t dropped;
+    bool stopping;          // The writer exits once the records pending are written
+
+    pthread_t writer;
+};
+
+/*
+ * Open the log stored in `dir`, creating it if needed, and discard the records of a batch that was not completely
+ * written. The oldest segments beyond `max_segments` are deleted, unless it is 0. Exits on error.
+ */
+void msglog_open(struct msglog *log, const char *dir, long sync_interval, size_t max_segments);
+
+// Start the writer thread. Records can be read from the log until then.
+void msglog_start(struct msglog *log);
+
+// Write and sync the records pending, then stop the writer thread. No record must be copied anymore.
+void msglog_stop(struct msglog *log);
+
+// Copy a record to be written to the log. Thread-safe.
+void msglog_append(struct msglog *log, uint32_t room, uint32_t client_id, const char *name, const char *msg, uint32_t msg_len);
+
+// Position a cursor on the first indexed record at least `bytes` bytes before the end of the log, or at its start
+void msglog_seek_back(struct msglog *log, struct msglog_cursor *cur, uint64_t bytes);
+
+// Get the record at the cursor and move it to the next one. Returns NULL at the end of the log.
+const struct msglog_record *msglog_next(struct msglog *log, struct msglog_cursor *cur);
+
+// Name and message of a record
+const char *msglog_name(const struct msglog_record *rec);
+const char *msglog_msg(const struct msglog_record *rec);
+
+#endif
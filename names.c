@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include "names.h"
+
+// Zero-padded copy of a name, and its hash
+struct name_key {
+    uint64_t words[NAMES_KEY_WORDS];
+    uint32_t hash;
+};
+
+static void make_key(struct name_key *k, const char *name) {
+
+    memset(k->words, 0, sizeof(k->words));
+    memcpy(k->words, name, strnlen(name, MAX_USERNAME_LENGTH));
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *) k->words;
+    for (size_t i = 0; i < sizeof(k->words); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    k->hash = hash;
+
+}
+
+static bool key_matches(struct name_entry *e, struct name_key *k) {
+    if (atomic_load_explicit(&e->hash, memory_order_relaxed) != k->hash) return false;
+    for (int i = 0; i < NAMES_KEY_WORDS; i++) {
+        if (atomic_load_explicit(&e->key[i], memory_order_relaxed) != k->words[i]) return false;
+    }
+    return true;
+}
+
+static void copy_entry(struct name_entry *to, struct name_entry *from) {
+    atomic_store_explicit(&to->hash, atomic_load_explicit(&from->hash, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&to->id, atomic_load_explicit(&from->id, memory_order_relaxed), memory_order_relaxed);
+    for (int i = 0; i < NAMES_KEY_WORDS; i++) {
+        atomic_store_explicit(&to->key[i], atomic_load_explicit(&from->key[i], memory_order_relaxed), memory_order_relaxed);
+    }
+    atomic_store_explicit(&to->used, true, memory_order_relaxed);
+}
+
+void names_init(struct names *n, size_t max_names) {
+
+    // Keep the table at most half full so probe sequences stay short
+    size_t size = 64;
+    while (size < 2 * max_names) size *= 2;
+
+    n->entries = calloc(size, sizeof(struct name_entry));
+    n->mask = size - 1;
+    atomic_init(&n->seq, 0);
+    pthread_mutex_init(&n->lock, NULL);
+
+}
+
+// Find the entry of a key. Returns the index of the entry, or of the empty entry ending its probe sequence.
+static size_t find(struct names *n, struct name_key *k, bool *found) {
+
+    size_t i = k->hash & n->mask;
+
+    while (atomic_load_explicit(&n->entries[i].used, memory_order_acquire)) {
+        if (key_matches(&n->entries[i], k)) {
+            *found = true;
+            return i;
+        }
+        i = (i + 1) & n->mask;
+    }
+
+    *found = false;
+    return i;
+
+}
+
+bool names_add(struct names *n, const char *name, uint32_t id) {
+
+    struct name_key k;
+    make_key(&k, name);
+
+    pthread_mutex_lock(&n->lock);
+
+    bool found;
+    size_t i = find(n, &k, &found);
+
+    if (!found) {
+        // The entry is filled before being marked as used, so readers never see a partial entry
+        struct name_entry *e = &n->entries[i];
+        atomic_store_explicit(&e->hash, k.hash, memory_order_relaxed);
+        atomic_store_explicit(&e->id, id, memory_order_relaxed);
+        for (int w = 0; w < NAMES_KEY_WORDS; w++) {
+            atomic_store_explicit(&e->key[w], k.words[w], memory_order_relaxed);
+        }
+        atomic_store_explicit(&e->used, true, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&n->lock);
+
+    return !found;
+
+}
+
+void names_set_id(struct names *n, const char *name, uint32_t id) {
+
+    struct name_key k;
+    make_key(&k, name);
+
+    pthread_mutex_lock(&n->lock);
+
+    bool found;
+    size_t i = find(n, &k, &found);
+    if (found) atomic_store_explicit(&n->entries[i].id, id, memory_order_release);
+
+    pthread_mutex_unlock(&n->lock);
+
+}
+
+void names_remove(struct names *n, const char *name) {
+
+    struct name_key k;
+    make_key(&k, name);
+
+    pthread_mutex_lock(&n->lock);
+
+    bool found;
+    size_t i = find(n, &k, &found);
+
+    if (found) {
+
+        // Tell readers entries are moving
+        atomic_fetch_add_explicit(&n->seq, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        // Move back the following entries of the probe sequence that would not be found anymore
+        size_t j = i;
+        while (true) {
+
+            j = (j + 1) & n->mask;
+            struct name_entry *e = &n->entries[j];
+
+            if (!atomic_load_explicit(&e->used, memory_order_relaxed)) break;
+
+            // The entry can move to the hole only if its home position is not between the hole and itself
+            size_t home = atomic_load_explicit(&e->hash, memory_order_relaxed) & n->mask;
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays) continue;
+
+            copy_entry(&n->entries[i], e);
+            i = j;
+
+        }
+
+        atomic_store_explicit(&n->entries[i].used, false, memory_order_relaxed);
+
+        atomic_fetch_add_explicit(&n->seq, 1, memory_order_release);
+
+    }
+
+    pthread_mutex_unlock(&n->lock);
+
+}
+
+uint32_t names_lookup(struct names *n, const char *name) {
+
+    struct name_key k;
+    make_key(&k, name);
+
+    while (true) {
+
+        unsigned seq = atomic_load_explicit(&n->seq, memory_order_acquire);
+
+        // A removal is moving entries
+        if (seq & 1) continue;
+
+        bool found;
+        size_t i = find(n, &k, &found);
+        uint32_t id = found ? atomic_load_explicit(&n->entries[i].id, memory_order_acquire) : NAMES_NONE;
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&n->seq, memory_order_relaxed) == seq) return id;
+
+    }
+
+}
@@ -0,0 +1,60 @@
+#ifndef DEF_NAMES
+#define DEF_NAMES
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Hash index of the usernames in use, mapping each name to the id of its client.
+ *
+ * Lookups are lock-free and can run concurrently with writers. Writers (adding and removing names) are serialized by
+ * the index lock. The table uses linear probing and backward shift deletion, so it never fills up with tombstones :
+ * readers retry their lookup if a removal moved entries while they were probing.
+ */
+
+// Id of a name reserved by a client that did not get its id yet
+#define NAMES_RESERVED UINT32_MAX
+
+// Result of a lookup for a name that is not in use
+#define NAMES_NONE (UINT32_MAX - 1)
+
+// Names are stored zero-padded in 64 bits words, so that they can be read atomically and compared word by word
+#define NAMES_KEY_WORDS ((MAX_USERNAME_LENGTH + 1 + 7) / 8)
+
+struct name_entry {
+    atomic_bool used;
+    atomic_uint_least32_t hash;
+    atomic_uint_least32_t id;
+    atomic_uint_least64_t key[NAMES_KEY_WORDS];
+};
+
+struct names {
+    struct name_entry *entries;
+    size_t mask;
+    atomic_uint seq;            // Odd while a removal is moving entries
+    pthread_mutex_t lock;       // Serializes writers
+};
+
+// Create an index able to hold `max_names` names
+void names_init(struct names *n, size_t max_names);
+
+/*
+ * Add a name to the index, if it is not already used. Returns false if the name is taken.
+ * `name` must be a null-terminated string of at most MAX_USERNAME_LENGTH characters.
+ */
+bool names_add(struct names *n, const char *name, uint32_t id);
+
+// Change the id associated to a name in the index
+void names_set_id(struct names *n, const char *name, uint32_t id);
+
+// Remove a name from the index
+void names_remove(struct names *n, const char *name);
+
+// Get the id of the client using a name. Returns NAMES_NONE if the name is free. Does not take any lock.
+uint32_t names_lookup(struct names *n, const char *name);
+
+#endif
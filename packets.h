@@ -3,13 +3,27 @@
 
 #define PA_MSG          0   // User message
 #define PA_SYS          1   // System message
+#define PA_DM           2   // Direct message to a single user
+#define PA_HISTORY      3   // Last messages sent to a room
 #define PA_USERNAME     20  // Username
 #define PA_USERID       21  // User id
-#define PA_USRJOIN      22  // User connect
-#define PA_USRLEAVE     23  // User disconnect
-#define PA_USRLIST      24  // User list
-#define PA_CONNACCEPT   40  // Connection accepted
+#define PA_USRJOIN      22  // User connect, or joins a room
+#define PA_USRLEAVE     23  // User disconnect, or leaves a room
+#define PA_USRLIST      24  // Users of a room
+#define PA_JOINROOM     25  // Join a room
+#define PA_LEAVEROOM    26  // Leave a room
+#define PA_PRESENCE     27  // Version of the list of users of the lobby
+#define PA_USRUPDATE    28  // Users who joined and left the lobby
+#define PA_CONNACCEPT   40  // Connection accepted, with the capabilities of the server
+#define PA_CAPS         41  // Capabilities used by the client
+#define PA_COMPRESSED   42  // Packets compressed with deflate
+#define PA_PING         43  // Check that the other side is alive
+#define PA_PONG         44  // Answer to a ping
 #define PA_ERRNAME      50  // Error : username already taken
 #define PA_ERRMAXCONN   51  // Error : max number of connections reached
 
+// Capabilities of a PA_CONNACCEPT or PA_CAPS packet
+#define CAP_DEFLATE     1   // Large packets may be sent in a PA_COMPRESSED packet
+#define CAP_DICT        2   // Compressed packets may use the preset dictionary
+
 #endif
\ No newline at end of file
@@ -0,0 +1,224 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include "packets.h"
+#include "parser.h"
+
+// Fields following the packet number, in this order
+enum field {
+    F_ROOM = 1,     // room
+    F_ID = 2,       // id
+    F_LEN = 4,      // len, payload
+    F_LIST = 8,     // count, count * (id, len, name)
+    F_HISTORY = 16, // count, count * (id, len, name, len, text)
+    F_VERSION = 32, // version, on 64 bits, after the id if any
+};
+
+// Fields of a packet, or -1 if the packet number is unknown
+static int get_fields(uint32_t pa_num) {
+    switch (pa_num) {
+        case PA_ERRNAME:
+        case PA_ERRMAXCONN:
+            return 0;
+        case PA_USERID:
+        case PA_CONNACCEPT:
+        case PA_CAPS:
+            return F_ID;
+        case PA_SYS:
+        case PA_USERNAME:
+            return F_LEN;
+        case PA_DM:
+        case PA_COMPRESSED:
+            return F_ID | F_LEN;
+        case PA_MSG:
+        case PA_USRJOIN:
+            return F_ROOM | F_ID | F_LEN;
+        case PA_USRLEAVE:
+            return F_ROOM | F_ID;
+        case PA_USRLIST:
+        case PA_USRUPDATE:
+            return F_ROOM | F_LIST;
+        case PA_HISTORY:
+            return F_ROOM | F_HISTORY;
+        case PA_JOINROOM:
+        case PA_LEAVEROOM:
+            return F_ROOM;
+        case PA_PRESENCE:
+            return F_ID | F_VERSION;
+        case PA_PING:
+        case PA_PONG:
+            return F_VERSION;
+        default:
+            return -1;
+    }
+}
+
+static uint32_t read_u32(const char *buff) {
+    uint32_t n;
+    memcpy(&n, buff, sizeof(uint32_t));
+    return ntohl(n);
+}
+
+void parser_init(struct parser *p, size_t max_packet) {
+    p->buff = NULL;
+    p->cap = 0;
+    p->start = 0;
+    p->end = 0;
+    p->max_packet = max_packet;
+}
+
+void parser_destroy(struct parser *p) {
+    free(p->buff);
+    parser_init(p, p->max_packet);
+}
+
+char *parser_reserve(struct parser *p, size_t len) {
+
+    if (p->cap - p->end < len) {
+
+        // Move the partial packet to the beginning of the buffer, and grow it if it is still too small
+        size_t pending = p->end - p->start;
+        memmove(p->buff, p->buff + p->start, pending);
+        p->start = 0;
+        p->end = pending;
+
+        if (p->cap - p->end < len) {
+            p->cap = p->cap == 0 ? PARSER_READ_SIZE : p->cap * 2;
+            if (p->cap - p->end < len) p->cap = p->end + len;
+            p->buff = realloc(p->buff, p->cap);
+        }
+
+    }
+
+    return p->buff + p->end;
+
+}
+
+char *parser_space(struct parser *p, size_t *len) {
+    char *space = parser_reserve(p, PARSER_READ_SIZE);
+    *len = p->cap - p->end;
+    return space;
+}
+
+void parser_commit(struct parser *p, size_t len) {
+    p->end += len;
+}
+
+size_t parser_pending(struct parser *p) {
+    return p->end - p->start;
+}
+
+void parser_release(struct parser *p) {
+    if (p->start != p->end) return;
+    free(p->buff);
+    p->buff = NULL;
+    p->cap = 0;
+    p->start = 0;
+    p->end = 0;
+}
+
+int parser_next(struct parser *p, struct packet *pkt) {
+
+    char *buff = p->buff + p->start;
+    size_t available = p->end - p->start;
+
+    if (available < sizeof(uint32_t)) return 0;
+
+    pkt->pa_num = read_u32(buff);
+    pkt->room = 0;
+    pkt->id = 0;
+    pkt->version = 0;
+    pkt->len = 0;
+    pkt->data = NULL;
+
+    size_t size = sizeof(uint32_t);
+    int fields = get_fields(pkt->pa_num);
+
+    if (fields < 0) return -1;
+
+    if (fields & F_ROOM) {
+        if (available < size + sizeof(uint32_t)) return 0;
+        pkt->room = read_u32(buff + size);
+        size += sizeof(uint32_t);
+    }
+
+    if (fields & (F_ID | F_LIST | F_HISTORY)) {
+        if (available < size + sizeof(uint32_t)) return 0;
+        pkt->id = read_u32(buff + size);
+        size += sizeof(uint32_t);
+    }
+
+    if (fields & F_VERSION) {
+        if (available < size + sizeof(uint64_t)) return 0;
+        pkt->version = (uint64_t) read_u32(buff + size) << 32 | read_u32(buff + size + sizeof(uint32_t));
+        size += sizeof(uint64_t);
+    }
+
+    if (fields & F_LEN) {
+
+        if (available < size + sizeof(uint32_t)) return 0;
+        pkt->len = read_u32(buff + size);
+        size += sizeof(uint32_t);
+
+        if (pkt->len > p->max_packet - size) return -1;
+
+    } else if (fields & (F_LIST | F_HISTORY)) {
+
+        // The size of the list is only known once the length of each string has been read
+        int strings = fields & F_HISTORY ? 2 : 1;
+        size_t len = 0;
+        for (uint32_t i = 0; i < pkt->id; i++) {
+
+            len += sizeof(uint32_t);
+
+            for (int s = 0; s < strings; s++) {
+                if (available < size + len + sizeof(uint32_t)) return 0;
+                len += sizeof(uint32_t) + read_u32(buff + size + len);
+                if (len > p->max_packet - size) return -1;
+            }
+
+        }
+
+        pkt->len = len;
+
+    }
+
+    if (available < size + pkt->len) return 0;
+
+    pkt->data = buff + size;
+    p->start += size + pkt->len;
+
+    // Reads start at the beginning of the buffer again once everything is parsed
+    if (p->start == p->end) {
+        p->start = 0;
+        p->end = 0;
+    }
+
+    return 1;
+
+}
+
+bool packet_next_user(struct packet *pkt, size_t *off, uint32_t *id, char **name, uint32_t *name_len) {
+
+    if (*off >= pkt->len) return false;
+
+    *id = read_u32(pkt->data + *off);
+    *name_len = read_u32(pkt->data + *off + sizeof(uint32_t));
+    *name = pkt->data + *off + 2 * sizeof(uint32_t);
+    *off += 2 * sizeof(uint32_t) + *name_len;
+
+    return true;
+
+}
+
+bool packet_next_msg(struct packet *pkt, size_t *off, uint32_t *id, char **name, uint32_t *name_len, char **msg, uint32_t *msg_len) {
+
+    if (!packet_next_user(pkt, off, id, name, name_len)) return false;
+
+    *msg_len = read_u32(pkt->data + *off);
+    *msg = pkt->data + *off + sizeof(uint32_t);
+    *off += sizeof(uint32_t) + *msg_len;
+
+    return true;
+
+}
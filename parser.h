@@ -0,0 +1,77 @@
+#ifndef DEF_PARSER
+#define DEF_PARSER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Incremental packet parser, shared by the client and the server.
+ *
+ * Data read from the connection is appended to a buffer large enough to hold a whole TLS record, so that a single
+ * read usually returns several packets. Complete packets are then parsed in place : the payload of a parsed packet
+ * points into the buffer, and stays valid until the next call to parser_space. A packet split across reads is kept
+ * in the buffer and completed by the following reads.
+ */
+
+// Space made available for each read, the maximum size of a TLS record
+#define PARSER_READ_SIZE (16 * 1024)
+
+struct packet {
+    uint32_t pa_num;
+    uint32_t room;      // Room of a PA_MSG, PA_HISTORY, PA_USRJOIN, PA_USRLEAVE, PA_USRLIST, PA_USRUPDATE, PA_JOINROOM or PA_LEAVEROOM
+    uint32_t id;        // Client id of a PA_MSG, PA_DM, PA_USERID, PA_USRJOIN or PA_USRLEAVE, number of entries of a PA_USRLIST, PA_USRUPDATE or PA_HISTORY,
+                        // capabilities of a PA_CONNACCEPT or PA_CAPS, size of the packets of a PA_COMPRESSED once decompressed,
+                        // server instance of a PA_PRESENCE
+    uint64_t version;   // Version of the list of users of a PA_PRESENCE, token of a PA_PING or PA_PONG
+    uint32_t len;       // Length of the payload
+    char *data;         // Payload : text of a PA_MSG, PA_DM, PA_SYS, PA_USERNAME or PA_USRJOIN, entries of a PA_USRLIST, PA_USRUPDATE or PA_HISTORY,
+                        // compressed packets of a PA_COMPRESSED
+};
+
+struct parser {
+    char *buff;
+    size_t cap;
+    size_t start;       // First byte not parsed yet
+    size_t end;         // End of the data read
+    size_t max_packet;  // Size of the largest packet accepted
+};
+
+void parser_init(struct parser *p, size_t max_packet);
+
+void parser_destroy(struct parser *p);
+
+// Get space to read at least PARSER_READ_SIZE bytes into. Invalidates the packets parsed so far.
+char *parser_space(struct parser *p, size_t *len);
+
+// Get space to write at least `len` bytes into. Invalidates the packets parsed so far.
+char *parser_reserve(struct parser *p, size_t len);
+
+// Add `len` bytes read into the space returned by parser_space or parser_reserve
+void parser_commit(struct parser *p, size_t len);
+
+/*
+ * Parse the next complete packet.
+ * Returns 1 if a packet was parsed, 0 if more data is needed, and -1 if the data is not a valid packet.
+ */
+int parser_next(struct parser *p, struct packet *pkt);
+
+// Number of bytes read but not parsed yet
+size_t parser_pending(struct parser *p);
+
+// Free the buffer if no partial packet is waiting, so that idle connections do not keep it
+void parser_release(struct parser *p);
+
+/*
+ * Get the next user of a PA_USRLIST or PA_USRUPDATE packet, starting with `*off` = 0.
+ * Returns false once all the users have been read.
+ */
+bool packet_next_user(struct packet *pkt, size_t *off, uint32_t *id, char **name, uint32_t *name_len);
+
+/*
+ * Get the next message of a PA_HISTORY packet, starting with `*off` = 0.
+ * Returns false once all the messages have been read.
+ */
+bool packet_next_msg(struct packet *pkt, size_t *off, uint32_t *id, char **name, uint32_t *name_len, char **msg, uint32_t *msg_len);
+
+#endif
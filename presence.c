@@ -0,0 +1,372 @@
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "packets.h"
+#include "presence.h"
+
+// Size of the header of a PA_USRLIST, of a PA_USRJOIN before its user, and of a PA_PRESENCE
+#define LIST_HEADER (3 * sizeof(uint32_t))
+#define JOIN_HEADER (2 * sizeof(uint32_t))
+#define PRESENCE_PACKET (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
+static uint32_t read_u32(const char *buff) {
+    uint32_t n;
+    memcpy(&n, buff, sizeof(uint32_t));
+    return ntohl(n);
+}
+
+static void free_snapshot(void *ptr) {
+    struct presence_snapshot *s = ptr;
+    for (int i = 0; i < 2; i++) {
+        struct frame *z = atomic_load_explicit(&s->compressed[i], memory_order_relaxed);
+        if (z != NULL) frame_release(z);
+    }
+    frame_release(s->list);
+    free(s);
+}
+
+static void free_event(void *ptr) {
+    struct presence_event *e = ptr;
+    frame_release(e->frame);
+    free(e);
+}
+
+static struct presence_snapshot *new_snapshot(struct frame *list, uint64_t version) {
+    struct presence_snapshot *s = malloc(sizeof(struct presence_snapshot));
+    s->list = list;
+    s->version = version;
+    atomic_init(&s->compressed[0], NULL);
+    atomic_init(&s->compressed[1], NULL);
+    return s;
+}
+
+void presence_init(struct presence *p, size_t keep) {
+
+    // Clients must not mistake the versions of a previous instance for the ones of this one
+    if (getrandom(&p->instance, sizeof(p->instance), 0) != sizeof(p->instance)) {
+        p->instance = (uint32_t) time(NULL) ^ (uint32_t) getpid() << 16;
+    }
+
+    uint32_t header[3] = {htonl(PA_USRLIST), htonl(LOBBY_ROOM), 0};
+    struct presence_state *s = calloc(1, sizeof(struct presence_state));
+    s->snapshot = new_snapshot(frame_new(PA_USRLIST, header, sizeof(header), NULL, 0), 0);
+
+    atomic_init(&p->state, s);
+    pthread_mutex_init(&p->lock, NULL);
+    atomic_flag_clear(&p->compacting);
+
+    p->keep = keep;
+    p->cap = 64;
+    p->head = 0;
+    p->len = 0;
+    p->events = malloc(p->cap * sizeof(struct presence_event *));
+
+}
+
+static void push_event(struct presence *p, struct presence_event *e) {
+
+    if (p->len == p->cap) {
+
+        struct presence_event **events = malloc(2 * p->cap * sizeof(struct presence_event *));
+        for (size_t i = 0; i < p->len; i++) events[i] = p->events[(p->head + i) % p->cap];
+
+        free(p->events);
+        p->events = events;
+        p->head = 0;
+        p->cap *= 2;
+
+    }
+
+    p->events[(p->head + p->len) % p->cap] = e;
+    p->len++;
+
+}
+
+void presence_add(struct presence *p, struct epoch_thread *t, uint64_t seq, struct frame *f) {
+
+    struct presence_event *e = malloc(sizeof(struct presence_event));
+    struct presence_state *s = malloc(sizeof(struct presence_state));
+
+    pthread_mutex_lock(&p->lock);
+
+    struct presence_state *old = atomic_load_explicit(&p->state, memory_order_relaxed);
+    *s = *old;
+
+    e->version = old->version + 1;
+    e->seq = seq;
+    e->frame = f;
+    e->prev = old->last;
+
+    s->last = e;
+    s->version = e->version;
+    s->seq = seq;
+    s->count += f->pa_num == PA_USRJOIN ? 1 : -1;
+
+    // Forget the oldest events already merged into the snapshot, beyond the ones kept for the reconnecting clients.
+    // Readers never follow the links to them, as they only walk back the events after the snapshot or `forgotten`.
+    while (p->len >= p->keep && p->events[p->head]->version <= s->snapshot->version) {
+        struct presence_event *oldest = p->events[p->head];
+        p->head = (p->head + 1) % p->cap;
+        p->len--;
+        s->forgotten = oldest->version;
+        epoch_retire(t, oldest, free_event);
+    }
+
+    push_event(p, e);
+    atomic_store_explicit(&p->state, s, memory_order_release);
+
+    pthread_mutex_unlock(&p->lock);
+
+    epoch_retire(t, old, free);
+
+}
+
+// Users are looked up by id while merging the events, ids are spread by the Knuth multiplicative hash
+static size_t slot(uint32_t id, size_t mask) {
+    return (size_t) (id * 2654435761u) & mask;
+}
+
+/*
+ * Build the list of users once the `n` events before `last` are applied to a snapshot. A user may leave and a new one
+ * get the same id in between, so only the last event of each id counts.
+ */
+static struct frame *merge(struct presence_snapshot *snapshot, struct presence_event *last, uint64_t n) {
+
+    struct presence_event **events = malloc(n * sizeof(struct presence_event *));
+    size_t len = snapshot->list->len;
+
+    for (uint64_t i = n; i > 0; i--) {
+        events[i - 1] = last;
+        if (last->frame->pa_num == PA_USRJOIN) len += last->frame->len - JOIN_HEADER;
+        last = last->prev;
+    }
+
+    // Last event of each id, as its position plus one
+    size_t mask = 1;
+    while (mask < 2 * n) mask = 2 * mask + 1;
+    uint32_t *ids = malloc((mask + 1) * sizeof(uint32_t));
+    uint32_t *latest = calloc(mask + 1, sizeof(uint32_t));
+
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t id = read_u32(events[i]->frame->data + 2 * sizeof(uint32_t));
+        size_t b = slot(id, mask);
+        while (latest[b] != 0 && ids[b] != id) b = (b + 1) & mask;
+        ids[b] = id;
+        latest[b] = i + 1;
+    }
+
+    struct frame *list = frame_alloc(PA_USRLIST, len);
+    char *out = list->data + LIST_HEADER;
+    uint32_t count = 0;
+
+    // Users of the snapshot without any event since then
+    const char *in = snapshot->list->data + LIST_HEADER;
+    const char *end = snapshot->list->data + snapshot->list->len;
+
+    while (in < end) {
+
+        uint32_t id = read_u32(in);
+        size_t size = 2 * sizeof(uint32_t) + read_u32(in + sizeof(uint32_t));
+
+        size_t b = slot(id, mask);
+        while (latest[b] != 0 && ids[b] != id) b = (b + 1) & mask;
+
+        if (latest[b] == 0) {
+            memcpy(out, in, size);
+            out += size;
+            count++;
+        }
+
+        in += size;
+
+    }
+
+    // Users whose last event is their join
+    for (uint64_t i = 0; i < n; i++) {
+
+        struct frame *f = events[i]->frame;
+        if (f->pa_num != PA_USRJOIN) continue;
+
+        uint32_t id = read_u32(f->data + 2 * sizeof(uint32_t));
+        size_t b = slot(id, mask);
+        while (latest[b] != 0 && ids[b] != id) b = (b + 1) & mask;
+
+        if (latest[b] == i + 1) {
+            memcpy(out, f->data + JOIN_HEADER, f->len - JOIN_HEADER);
+            out += f->len - JOIN_HEADER;
+            count++;
+        }
+
+    }
+
+    uint32_t header[3] = {htonl(PA_USRLIST), htonl(LOBBY_ROOM), htonl(count)};
+    memcpy(list->data, header, sizeof(header));
+    list->len = out - list->data;
+
+    free(ids);
+    free(latest);
+    free(events);
+
+    return list;
+
+}
+
+struct frame *presence_update(struct frame **events, uint32_t n, size_t extra) {
+
+    // Slot of each id, holding the position plus one of its join that no leave followed yet, or PAIRED
+    const uint32_t PAIRED = UINT32_MAX;
+    size_t mask = 1;
+    while (mask < 2 * (size_t) n) mask = 2 * mask + 1;
+    uint32_t *ids = malloc((mask + 1) * sizeof(uint32_t));
+    uint32_t *joins = calloc(mask + 1, sizeof(uint32_t));
+    bool *cancelled = calloc(n, sizeof(bool));
+
+    for (uint32_t i = 0; i < n; i++) {
+
+        uint32_t id = read_u32(events[i]->data + 2 * sizeof(uint32_t));
+        size_t b = slot(id, mask);
+        while (joins[b] != 0 && ids[b] != id) b = (b + 1) & mask;
+        ids[b] = id;
+
+        if (events[i]->pa_num == PA_USRJOIN) {
+            joins[b] = i + 1;
+        } else if (joins[b] != 0 && joins[b] != PAIRED) {
+            cancelled[joins[b] - 1] = true;
+            cancelled[i] = true;
+            joins[b] = PAIRED;
+        } else {
+            joins[b] = PAIRED;
+        }
+
+    }
+
+    uint32_t count = 0;
+    size_t len = LIST_HEADER + extra;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (cancelled[i]) continue;
+        len += events[i]->pa_num == PA_USRJOIN ? events[i]->len - JOIN_HEADER : 2 * sizeof(uint32_t);
+        count++;
+    }
+
+    struct frame *f = NULL;
+
+    if (count == 0) {
+
+        if (extra > 0) f = frame_alloc(PA_USRUPDATE, extra);
+
+    } else {
+
+        f = frame_alloc(PA_USRUPDATE, len);
+        uint32_t header[3] = {htonl(PA_USRUPDATE), htonl(LOBBY_ROOM), htonl(count)};
+        memcpy(f->data, header, sizeof(header));
+        char *out = f->data + sizeof(header);
+
+        // An id may leave and be given to a new user among the events : leaves are applied first
+        for (uint32_t i = 0; i < n; i++) {
+            if (cancelled[i] || events[i]->pa_num == PA_USRJOIN) continue;
+            uint32_t user[2] = {0, 0};
+            memcpy(user, events[i]->data + 2 * sizeof(uint32_t), sizeof(uint32_t));
+            memcpy(out, user, sizeof(user));
+            out += sizeof(user);
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (cancelled[i] || events[i]->pa_num != PA_USRJOIN) continue;
+            memcpy(out, events[i]->data + JOIN_HEADER, events[i]->len - JOIN_HEADER);
+            out += events[i]->len - JOIN_HEADER;
+        }
+
+    }
+
+    free(ids);
+    free(joins);
+    free(cancelled);
+
+    return f;
+
+}
+
+void presence_compact(struct presence *p, struct epoch_thread *t) {
+
+    epoch_enter(t);
+
+    struct presence_state *s = atomic_load_explicit(&p->state, memory_order_acquire);
+    uint64_t n = s->version - s->snapshot->version;
+
+    if (n <= PRESENCE_MIN_EVENTS + s->count / 4 || atomic_flag_test_and_set(&p->compacting)) {
+        epoch_exit(t);
+        return;
+    }
+
+    // The snapshot of the state read may not be the last one anymore if another thread just built one
+    struct presence_snapshot *old_snapshot = s->snapshot;
+    struct presence_snapshot *snapshot = NULL;
+
+    if (atomic_load_explicit(&p->state, memory_order_acquire)->snapshot == old_snapshot) {
+        snapshot = new_snapshot(merge(old_snapshot, s->last, n), s->version);
+    }
+
+    epoch_exit(t);
+
+    if (snapshot == NULL) {
+        atomic_flag_clear(&p->compacting);
+        return;
+    }
+
+    // Events may have been added meanwhile, they stay after the new snapshot
+    struct presence_state *ns = malloc(sizeof(struct presence_state));
+
+    pthread_mutex_lock(&p->lock);
+    struct presence_state *old = atomic_load_explicit(&p->state, memory_order_relaxed);
+    *ns = *old;
+    ns->snapshot = snapshot;
+    atomic_store_explicit(&p->state, ns, memory_order_release);
+    pthread_mutex_unlock(&p->lock);
+
+    epoch_retire(t, old, free);
+    epoch_retire(t, old_snapshot, free_snapshot);
+
+    atomic_flag_clear(&p->compacting);
+
+}
+
+struct presence_snapshot *presence_read(struct presence *p, uint64_t since, struct frame **delta, uint64_t *seq) {
+
+    struct presence_state *s = atomic_load_explicit(&p->state, memory_order_acquire);
+    struct presence_snapshot *snapshot = s->snapshot;
+    uint64_t from = snapshot->version;
+
+    // The events since the version of the client are sent instead of the whole list if they are fewer than the users
+    if (since != PRESENCE_NONE && since >= s->forgotten && since <= s->version
+        && s->version - since <= s->count + (s->version - from)) {
+        snapshot = NULL;
+        from = since;
+    }
+
+    uint64_t n = s->version - from;
+    struct frame **events = malloc(n * sizeof(struct frame *));
+
+    struct presence_event *e = s->last;
+    for (uint64_t i = n; i > 0; i--) {
+        events[i - 1] = e->frame;
+        e = e->prev;
+    }
+
+    struct frame *f = presence_update(events, n, PRESENCE_PACKET);
+    free(events);
+
+    uint32_t packet[4] = {htonl(PA_PRESENCE), htonl(p->instance), htonl(s->version >> 32), htonl(s->version)};
+    memcpy(f->data + f->len - PRESENCE_PACKET, packet, sizeof(packet));
+    f->pa_num = PA_PRESENCE;
+
+    *delta = f;
+    *seq = s->seq;
+    return snapshot;
+
+}
@@ -0,0 +1,103 @@
+#ifndef DEF_PRESENCE
+#define DEF_PRESENCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "epoch.h"
+#include "frame.h"
+
+/*
+ * Versioned list of the users of the lobby, kept serialized for the users joining.
+ *
+ * The list is a snapshot, a PA_USRLIST frame shared by every user joining, followed by the PA_USRJOIN and PA_USRLEAVE
+ * frames of the joins and leaves that happened since then. Adding a join or a leave and reading the list are both
+ * O(1) whatever the number of users, the events after the snapshot being few : once they are too many compared to the
+ * size of the list, a new snapshot is built from the previous one and the events, outside of any lock.
+ *
+ * The version of the list is the number of joins and leaves so far. The last events are kept a while after being
+ * merged into a snapshot, so that a client reconnecting with the list it had at some version only gets the events
+ * since then. Versions are only meaningful for the same server instance, as they start again from 0 on restart.
+ *
+ * The list is read without a lock, in an epoch critical section : snapshots, events and states are retired through
+ * the epoch of the thread replacing them.
+ */
+
+// Version given by clients that do not have any list
+#define PRESENCE_NONE UINT64_MAX
+
+// Events after the snapshot from which a new snapshot is built, plus one for every 4 users
+#define PRESENCE_MIN_EVENTS 64
+
+struct presence_snapshot {
+    struct frame *list;                         // PA_USRLIST of the lobby
+    uint64_t version;
+    _Atomic(struct frame *) compressed[2];      // List as sent compressed without and with the preset dictionary,
+                                                // built by the first client needing it
+};
+
+struct presence_event {
+    uint64_t version;
+    uint64_t seq;                               // Presence sequence number of the event
+    struct frame *frame;                        // PA_USRJOIN or PA_USRLEAVE
+    struct presence_event *prev;
+};
+
+// State of the list, replaced by every change
+struct presence_state {
+    struct presence_snapshot *snapshot;
+    struct presence_event *last;                // Last event, NULL if none
+    uint64_t version;
+    uint64_t seq;                               // Presence sequence number of the last event
+    uint64_t forgotten;                         // Events up to this version are not kept anymore
+    uint32_t count;                             // Number of users
+};
+
+struct presence {
+    uint32_t instance;                          // Random identifier of the server instance
+    _Atomic(struct presence_state *) state;
+    pthread_mutex_t lock;                       // Serializes the changes of state
+    atomic_flag compacting;                     // A new snapshot is being built
+
+    // Events kept, oldest first, as a ring buffer
+    struct presence_event **events;
+    size_t head;
+    size_t len;
+    size_t cap;
+    size_t keep;                                // Events kept for the reconnecting clients
+};
+
+// Create an empty list, keeping at least the last `keep` events for the reconnecting clients
+void presence_init(struct presence *p, size_t keep);
+
+/*
+ * Add a join or a leave, taking over the reference to its frame. Events must be added in the order of their sequence
+ * numbers, so the caller must serialize the calls.
+ */
+void presence_add(struct presence *p, struct epoch_thread *t, uint64_t seq, struct frame *f);
+
+/*
+ * Build a new snapshot if there are too many events since the last one. Only one thread builds it at a time, others
+ * return right away. Must not be called in an epoch critical section.
+ */
+void presence_compact(struct presence *p, struct epoch_thread *t);
+
+/*
+ * Build the PA_USRUPDATE packet of `n` joins and leaves of the lobby, in the order they happened, leaving out the users
+ * who joined and then left among them. The frame is followed by `extra` bytes left to the caller.
+ * Returns NULL if there is nothing left to send and `extra` is 0.
+ */
+struct frame *presence_update(struct frame **events, uint32_t n, size_t extra);
+
+/*
+ * Get what a joining client must be sent to know the list of users : the snapshot, or NULL if the client has the list
+ * at version `since` and it is shorter to only send it the events since then, and in `delta` a frame holding the
+ * PA_USRUPDATE of the events after the snapshot or after `since`, followed by a PA_PRESENCE packet with the version of
+ * the list.
+ * `seq` is set to the presence sequence number of the list.
+ * Must be called in an epoch critical section, the snapshot being only valid until its end.
+ */
+struct presence_snapshot *presence_read(struct presence *p, uint64_t since, struct frame **delta, uint64_t *seq);
+
+#endif
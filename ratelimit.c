@@ -0,0 +1,47 @@
+#include "ratelimit.h"
+
+static void refill(double *tokens, double rate, double elapsed) {
+    if (rate <= 0) return;
+    *tokens += rate * elapsed;
+    if (*tokens > rate * RATE_BURST) *tokens = rate * RATE_BURST;
+}
+
+static void refill_all(struct rate_limit *l, const struct rate_config *cfg, uint64_t now) {
+    if (now <= l->last) return;
+    double elapsed = (now - l->last) / 1e6;
+    refill(&l->msgs, cfg->msg_rate, elapsed);
+    refill(&l->bytes, cfg->byte_rate, elapsed);
+    l->last = now;
+}
+
+void rate_limit_init(struct rate_limit *l, const struct rate_config *cfg, uint64_t now) {
+    l->msgs = cfg->msg_rate * RATE_BURST;
+    l->bytes = cfg->byte_rate * RATE_BURST;
+    l->last = now;
+}
+
+bool rate_limit_take(struct rate_limit *l, const struct rate_config *cfg, size_t bytes, uint64_t now, bool debt) {
+
+    refill_all(l, cfg, now);
+
+    bool allowed = (cfg->msg_rate <= 0 || l->msgs >= 1) && (cfg->byte_rate <= 0 || l->bytes >= bytes);
+    if (!allowed && !debt) return false;
+
+    if (cfg->msg_rate > 0) l->msgs -= 1;
+    if (cfg->byte_rate > 0) l->bytes -= bytes;
+    return allowed;
+
+}
+
+uint64_t rate_limit_wait(struct rate_limit *l, const struct rate_config *cfg, uint64_t now) {
+
+    refill_all(l, cfg, now);
+
+    double wait = 0;
+    if (cfg->msg_rate > 0 && l->msgs < 0) wait = -l->msgs / cfg->msg_rate;
+    if (cfg->byte_rate > 0 && l->bytes < 0 && -l->bytes / cfg->byte_rate > wait) wait = -l->bytes / cfg->byte_rate;
+
+    // Rounded up, so that the buckets are out of debt once the time has passed
+    return wait > 0 ? (uint64_t) (wait * 1e6) + 1 : 0;
+
+}
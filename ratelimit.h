@@ -0,0 +1,43 @@
+#ifndef DEF_RATELIMIT
+#define DEF_RATELIMIT
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Token buckets limiting the packets and the bytes a client may send per second.
+ *
+ * Each bucket holds up to `burst` tokens and is refilled at `rate` tokens per second, lazily when it is used. A packet
+ * takes one token from the first bucket and one per byte from the second. A bucket may go into debt, in which case the
+ * client must wait for it to be refilled above 0 before sending again.
+ * A bucket is owned by a single thread, so it is not synchronized.
+ */
+
+// Seconds of traffic at full rate a client may send at once
+#define RATE_BURST 2
+
+struct rate_config {
+    double msg_rate;        // Packets per second, 0 for no limit
+    double byte_rate;       // Bytes per second, 0 for no limit
+};
+
+struct rate_limit {
+    double msgs;            // Tokens left
+    double bytes;
+    uint64_t last;          // Last time the buckets were refilled (microseconds)
+};
+
+// Start with full buckets at time `now` (microseconds)
+void rate_limit_init(struct rate_limit *l, const struct rate_config *cfg, uint64_t now);
+
+/*
+ * Take the tokens of a packet of `bytes` bytes at time `now` (microseconds). Returns whether there were enough of them.
+ * If there were not, they are only taken if `debt` is set.
+ */
+bool rate_limit_take(struct rate_limit *l, const struct rate_config *cfg, size_t bytes, uint64_t now, bool debt);
+
+// Time from `now` until the buckets are out of debt (microseconds), 0 if they are not in debt
+uint64_t rate_limit_wait(struct rate_limit *l, const struct rate_config *cfg, uint64_t now);
+
+#endif
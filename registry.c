@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include "registry.h"
+
+#define SLOT_MASK (REGISTRY_MAX_SLOTS - 1)
+#define GEN_MASK ((1u << REGISTRY_GEN_BITS) - 1)
+
+static struct registry_slot *get_slot(struct registry *reg, uint32_t slot) {
+    struct registry_slot *chunk = atomic_load_explicit(&reg->chunks[slot >> REGISTRY_CHUNK_BITS], memory_order_acquire);
+    return &chunk[slot & (REGISTRY_CHUNK_SIZE - 1)];
+}
+
+static uint32_t make_id(struct registry *reg, uint32_t slot, uint32_t gen) {
+    return (gen << (REGISTRY_SLOT_BITS + REGISTRY_SHARD_BITS)) | (reg->shard << REGISTRY_SLOT_BITS) | slot;
+}
+
+void registry_init(struct registry *reg, uint32_t shard) {
+    reg->shard = shard;
+    for (uint32_t i = 0; i < REGISTRY_MAX_CHUNKS; i++) atomic_init(&reg->chunks[i], NULL);
+    atomic_init(&reg->nb_slots, 0);
+    reg->free_slot = REGISTRY_NO_SLOT;
+    reg->active = NULL;
+    reg->active_slots = NULL;
+    reg->count = 0;
+    reg->active_cap = 0;
+}
+
+void registry_destroy(struct registry *reg) {
+    for (uint32_t i = 0; i < REGISTRY_MAX_CHUNKS; i++) free(atomic_load(&reg->chunks[i]));
+    free(reg->active);
+    free(reg->active_slots);
+    registry_init(reg, reg->shard);
+}
+
+// Use a new slot after the last one. The registry must not be full.
+static uint32_t grow(struct registry *reg) {
+
+    uint32_t slot = atomic_load_explicit(&reg->nb_slots, memory_order_relaxed);
+
+    // Chunks are initialized before being published, and never move once they are
+    if ((slot & (REGISTRY_CHUNK_SIZE - 1)) == 0) {
+        struct registry_slot *chunk = malloc(sizeof(struct registry_slot) * REGISTRY_CHUNK_SIZE);
+        for (uint32_t i = 0; i < REGISTRY_CHUNK_SIZE; i++) {
+            atomic_init(&chunk[i].client, NULL);
+            atomic_init(&chunk[i].gen, 0);
+        }
+        atomic_store_explicit(&reg->chunks[slot >> REGISTRY_CHUNK_BITS], chunk, memory_order_release);
+    }
+
+    atomic_store_explicit(&reg->nb_slots, slot + 1, memory_order_release);
+    return slot;
+
+}
+
+// Make a free slot active, holding a client
+static void activate(struct registry *reg, uint32_t slot, struct client *c) {
+
+    struct registry_slot *s = get_slot(reg, slot);
+
+    if (reg->count == reg->active_cap) {
+        reg->active_cap = reg->active_cap == 0 ? 64 : reg->active_cap * 2;
+        reg->active = realloc(reg->active, sizeof(struct client *) * reg->active_cap);
+        reg->active_slots = realloc(reg->active_slots, sizeof(uint32_t) * reg->active_cap);
+    }
+
+    reg->active[reg->count] = c;
+    reg->active_slots[reg->count] = slot;
+
+    s->link = reg->count;
+    reg->count++;
+
+    // Publish the client last, readers seeing it also see everything written to it before
+    atomic_store_explicit(&s->client, c, memory_order_release);
+
+}
+
+uint32_t registry_add(struct registry *reg, struct client *c) {
+
+    uint32_t slot = reg->free_slot;
+
+    if (slot != REGISTRY_NO_SLOT) {
+        reg->free_slot = get_slot(reg, slot)->link;
+    } else {
+        if (atomic_load_explicit(&reg->nb_slots, memory_order_relaxed) == REGISTRY_MAX_SLOTS) return REGISTRY_NO_SLOT;
+        slot = grow(reg);
+    }
+
+    activate(reg, slot, c);
+    return make_id(reg, slot, atomic_load_explicit(&get_slot(reg, slot)->gen, memory_order_relaxed));
+
+}
+
+bool registry_restore(struct registry *reg, uint32_t id, struct client *c) {
+
+    uint32_t slot = id & SLOT_MASK;
+    if (registry_shard(id) != reg->shard) return false;
+
+    // Slots skipped to reach the one of the client are free. Clients restored in the order of their slots never have
+    // to be taken out of the free list.
+    while (atomic_load_explicit(&reg->nb_slots, memory_order_relaxed) <= slot) {
+        uint32_t skipped = grow(reg);
+        get_slot(reg, skipped)->link = reg->free_slot;
+        reg->free_slot = skipped;
+    }
+
+    struct registry_slot *s = get_slot(reg, slot);
+    if (atomic_load_explicit(&s->client, memory_order_relaxed) != NULL) return false;
+
+    uint32_t *link = &reg->free_slot;
+    while (*link != slot) link = &get_slot(reg, *link)->link;
+    *link = s->link;
+
+    atomic_store_explicit(&s->gen, id >> (REGISTRY_SLOT_BITS + REGISTRY_SHARD_BITS), memory_order_relaxed);
+    activate(reg, slot, c);
+    return true;
+
+}
+
+struct client *registry_slot_client(struct registry *reg, uint32_t slot, uint32_t *id) {
+
+    struct registry_slot *s = get_slot(reg, slot);
+    struct client *c;
+    uint32_t gen;
+
+    // The generation is changed after the client is unpublished : if the client did not change after reading the
+    // generation, the generation is the one of the client
+    do {
+        c = atomic_load_explicit(&s->client, memory_order_acquire);
+        if (c == NULL) return NULL;
+        gen = atomic_load_explicit(&s->gen, memory_order_acquire);
+    } while (atomic_load_explicit(&s->client, memory_order_relaxed) != c);
+
+    *id = make_id(reg, slot, gen);
+    return c;
+
+}
+
+uint32_t registry_nb_slots(struct registry *reg) {
+    return atomic_load_explicit(&reg->nb_slots, memory_order_acquire);
+}
+
+struct client *registry_get(struct registry *reg, uint32_t id) {
+
+    uint32_t slot = id & SLOT_MASK;
+    uint32_t slot_id;
+
+    if (registry_shard(id) != reg->shard || slot >= registry_nb_slots(reg)) return NULL;
+
+    struct client *c = registry_slot_client(reg, slot, &slot_id);
+    return c != NULL && slot_id == id ? c : NULL;
+
+}
+
+void registry_remove(struct registry *reg, uint32_t id) {
+
+    if (registry_get(reg, id) == NULL) return;
+
+    uint32_t slot = id & SLOT_MASK;
+    struct registry_slot *s = get_slot(reg, slot);
+    uint32_t index = s->link;
+
+    // Move the last active client in place of the removed one
+    reg->count--;
+    reg->active[index] = reg->active[reg->count];
+    reg->active_slots[index] = reg->active_slots[reg->count];
+    get_slot(reg, reg->active_slots[index])->link = index;
+
+    atomic_store_explicit(&s->client, NULL, memory_order_relaxed);
+    atomic_store_explicit(&s->gen, (atomic_load_explicit(&s->gen, memory_order_relaxed) + 1) & GEN_MASK, memory_order_release);
+    s->link = reg->free_slot;
+    reg->free_slot = slot;
+
+}
@@ -0,0 +1,90 @@
+#ifndef DEF_REGISTRY
+#define DEF_REGISTRY
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Table of the connected clients of a reactor.
+ *
+ * Client ids are made of a slot index, the index of the registry (one per reactor) and a generation number that
+ * changes every time the slot is reused, so that a stale id never designates a new client :
+ *
+ *   | generation (8 bits) | registry (6 bits) | slot (18 bits) |
+ *
+ * Free slots are kept in a free list, and active clients are also stored in a dense array so that they can be iterated
+ * without looking at free slots.
+ *
+ * Only the reactor owning the registry may modify it or use the dense array, but other threads may look up clients
+ * and iterate over the slots without a lock : slots are allocated by chunks that never move, and the client pointers
+ * are published atomically. A client found this way may be removed concurrently, so its memory must be reclaimed
+ * through the epoch mechanism (see epoch.h) and readers must be in an epoch critical section.
+ */
+
+#define REGISTRY_SLOT_BITS 18
+#define REGISTRY_SHARD_BITS 6
+#define REGISTRY_GEN_BITS 8
+
+#define REGISTRY_MAX_SLOTS (1u << REGISTRY_SLOT_BITS)
+#define REGISTRY_MAX_SHARDS (1u << REGISTRY_SHARD_BITS)
+
+#define REGISTRY_CHUNK_BITS 10
+#define REGISTRY_CHUNK_SIZE (1u << REGISTRY_CHUNK_BITS)
+#define REGISTRY_MAX_CHUNKS (REGISTRY_MAX_SLOTS / REGISTRY_CHUNK_SIZE)
+
+#define REGISTRY_NO_SLOT UINT32_MAX
+
+struct client;
+
+struct registry_slot {
+    _Atomic(struct client *) client;    // NULL if the slot is free
+    _Atomic uint32_t gen;
+    uint32_t link;                      // Next free slot if the slot is free, index in the dense array otherwise
+};
+
+struct registry {
+    uint32_t shard;
+
+    _Atomic(struct registry_slot *) chunks[REGISTRY_MAX_CHUNKS];
+    _Atomic uint32_t nb_slots;
+    uint32_t free_slot;     // First free slot, or REGISTRY_NO_SLOT
+
+    // Active clients, and the slot of each of them
+    struct client **active;
+    uint32_t *active_slots;
+    uint32_t count;
+    uint32_t active_cap;
+};
+
+void registry_init(struct registry *reg, uint32_t shard);
+
+void registry_destroy(struct registry *reg);
+
+// Add a client to the registry. Returns its id, or REGISTRY_NO_SLOT if the registry is full.
+uint32_t registry_add(struct registry *reg, struct client *c);
+
+/*
+ * Add a client with the id it had in the registry of another process, so that its id does not change.
+ * Returns false if the id does not belong to this registry or its slot is taken.
+ */
+bool registry_restore(struct registry *reg, uint32_t id, struct client *c);
+
+// Remove the client with the given id from the registry
+void registry_remove(struct registry *reg, uint32_t id);
+
+// Get the client with the given id, or NULL if it is not connected anymore. May be called from any thread.
+struct client *registry_get(struct registry *reg, uint32_t id);
+
+// Number of slots ever used, slots above it are all free. May be called from any thread.
+uint32_t registry_nb_slots(struct registry *reg);
+
+// Get the client in a slot and its id, or NULL if the slot is free. May be called from any thread.
+struct client *registry_slot_client(struct registry *reg, uint32_t slot, uint32_t *id);
+
+// Index of the registry an id belongs to
+static inline uint32_t registry_shard(uint32_t id) {
+    return (id >> REGISTRY_SLOT_BITS) & (REGISTRY_MAX_SHARDS - 1);
+}
+
+#endif
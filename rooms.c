@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include "rooms.h"
+
+static size_t bucket(struct rooms *t, uint32_t id) {
+    // Knuth multiplicative hash, room ids are often small and consecutive
+    return (size_t) (id * 2654435761u) & t->mask;
+}
+
+void rooms_init(struct rooms *t, uint32_t nb_shards, uint32_t history_size, uint64_t idle_timeout) {
+    t->mask = 63;
+    t->buckets = calloc(t->mask + 1, sizeof(struct room *));
+    t->count = 0;
+    t->nb_shards = nb_shards;
+    t->history_size = history_size;
+    t->idle_timeout = idle_timeout;
+    t->idle_first = NULL;
+    t->idle_last = NULL;
+}
+
+// Add a room that lost its last member to the end of the idle rooms
+static void set_idle(struct rooms *t, struct room *room, uint64_t now) {
+    room->idle_since = now;
+    room->idle_next = NULL;
+    room->idle_prev = t->idle_last;
+    if (t->idle_last != NULL) t->idle_last->idle_next = room;
+    else t->idle_first = room;
+    t->idle_last = room;
+}
+
+static void unset_idle(struct rooms *t, struct room *room) {
+    if (room->idle_prev != NULL) room->idle_prev->idle_next = room->idle_next;
+    else t->idle_first = room->idle_next;
+    if (room->idle_next != NULL) room->idle_next->idle_prev = room->idle_prev;
+    else t->idle_last = room->idle_prev;
+}
+
+// Double the number of buckets once there are more rooms than buckets
+static void grow(struct rooms *t) {
+
+    size_t old_size = t->mask + 1;
+    struct room **old = t->buckets;
+
+    t->mask = 2 * old_size - 1;
+    t->buckets = calloc(t->mask + 1, sizeof(struct room *));
+
+    for (size_t i = 0; i < old_size; i++) {
+        struct room *room = old[i];
+        while (room != NULL) {
+            struct room *next = room->next;
+            size_t b = bucket(t, room->id);
+            room->next = t->buckets[b];
+            t->buckets[b] = room;
+            room = next;
+        }
+    }
+
+    free(old);
+
+}
+
+struct room *rooms_get(struct rooms *t, uint32_t id, uint64_t now) {
+
+    struct room *room = t->buckets[bucket(t, id)];
+    while (room != NULL && room->id != id) room = room->next;
+    if (room != NULL) return room;
+
+    if (t->count > t->mask) grow(t);
+
+    room = calloc(1, sizeof(struct room) + t->nb_shards * sizeof(struct room_members));
+    room->id = id;
+    room->nb_shards = t->nb_shards;
+    atomic_init(&room->refs, 1);
+    atomic_init(&room->shards, 0);
+    history_init(&room->history, t->history_size);
+
+    size_t b = bucket(t, id);
+    room->next = t->buckets[b];
+    t->buckets[b] = room;
+    t->count++;
+    set_idle(t, room, now);
+
+    return room;
+
+}
+
+struct room *rooms_join(struct rooms *t, uint32_t id, uint32_t shard, struct client *c, uint64_t since, uint64_t now) {
+
+    struct room *room = rooms_get(t, id, now);
+    if (room->count == 0) unset_idle(t, room);
+
+    struct room_members *local = &room->local[shard];
+    if (local->count == local->cap) {
+        local->cap = local->cap == 0 ? 4 : 2 * local->cap;
+        local->members = realloc(local->members, local->cap * sizeof(struct room_member));
+    }
+
+    local->members[local->count].client = c;
+    local->members[local->count].since = since;
+    local->members[local->count].history_pos = atomic_load_explicit(&room->history.head, memory_order_acquire);
+    local->count++;
+    room->count++;
+
+    if (local->count == 1) atomic_fetch_or_explicit(&room->shards, (uint64_t) 1 << shard, memory_order_relaxed);
+
+    room_ref(room, 1);
+    return room;
+
+}
+
+struct room_member *rooms_member(struct room *room, uint32_t shard, struct client *c) {
+    struct room_members *local = &room->local[shard];
+    for (uint32_t i = 0; i < local->count; i++) {
+        if (local->members[i].client == c) return &local->members[i];
+    }
+    return NULL;
+}
+
+void rooms_leave(struct rooms *t, struct room *room, uint32_t shard, struct client *c, uint64_t now) {
+
+    // Members are not kept in order, the last one takes the place of the leaving one
+    struct room_members *local = &room->local[shard];
+    for (uint32_t i = 0; i < local->count; i++) {
+        if (local->members[i].client != c) continue;
+        local->members[i] = local->members[--local->count];
+        room->count--;
+        break;
+    }
+
+    if (local->count == 0) atomic_fetch_and_explicit(&room->shards, ~((uint64_t) 1 << shard), memory_order_relaxed);
+
+    if (room->count == 0) set_idle(t, room, now);
+
+}
+
+void rooms_expire(struct rooms *t, uint64_t now) {
+
+    while (t->idle_first != NULL && now - t->idle_first->idle_since >= t->idle_timeout) {
+
+        struct room *room = t->idle_first;
+        unset_idle(t, room);
+
+        struct room **prev = &t->buckets[bucket(t, room->id)];
+        while (*prev != room) prev = &(*prev)->next;
+        *prev = room->next;
+        t->count--;
+
+        room_release(room);
+
+    }
+
+}
+
+void room_ref(struct room *room, int n) {
+    atomic_fetch_add_explicit(&room->refs, n, memory_order_relaxed);
+}
+
+void room_release(struct room *room) {
+
+    if (atomic_fetch_sub_explicit(&room->refs, 1, memory_order_acq_rel) != 1) return;
+
+    for (uint32_t i = 0; i < room->nb_shards; i++) free(room->local[i].members);
+    history_destroy(&room->history);
+    free(room);
+
+}
@@ -0,0 +1,97 @@
+#ifndef DEF_ROOMS
+#define DEF_ROOMS
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "history.h"
+
+/*
+ * Table of the rooms users joined, other than the lobby which every connected user is in.
+ *
+ * A room keeps its members in one compact array per reactor, so that a reactor sends a message of the room to its own
+ * members only, without a lock : the members of a reactor are only added and removed by that reactor. Joins and leaves
+ * of all the rooms are serialized by the caller, who must also serialize the reads of the members of other reactors.
+ *
+ * A room is reference counted : the table holds a reference, each member another one, and so does each broadcast to the
+ * room until every reactor handled it. A room without members is kept in the table with the history of its messages,
+ * so that the users joining it again see them, until it has been idle for the idle timeout of the table. It is then
+ * removed from the table, and freed with its last reference, along with its history.
+ */
+
+struct client;
+
+struct room_member {
+    struct client *client;
+    uint64_t since;         // Room sequence number of the join of the client
+    uint64_t history_pos;   // Position in the history of the first message not replayed to the client
+};
+
+struct room_members {
+    struct room_member *members;
+    uint32_t count;
+    uint32_t cap;
+};
+
+struct room {
+    uint32_t id;
+    atomic_int refs;
+    uint32_t count;                 // Number of members
+    uint32_t nb_shards;
+    atomic_uint_fast64_t shards;    // Reactors with at least one member, as a bit mask
+    struct room *next;              // Next room of the same bucket
+    struct history history;         // Last messages of the room
+
+    // Rooms without members, from the one idle for the longest time
+    uint64_t idle_since;            // Time the last member left (milliseconds)
+    struct room *idle_prev;
+    struct room *idle_next;
+
+    struct room_members local[];    // Members of each reactor
+};
+
+struct rooms {
+    struct room **buckets;
+    size_t mask;
+    size_t count;
+    uint32_t nb_shards;
+    uint32_t history_size;
+    uint64_t idle_timeout;          // Time a room without members is kept (milliseconds)
+    struct room *idle_first;
+    struct room *idle_last;
+};
+
+/*
+ * Create an empty table, for at most 64 reactors. Each room keeps its last `history_size` messages, and is kept for
+ * `idle_timeout` milliseconds once it has no members.
+ */
+void rooms_init(struct rooms *t, uint32_t nb_shards, uint32_t history_size, uint64_t idle_timeout);
+
+// Get a room, creating it without members at time `now` (milliseconds) if needed
+struct room *rooms_get(struct rooms *t, uint32_t id, uint64_t now);
+
+/*
+ * Add a client of reactor `shard` to a room, creating the room if needed. The client must not be a member already, and
+ * gets the messages added to the history from now on. Returns the room, on which the client holds a reference.
+ */
+struct room *rooms_join(struct rooms *t, uint32_t id, uint32_t shard, struct client *c, uint64_t since, uint64_t now);
+
+// Get the member of reactor `shard` of a room that is client `c`, NULL if it is not a member
+struct room_member *rooms_member(struct room *room, uint32_t shard, struct client *c);
+
+/*
+ * Remove a client of reactor `shard` from a room at time `now` (milliseconds). The caller keeps the reference of the
+ * client until it releases it.
+ */
+void rooms_leave(struct rooms *t, struct room *room, uint32_t shard, struct client *c, uint64_t now);
+
+// Remove the rooms that have been without members for the idle timeout at time `now` (milliseconds)
+void rooms_expire(struct rooms *t, uint64_t now);
+
+// Take `n` new references on a room
+void room_ref(struct room *room, int n);
+
+// Release a reference, the room is freed with its last reference
+void room_release(struct room *room);
+
+#endif
@@ -1,50 +1,380 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <asm-generic/errno.h>
-#include <bits/pthreadtypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "socket.h"
 #include "common.h"
 #include "packets.h"
+#include "bus.h"
+#include "frame.h"
+#include "registry.h"
+#include "epoch.h"
+#include "parser.h"
+#include "tickets.h"
+#include "names.h"
+#include "rooms.h"
+#include "history.h"
+#include "msglog.h"
+#include "compress.h"
+#include "presence.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "handoff.h"
 
 #define BUFF_SIZE 1024
-#define CONN_BACKLOG_SIZE 5
-#define MAX_CONNECTIONS 20
+#define CONN_BACKLOG_SIZE SOMAXCONN
+
+// File descriptors kept for the server itself when the maximum number of connections is derived from the fd limit
+#define RESERVED_FDS 64
+
+// Maximum number of events handled per epoll_wait call
+#define MAX_EVENTS 256
+
+// Maximum number of reads from a connection per event, so that a client sending a lot does not hold up the others
+#define READ_BUDGET 16
+
+// Default time allowed to complete the TLS handshake, and then to send the username (milliseconds)
+#define HANDSHAKE_TIMEOUT 5000
+#define USERNAME_TIMEOUT 5000
+
+// Default time after which a silent client is disconnected, being pinged halfway, and time after which a client that
+// does not read anything of what is sent to it is disconnected (milliseconds)
+#define IDLE_TIMEOUT 60000
+#define WRITE_TIMEOUT 30000
+
+// Maximum time an idle reactor keeps removed clients before trying to free them (milliseconds)
+#define EPOCH_POLL_INTERVAL 100
+
+// Default number of messages and bytes of messages a client may send per second, before being throttled
+#define MSG_RATE 10
+#define BYTE_RATE 4096
+
+// Default maximum number of bytes waiting to be sent to a client
+#define MAX_QUEUE_BYTES (256 * 1024)
+
+// Default number of TLS sessions kept for clients resuming without a ticket, and lifetime of a ticket key (seconds)
+#define SESSION_CACHE_SIZE 16384
+#define TICKET_KEY_LIFETIME 3600
+
+// Maximum number of frames written at once to a connection using kTLS
+#define MAX_IOV 64
+
+// Default size of a batch of messages, sent without waiting for the end of its window : a bit less than a TLS record
+#define BATCH_BYTES 16000
+
+// Period over which the broadcast rate is measured to size the batching window (microseconds)
+#define RATE_PERIOD 10000
+
+// Default time joins and leaves of the lobby are held back during a storm of them, to be sent together (microseconds)
+#define PRESENCE_WINDOW 20000
+
+// Default number of messages of each room replayed to the users joining it
+#define HISTORY_LENGTH 100
+
+// Default time a room is kept with its history once its last member left (seconds)
+#define ROOM_IDLE_TIMEOUT 3600
+
+// Default size from which the lists of users and the histories are compressed, for the clients supporting it
+#define COMPRESS_THRESHOLD 1024
+
+// Default maximum time before a message written to the message log is synced to disk (milliseconds)
+#define LOG_SYNC_INTERVAL 100
+
+// Default number of segments of the message log kept on disk, of MSGLOG_SEGMENT_SIZE bytes each
+#define LOG_MAX_SEGMENTS 16
+
+// Size of the end of the message log read to restore the histories on startup
+#define LOG_RESTORE_BYTES (16 * 1024 * 1024)
+
+// Number of joins and leaves kept for the clients reconnecting with the list of users they had
+#define PRESENCE_KEPT_EVENTS 16384
+
+// Biggest packet a client may send (a PA_MSG)
+#define MAX_IN_PACKET (4 * sizeof(uint32_t) + MAX_MSG_LENGTH + 1)
+
+// Maximum number of rooms a client may be in at once, besides the lobby
+#define MAX_CLIENT_ROOMS 16
 
 const char MAX_CONN_REACHED_MSG[] = "The server reached its maximum number of connections, please try again later.\n";
 
-sem_t available_connections;
-int nb_clients = 0;
-pthread_mutex_t clients_lock;
-struct client *clients;
-pthread_t *client_threads;
+// What to do with a message for a client whose outbound queue is full
+enum slow_policy {
+    SLOW_DROP,          // Drop the new message
+    SLOW_COALESCE,      // Drop the oldest queued messages to make room for the new one
+    SLOW_DISCONNECT,    // Close the connection
+};
 
-SSL_CTX *ssl_ctx = NULL;
+// What to do with a packet of a client sending too much
+enum flood_policy {
+    FLOOD_DROP,         // Drop the packet, warning the client
+    FLOOD_DELAY,        // Handle the packet, then stop reading from the client until it is within its limits again
+    FLOOD_DISCONNECT,   // Close the connection
+};
 
-void print_usage(char *progName) {
-    printf("Usage : %s [port]\n", progName);
-}
+enum client_state {
+    CL_HANDSHAKE,   // TLS handshake in progress
+    CL_USERNAME,    // Connection accepted, waiting for the PA_USERNAME packet
+    CL_CONNECTED,   // User joined the chat
+    CL_CLOSING,     // Flushing a last packet before closing the connection
+};
 
 struct client {
-    int id;
+    uint32_t id;
     char *name;
     Socket sock;
     int sock_fd;
+    enum client_state state;
+    char addr[INET6_ADDRSTRLEN];
+
+    // Partial packet received from the client
+    struct parser in;
+
+    // Packets waiting to be written to the client, as a ring buffer
+    struct frame **queue;
+    size_t queue_head;
+    size_t queue_len;
+    size_t queue_cap;
+    size_t queue_bytes;     // Bytes left to write
+    size_t out_off;         // Bytes of the first packet already written
+    uint32_t skipped;       // Messages dropped since the client was last told about it
+    uint32_t batch_id;      // Last batch of its reactor containing a message sent by the client
+
+    uint32_t events;        // Events currently registered in epoll
+    bool want_write;        // Last SSL call needs the socket to be writable
+    bool ktls_send;         // Records are encrypted by the kernel : frames are written directly to the socket
+    uint32_t caps;          // Capabilities chosen by the client (CAP_*)
+    bool dead;              // Connection scheduled for removal
+    bool has_permit;        // Holds one of the available_connections, given back when the client is removed
+    struct client *next_dead;
+
+    struct reactor *reactor;    // Reactor owning the connection
+    uint64_t accepted_at;       // Time the connection was accepted (microseconds)
+    uint64_t join_seq;          // Presence sequence number at which the client joined
+    uint64_t history_pos;       // Position in the lobby history of the first message not replayed to the client
+    uint64_t list_seq;          // Presence sequence number of the list of clients it received
+    uint64_t known_version;     // Version of the list of clients it already had, PRESENCE_NONE if none
+
+    // Timeout of the current connection phase, then next time the connection must be checked for being idle or stalled
+    struct timer timer;
+    uint64_t last_read;         // Last time data was received from the client (milliseconds)
+    uint64_t last_write;        // Last time the client started waiting for its queue to be written, or some of it was
+    bool pinged;                // The client was pinged since data was last received from it
+
+    // Messages the client may still send
+    struct rate_limit limit;
+    bool throttled;             // Messages were dropped since the client was last warned
+    uint64_t resume_at;         // Time at which the client is read from again after sending too much (milliseconds),
+                                // 0 if it is not paused
+
+    // Rooms the client joined
+    struct room *rooms[MAX_CLIENT_ROOMS];
+    uint32_t nb_rooms;
+};
+
+/*
+ * Event loop running in its own thread. Each reactor has its own listening socket and owns the connections it
+ * accepted : only the reactor thread may read from or write to them.
+ */
+struct reactor {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+
+    // Broadcasts to send to the clients of this reactor
+    struct bus bus;
+
+    // Connected clients owned by this reactor
+    struct registry registry;
+
+    // Reclamation of the clients other reactors may be reading
+    struct epoch_thread epoch;
+
+    // Timeouts of the connections
+    struct timer_wheel timers;
+
+    // Connections to remove at the end of the current loop iteration
+    struct client *dead_clients;
+
+    // Broadcasts held back to be sent in batches, and time at which they must be sent (microseconds, 0 if none)
+    struct bus_node *pending;
+    struct bus_node *pending_last;
+    size_t pending_bytes;
+    uint64_t batch_deadline;
+    int batch_timer;
+    uint32_t batch_id;
+
+    // Compression of the large packets sent to the clients of this reactor
+    z_stream deflate;
+
+    // Metrics of the reactor thread
+    struct metrics metrics;
+
+    // Broadcast rate measured over the last period (per microsecond)
+    uint64_t rate_start;
+    size_t rate_msgs;
+    size_t rate_bytes;
+    size_t rate_presence;
+    double msg_rate;
+    double byte_rate;
+    double presence_rate;
+};
+
+// Packet broadcast to the clients of all reactors. Each reactor gets its own message, all sharing the same frame.
+struct bus_msg {
+    struct bus_node node;
+    struct frame *frame;    // PA_MSG, PA_DM, PA_USRJOIN or PA_USRLEAVE
+    struct room *room;      // Room the packet is for, NULL for the lobby
+    uint32_t from;          // Client sending the message, joining or leaving
+    uint32_t to;            // Recipient of a PA_DM
+    uint64_t seq;           // Presence sequence number of a PA_USRJOIN or PA_USRLEAVE, room sequence number in a room,
+                            // position of a PA_MSG in the history of its room
 };
 
+struct reactor *reactors;
+int nb_reactors = 0;
+
+long max_clients = 0;
+atomic_long available_connections = 0;
+
+/*
+ * Joins and leaves are ordered by a presence sequence number, and must be seen in the same order by everyone : they
+ * are serialized by presence_lock, which is only held while a client is added to or removed from its registry and its
+ * join or leave is added to the list of clients. Every join or leave adds 2 to presence_seq.
+ */
+pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_uint_fast64_t presence_seq = 0;
+
+// List of the clients of the lobby, sent to the clients joining
+struct presence presence;
+
+/*
+ * Joins and leaves of rooms are also serialized by presence_lock, which must be held to read the members of the rooms
+ * of other reactors. Each of them increments room_seq, read without the lock when a message is sent to a room : members
+ * only get the messages sent after they joined.
+ */
+struct rooms rooms;
+atomic_uint_fast64_t room_seq = 0;
+
+// Last messages of the lobby, the ones of the other rooms are kept with the room
+struct history lobby_history;
+
+// Usernames in use
+struct names names;
+
+// Messages sent to the rooms, saved on disk if a directory is given for the log
+struct msglog msglog;
+char *log_dir = NULL;
+
+// Dumps the metrics of the server when SIGUSR1 is received, and serves them on a Unix socket if a path is given.
+// Both are handled by the first reactor.
+int signal_fd = -1;
+int stats_fd = -1;
+char *stats_path = NULL;
+
+// Hand-off of the server to a new process replacing it (see handoff.h)
+char *handoff_path = NULL;
+int handoff_fd = -1;
+int handoff_conn = -1;              // Connection of the process taking over
+atomic_bool stopping = false;       // The reactors stop to hand the server off
+atomic_int stopped_reactors = 0;
+
+struct rate_config flood_limits = {MSG_RATE, BYTE_RATE};
+enum flood_policy flood_policy = FLOOD_DROP;
+
+int backlog_size = CONN_BACKLOG_SIZE;
+size_t max_queue_bytes = MAX_QUEUE_BYTES;
+enum slow_policy slow_policy = SLOW_DROP;
+int handshake_timeout = HANDSHAKE_TIMEOUT;
+int username_timeout = USERNAME_TIMEOUT;
+int idle_timeout = IDLE_TIMEOUT;       // 0 to disable
+int write_timeout = WRITE_TIMEOUT;     // 0 to disable
+long session_cache_size = SESSION_CACHE_SIZE;
+long ticket_key_lifetime = TICKET_KEY_LIFETIME;
+bool use_ktls = false;
+long batch_window = 0;          // Maximum time a message may wait to be batched with others (microseconds), 0 to disable
+size_t batch_bytes = BATCH_BYTES;
+long presence_window = PRESENCE_WINDOW;     // Maximum time a join or leave may wait to be sent with others (microseconds), 0 to disable
+long history_length = HISTORY_LENGTH;
+long room_idle_timeout = ROOM_IDLE_TIMEOUT;
+long log_sync_interval = LOG_SYNC_INTERVAL;
+long log_max_segments = LOG_MAX_SEGMENTS;     // 0 for no limit
+size_t compress_threshold = COMPRESS_THRESHOLD;     // 0 to disable compression
+atomic_flag ktls_warned = ATOMIC_FLAG_INIT;
+
+SSL_CTX *ssl_ctx = NULL;
+
+void print_usage(char *progName) {
+    printf("Usage : %s [-t threads] [-m max_clients] [-b backlog] [-H handshake_timeout_ms] [-N username_timeout_ms] [-I idle_timeout_ms] [-T write_timeout_ms] [-q max_queue_bytes] [-p drop|coalesce|disconnect] [-r msg_rate] [-R byte_rate] [-f drop|delay|disconnect] [-c session_cache_size] [-k ticket_key_lifetime_s] [-K] [-w batch_window_us] [-W batch_bytes] [-P presence_window_us] [-l history_length] [-E room_idle_timeout_s] [-L log_dir] [-F log_sync_interval_ms] [-M log_max_segments] [-z compress_threshold] [-S stats_socket] [-U handoff_socket] [port]\n", progName);
+}
+
+// Monotonic time in milliseconds
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic time in microseconds
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Monotonic time in nanoseconds
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Take presence_lock, recording how long the reactor waited for it
+void lock_presence(struct reactor *r) {
+
+    if (pthread_mutex_trylock(&presence_lock) == 0) {
+        metrics_record(&r->metrics, H_LOCK_WAIT, 0);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&presence_lock);
+    metrics_record(&r->metrics, H_LOCK_WAIT, now_ns() - start);
+
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 int init_socket(int port, int backlog_size) {
 
     char port_str[6];
@@ -74,42 +404,18 @@ int init_socket(int port, int backlog_size) {
     struct addrinfo *rp;
     int s = -1;
 
-    // Create new SSL context    
-    ssl_ctx = SSL_CTX_new(TLS_server_method());
-    if (ssl_ctx == NULL) {
-        perror("Unable to create SSL context");
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-
-    // Set the key and cert used to authenticate
-    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, "ssl/server-cert.pem") <= 0) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-    
-    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, "ssl/server-key.pem", SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-
-    // Use scantor CA for certificate verification
-    if (!SSL_CTX_load_verify_locations(ssl_ctx, "ssl/ca-cert.pem", NULL)) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-
-    // Abort connection if handshake fails
-    // SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
-
     for(rp = res; rp != NULL; rp = rp->ai_next) {
 
         s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 
         if (s == -1) continue;
 
+        // Every reactor listens on the same port, the kernel balances new connections between them
+        int reuse = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
         if (bind(s, rp->ai_addr, rp->ai_addrlen) == 0) break;  /* Success */
-        
+
         close(s);
 
     }
@@ -132,369 +438,2465 @@ int init_socket(int port, int backlog_size) {
         exit(errno);
     }
 
+    if (set_nonblocking(s) != 0) {
+        perror("Error while setting listening socket as non-blocking");
+        close(s);
+        exit(EXIT_FAILURE);
+    }
+
     return s;
 
 }
 
+void init_ssl_ctx() {
+
+    // Create new SSL context
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (ssl_ctx == NULL) {
+        perror("Unable to create SSL context");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Set the key and cert used to authenticate
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, "ssl/server-cert.pem") <= 0) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, "ssl/server-key.pem", SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Use scantor CA for certificate verification
+    if (!SSL_CTX_load_verify_locations(ssl_ctx, "ssl/ca-cert.pem", NULL)) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Abort connection if handshake fails
+    // SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+
+    // Connections are non-blocking : allow SSL_write to be retried with a moved buffer and to write partially,
+    // and release the read/write buffers of idle connections to keep memory usage flat
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // Let reconnecting clients resume their session instead of doing a full handshake : with a ticket encrypted with
+    // rotating keys, or with a session id looked up in a bounded cache
+    SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char *) SSL_SERVER_HOSTNAME, strlen(SSL_SERVER_HOSTNAME));
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ssl_ctx, session_cache_size);
+    SSL_CTX_set_num_tickets(ssl_ctx, 1);
+    tickets_init(ssl_ctx, ticket_key_lifetime);
+
+    // Let OpenSSL hand the keys to the kernel after the handshake, if both the kernel and the cipher support it
+    if (use_ktls) SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+
+}
+
+// Raise the open file descriptors limit to its maximum, as each connection uses one. Returns the new limit.
+long raise_fd_limit() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) != 0) return 1024;
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) != 0) getrlimit(RLIMIT_NOFILE, &lim);
+    return lim.rlim_cur;
+}
+
 void close_socket(int sock_fd, SSL *ssl) {
     if (ssl != NULL) {
         SSL_shutdown(ssl);
         SSL_free(ssl);
+        // Shutting down a connection that did not complete its handshake queues errors the next SSL call would see
+        ERR_clear_error();
     }
     if (sock_fd >= 0) {
         close(sock_fd);
     }
 }
 
-// Broadcast a message to all connected users
-void broadcast_msg(const char *buff, int from) {
-
-    int len = strlen(buff) + 1;
-
-    uint32_t packet[3] = {htonl(PA_MSG), htonl(from), htonl(len)};
-
-    pthread_mutex_lock(&clients_lock);
+/*
+ * Schedule the next check of a connected client : when it must be pinged or disconnected for being silent, or
+ * disconnected for not reading what is queued for it, or read from again after sending too much. The timer is not
+ * moved when data is received or written, it only finds out when it expires that the client was active and is
+ * scheduled again.
+ */
+void schedule_timeout(struct client *c) {
 
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (clients[i].sock == NULL || i == from) continue;
-        SSL_write(clients[i].sock, packet, sizeof(packet));
-        SSL_write(clients[i].sock, buff, len);
-    }
+    uint64_t when = UINT64_MAX;
+    if (idle_timeout > 0) when = c->last_read + (c->pinged ? idle_timeout : idle_timeout / 2);
+    if (write_timeout > 0 && c->queue_len > 0 && c->last_write + write_timeout < when) when = c->last_write + write_timeout;
+    if (c->resume_at != 0 && c->resume_at < when) when = c->resume_at;
 
-    pthread_mutex_unlock(&clients_lock);
+    if (when == UINT64_MAX) timer_cancel(&c->reactor->timers, &c->timer);
+    else timer_schedule(&c->reactor->timers, &c->timer, when);
 
 }
 
-void broadcast_join_message(int client_id) {
+// Register the events the connection is waiting for in epoll
+void update_events(struct client *c) {
 
-    int username_len = strlen(clients[client_id].name) + 1;
-    uint32_t packet[3] = {htonl(PA_USRJOIN), htonl(client_id), htonl(username_len)};
+    // A client sending too much is left waiting in the kernel buffers
+    uint32_t events = c->resume_at != 0 ? 0 : EPOLLIN;
+    if (c->queue_len > 0 || c->want_write) events |= EPOLLOUT;
 
-    pthread_mutex_lock(&clients_lock);
+    if (events == c->events) return;
 
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (i == client_id || clients[i].sock == NULL) continue;
-        SSL_write(clients[i].sock, &packet, sizeof(packet));
-        SSL_write(clients[i].sock, clients[client_id].name, username_len);
+    // The client starts waiting for its queue to be written, and must read it in time
+    if ((events & EPOLLOUT) && c->state == CL_CONNECTED) {
+        c->last_write = now_ms();
+        schedule_timeout(c);
     }
 
-    pthread_mutex_unlock(&clients_lock);
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(c->reactor->epoll_fd, EPOLL_CTL_MOD, c->sock_fd, &ev);
+    c->events = events;
+
+}
+
+// Schedule the removal of a client. It will be removed once all pending events are handled.
+void kill_client(struct client *c) {
+    if (c->dead) return;
+    c->dead = true;
+    c->next_dead = c->reactor->dead_clients;
+    c->reactor->dead_clients = c;
+}
 
+// Frees the queue of a client once it is empty, so that idle connections do not keep it around
+void release_queue(struct client *c) {
+    free(c->queue);
+    c->queue = NULL;
+    c->queue_head = 0;
+    c->queue_cap = 0;
 }
 
-void broadcast_leave_message(uint32_t client_id) {
+void queue_push(struct client *c, struct frame *f) {
+
+    if (c->queue_len == c->queue_cap) {
 
-    uint32_t packet[2] = {htonl(PA_USRLEAVE), htonl(client_id)};
+        size_t cap = c->queue_cap == 0 ? 8 : c->queue_cap * 2;
+        struct frame **queue = malloc(sizeof(struct frame *) * cap);
+
+        for (size_t i = 0; i < c->queue_len; i++) {
+            queue[i] = c->queue[(c->queue_head + i) % c->queue_cap];
+        }
 
-    pthread_mutex_lock(&clients_lock);
+        free(c->queue);
+        c->queue = queue;
+        c->queue_head = 0;
+        c->queue_cap = cap;
 
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (clients[i].sock == NULL) continue;
-        SSL_write(clients[i].sock, &packet, sizeof(packet));
     }
 
-    pthread_mutex_unlock(&clients_lock);
+    c->queue[(c->queue_head + c->queue_len) % c->queue_cap] = f;
+    c->queue_len++;
+    c->queue_bytes += f->len;
+    metrics_gauge(&c->reactor->metrics, G_QUEUED_BYTES, f->len);
 
 }
 
-char *read_username(Socket s) {
+// Messages of users may be dropped for slow clients, other packets keep the client in sync
+bool is_message(struct frame *f) {
+    return f->pa_num == PA_MSG || f->pa_num == PA_DM;
+}
 
-    int nread;
-    char buff[BUFF_SIZE] = {0};
-    uint32_t pa_num;
-    uint32_t username_len;
+/*
+ * Drop the oldest messages of the queue until `needed` more bytes fit in it.
+ * Other packets and the packet being written are kept, as the client needs them to stay in sync.
+ */
+void coalesce_queue(struct client *c, size_t needed) {
 
-    nread = SSL_read(s, &pa_num, sizeof(uint32_t));
-    pa_num = ntohl(pa_num);
+    size_t kept = 0;
 
-    if (nread != sizeof(uint32_t) || pa_num != PA_USERNAME) {
-        fprintf(stderr, "Error while SSL_reading username packet\n");
-        return NULL;
-    }
+    for (size_t i = 0; i < c->queue_len; i++) {
 
-    SSL_read(s, &username_len, sizeof(uint32_t));
-    username_len = ntohl(username_len);
+        struct frame *f = c->queue[(c->queue_head + i) % c->queue_cap];
+        bool partial = i == 0 && c->out_off > 0;
 
-    if (username_len > MAX_USERNAME_LENGTH) {
-        username_len = MAX_USERNAME_LENGTH;
-    }
+        if (!partial && is_message(f) && c->queue_bytes + needed > max_queue_bytes) {
+            c->queue_bytes -= f->len;
+            metrics_gauge(&c->reactor->metrics, G_QUEUED_BYTES, -(int64_t) f->len);
+            c->skipped += f->count;
+            frame_release(f);
+            continue;
+        }
 
-    nread = SSL_read(s, buff , sizeof(char) * username_len);
+        c->queue[(c->queue_head + kept) % c->queue_cap] = f;
+        kept++;
 
-    if (nread != (int) username_len) {
-        fprintf(stderr, "Error while SSL_reading username (%d SSL_read, username length = %d)\n", nread, username_len);
-        return NULL;
     }
 
-    buff[MAX_USERNAME_LENGTH + 1] = '\0';
-    char *username = malloc(sizeof(char) * username_len);
-    strcpy(username, buff);
-    return username;
+    c->queue_len = kept;
+
 }
 
 /*
- * Remove a client from the list of clients. If `cancel_thread` is true, cancel the thread used to handle the client.
- * If this is called from the client handler thread, `cancel_thread` should be `false`.
+ * Write queued frames with SSL_write, one TLS record per frame.
+ * Returns the number of bytes written, 0 if the connection is not writable, or -1 if it failed.
  */
-void remove_client(struct client client, bool cancel_thread) {
+ssize_t write_tls(struct client *c) {
 
-    pthread_mutex_lock(&clients_lock);
+    struct frame *f = c->queue[c->queue_head];
 
-    close_socket(clients[client.id].sock_fd, clients[client.id].sock);
-    clients[client.id].sock_fd = -1;
-    clients[client.id].sock = NULL;
+    ERR_clear_error();
+    int n = SSL_write(c->sock, f->data + c->out_off, f->len - c->out_off);
 
-    if (cancel_thread) {
-        pthread_cancel(client_threads[client.id]);
+    if (n <= 0) {
+        switch (SSL_get_error(c->sock, n)) {
+            case SSL_ERROR_WANT_WRITE:
+            case SSL_ERROR_WANT_READ:
+                return 0;
+            default:
+                return -1;
+        }
     }
 
-    nb_clients--;
+    return n;
+
+}
 
-    pthread_mutex_unlock(&clients_lock);
+/*
+ * Write queued frames directly to a socket doing kTLS : the kernel encrypts them, and several frames are written
+ * with a single system call without being copied in user space.
+ * Returns the number of bytes written, 0 if the connection is not writable, or -1 if it failed.
+ */
+ssize_t write_ktls(struct client *c) {
 
-    broadcast_leave_message(client.id);
+    struct iovec iov[MAX_IOV];
+    int iovcnt = 0;
 
-    sem_post(&available_connections);
-}
+    for (size_t i = 0; i < c->queue_len && iovcnt < MAX_IOV; i++) {
+        struct frame *f = c->queue[(c->queue_head + i) % c->queue_cap];
+        size_t off = i == 0 ? c->out_off : 0;
+        iov[iovcnt].iov_base = f->data + off;
+        iov[iovcnt].iov_len = f->len - off;
+        iovcnt++;
+    }
+
+    ssize_t n = writev(c->sock_fd, iov, iovcnt);
 
-void *handle_client(void *args) {
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
 
-    struct client client = *(struct client *)(args);
+    return n;
+
+}
 
-    char buff[MAX_MSG_LENGTH + 1];
+/*
+ * Write as much pending output as possible to the client without blocking.
+ * Returns -1 if the connection failed.
+ */
+int flush_client(struct client *c) {
 
-    int nread = 0;
-    uint32_t pa_num;
-    uint32_t msglen;
+    c->want_write = false;
 
     while (true) {
 
-        nread = SSL_read(client.sock, &pa_num, sizeof(uint32_t));
+        if (c->queue_len == 0) {
 
-        // Stop communicating with the client
-        if (nread <= 0) break;
+            if (c->skipped == 0) break;
 
-        pa_num = ntohl(pa_num);
+            // Tell the client it missed messages once it caught up
+            char notice[MAX_MSG_LENGTH];
+            uint32_t len = snprintf(notice, sizeof(notice), "%u messages were not delivered because your connection is too slow.", c->skipped) + 1;
+            uint32_t header[2] = {htonl(PA_SYS), htonl(len)};
+            queue_push(c, frame_new(PA_SYS, header, sizeof(header), notice, len));
+            c->skipped = 0;
 
-        if (nread != sizeof(uint32_t) || pa_num != PA_MSG) {
-            printf("[ERROR] Invalid packet %d from '%s', closing connection.\n", pa_num, client.name);
-            remove_client(client, true);
-            return NULL;
         }
 
-        // Ignore client_id
-        SSL_read(client.sock, &pa_num, sizeof(uint32_t));
+        ssize_t n = c->ktls_send ? write_ktls(c) : write_tls(c);
 
-        nread = SSL_read(client.sock, &msglen, sizeof(uint32_t));
-        msglen = ntohl(msglen);
+        if (n < 0) return -1;
+        if (n == 0) return 0;
 
-        if (nread < (int) sizeof(uint32_t)) {
-            printf("[ERROR] Invalid packet from '%s', closing connection.\n", client.name);
-            remove_client(client, true);
-            return NULL;
-        }
+        c->queue_bytes -= n;
+        metrics_gauge(&c->reactor->metrics, G_QUEUED_BYTES, -n);
+        metrics_add(&c->reactor->metrics, M_BYTES_OUT, n);
+        c->last_write = now_ms();
 
-        if (msglen > sizeof(buff)) {
-            printf("[ERROR] Error SSL_reading packet from '%s' : packet too large\n", client.name);
-            remove_client(client, true);
-            return NULL;
-        }
+        // Release the frames written entirely
+        while (n > 0) {
 
-        nread = SSL_read(client.sock, buff, msglen);
+            struct frame *f = c->queue[c->queue_head];
+            size_t written = f->len - c->out_off < (size_t) n ? f->len - c->out_off : (size_t) n;
 
-        // Stop communicating with the client
-        if (nread <= 0) break;
+            c->out_off += written;
+            n -= written;
 
-        broadcast_msg(buff, client.id);
+            if (c->out_off == f->len) {
+                frame_release(f);
+                c->out_off = 0;
+                c->queue_head = (c->queue_head + 1) % c->queue_cap;
+                c->queue_len--;
+            }
 
-    } 
+        }
 
-    // Disconnect client
-    remove_client(client, false);
+    }
 
-    return NULL;
+    release_queue(c);
+
+    if (c->state == CL_CLOSING) kill_client(c);
+
+    return 0;
 
 }
 
-int main(int argc, char* argv[]) {
+/*
+ * Queue a packet to be sent to a client, and try to send it right away. Takes over the reference to the frame.
+ * If the queue of the client is full, messages are handled according to the slow consumer policy. Other packets are
+ * always queued as the client needs them to stay in sync, unless the client is already over its limit.
+ */
+void client_send(struct client *c, struct frame *f) {
 
-    int err;
+    if (c->dead) {
+        frame_release(f);
+        return;
+    }
 
-    long port = DEFAULT_PORT;
-    if (argc >= 2) {
-        char *endptr;
-        port = strtol(argv[1], &endptr, 10);
-        if (endptr == argv[1] || port < 0 || port > 65536) {
-            printf("Invalid port number\n");
-            return EXIT_FAILURE;
+    if (c->queue_len > 0 && c->queue_bytes + f->len > max_queue_bytes) {
+
+        if (!is_message(f)) {
+            if (c->queue_bytes > max_queue_bytes) {
+                printf("[ERROR] Outbound queue of '%s' is full, closing connection.\n", c->name);
+                frame_release(f);
+                kill_client(c);
+                return;
+            }
+        } else if (slow_policy == SLOW_DROP) {
+            c->skipped += f->count;
+            frame_release(f);
+            return;
+        } else if (slow_policy == SLOW_COALESCE) {
+            coalesce_queue(c, f->len);
+        } else {
+            printf("[ERROR] Outbound queue of '%s' is full, closing connection.\n", c->name);
+            frame_release(f);
+            kill_client(c);
+            return;
         }
+
     }
 
-    sem_init(&available_connections, 0, MAX_CONNECTIONS);
-    pthread_mutex_init(&clients_lock, NULL);
+    if (is_message(f)) metrics_add(&c->reactor->metrics, M_MESSAGES_OUT, f->count);
+    queue_push(c, f);
 
-    int s = init_socket(port, CONN_BACKLOG_SIZE);
+    if (flush_client(c) != 0) {
+        kill_client(c);
+        return;
+    }
 
-    err = listen(s, CONN_BACKLOG_SIZE);
+    update_events(c);
+    metrics_record(&c->reactor->metrics, H_QUEUE_DEPTH, c->queue_bytes);
 
-    client_threads = malloc(sizeof(pthread_t) * MAX_CONNECTIONS);
-    clients = malloc(sizeof(struct client) * MAX_CONNECTIONS);
+}
 
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        clients[i].id = i;
-        clients[i].sock_fd = -1;
-        clients[i].sock = NULL;
-        clients[i].name = NULL;
-    }
+// Send a packet containing only its packet number, then close the connection
+void refuse_client(struct client *c, uint32_t pa_num) {
+    uint32_t packet = htonl(pa_num);
+    c->state = CL_CLOSING;
+    client_send(c, frame_new(pa_num, &packet, sizeof(uint32_t), NULL, 0));
+}
 
-    while(true) {
+/*
+ * Whether a packet that may be large, such as a list of users, is sent compressed to a client supporting it.
+ * Compressing is only worth it for packets sent to a single client, or shared by the clients joining : messages are
+ * shared by all the recipients and small anyway.
+ */
+bool should_compress(struct client *c, struct frame *f) {
+    return (c->caps & CAP_DEFLATE) && compress_threshold > 0 && f->len >= compress_threshold;
+}
 
-        struct sockaddr_in client_addr = {0};
-        socklen_t addr_length = sizeof(struct sockaddr_in);
+// Build the PA_COMPRESSED packet holding a frame, or return NULL if compressing it does not make it smaller
+struct frame *compress_frame(struct reactor *r, struct frame *f, bool dict) {
 
-        int client_sock_fd = accept(s, (struct sockaddr*)&client_addr, &addr_length);
+    const size_t header_len = 3 * sizeof(uint32_t);
+    struct frame *z = frame_alloc(PA_COMPRESSED, header_len + compress_bound(f->len));
+    size_t len = compress_packet(&r->deflate, dict, f->data, f->len, z->data + header_len);
 
-        if (client_sock_fd == -1) {
-            fprintf(stderr, "Error while accepting client connection");
-            switch (errno) {
-            
-                case ECONNABORTED:
-                    fprintf(stderr, " : connection aborted\n");
-                    break;
+    if (len == 0) {
+        frame_release(z);
+        return NULL;
+    }
 
-                case EMFILE:
-                case ENFILE:
-                    fprintf(stderr, " : open file descriptors limit reached\n");
-                    break;
+    uint32_t header[3] = {htonl(PA_COMPRESSED), htonl(f->len), htonl(len)};
+    memcpy(z->data, header, header_len);
+    z->len = header_len + len;
+    return z;
 
-                case ENOBUFS:
-                case ENOMEM:
-                    fprintf(stderr, " : not enough memory\n");
-                    break;
+}
 
-                case EPERM:
-                    fprintf(stderr, " : firewall rules forbid connection\n");
-                    break;
+// Send a packet that may be large to a single client, compressed if it supports it
+void send_bulk(struct client *c, struct frame *f) {
 
-                case ETIMEDOUT:
-                    fprintf(stderr, " : timed out\n");
-                    break;
+    struct frame *z = should_compress(c, f) ? compress_frame(c->reactor, f, c->caps & CAP_DICT) : NULL;
 
-                default:
-                    fprintf(stderr, " : ERRNO %d\n", errno);
-                    break;
-            }
-            continue;
-        }
+    if (z == NULL) {
+        client_send(c, f);
+        return;
+    }
 
-        /* Create server SSL structure using newly accepted client socket */
-        SSL *client_sock = SSL_new(ssl_ctx);
-        if (!SSL_set_fd(client_sock, client_sock_fd)) {
-            ERR_print_errors_fp(stderr);
-            exit(EXIT_FAILURE);
-        }
-        
-        /* Wait for SSL connection from the client */
-        if (SSL_accept(client_sock) <= 0) {
-            ERR_print_errors_fp(stderr);
-            close(client_sock_fd);
-            continue;
-        }
+    frame_release(f);
+    client_send(c, z);
 
-        char addr_buff[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(client_addr.sin_addr), addr_buff, INET_ADDRSTRLEN);
-        printf("New connection from %s : ", addr_buff);
+}
 
-        uint32_t pa_num;
+/*
+ * Get the frame of the snapshot of the list of clients to send to a client. The snapshot is compressed once for all
+ * the clients joining until the next one, the first of them compressing it. Must be called in an epoch critical
+ * section.
+ */
+struct frame *snapshot_frame(struct client *c, struct presence_snapshot *s) {
 
-        // Test if new connections are available
-        err = sem_trywait(&available_connections);
-        if (err != 0) {
-            // No new connections available
-            pa_num = htonl(PA_ERRMAXCONN);
-            SSL_write(client_sock, &pa_num, sizeof(uint32_t));
-            close_socket(client_sock_fd, client_sock);
-            continue;
-        }
+    if (!should_compress(c, s->list)) return frame_ref(s->list);
 
-        // Accept connection
-        pa_num = htonl(PA_CONNACCEPT);
-        SSL_write(client_sock, &pa_num, sizeof(uint32_t));
+    bool dict = c->caps & CAP_DICT;
+    struct frame *z = atomic_load_explicit(&s->compressed[dict], memory_order_acquire);
 
-        char *username = read_username(client_sock);
+    if (z == NULL) {
 
-        printf("%s\n", username);
+        // The list itself is kept if it cannot be compressed, so that it is not tried again
+        z = compress_frame(c->reactor, s->list, dict);
+        if (z == NULL) z = frame_ref(s->list);
 
-        if (username == NULL) {
-            sem_post(&available_connections);
-            pa_num = htonl(PA_ERRNAME);
-            SSL_write(client_sock, &pa_num, sizeof(uint32_t));
-            close_socket(client_sock_fd, client_sock);
-            continue;
+        struct frame *expected = NULL;
+        if (!atomic_compare_exchange_strong_explicit(&s->compressed[dict], &expected, z, memory_order_acq_rel, memory_order_acquire)) {
+            frame_release(z);
+            z = expected;
         }
 
-        pthread_mutex_lock(&clients_lock);
+    }
 
-        // Get next available connection id and check if username is available
-        int conn_id;
-        for (conn_id = 0; conn_id < MAX_CONNECTIONS; conn_id++) {
-            if (clients[conn_id].sock == NULL) break;
-        }
+    return frame_ref(z);
 
-        bool username_ok = true;
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            if (clients[i].sock != NULL && !strcmp(clients[i].name, username)) {
-                username_ok = false;
-                break;
-            }
-        }
+}
 
-        pthread_mutex_unlock(&clients_lock);
+// Send an informative message to a client
+void send_system_msg(struct client *c, const char *msg) {
+    uint32_t len = strlen(msg) + 1;
+    uint32_t header[2] = {htonl(PA_SYS), htonl(len)};
+    client_send(c, frame_new(PA_SYS, header, sizeof(header), msg, len));
+}
 
-        if (!username_ok) {
-            sem_post(&available_connections);
-            pa_num = htonl(PA_ERRNAME);
-            SSL_write(client_sock, &pa_num, sizeof(uint32_t));
-            close_socket(client_sock_fd, client_sock);
-            continue;
-        }
+// Send a PA_PING or PA_PONG packet with its token
+void send_ping(struct client *c, uint32_t pa_num, uint64_t token) {
+    uint32_t packet[3] = {htonl(pa_num), htonl(token >> 32), htonl(token & UINT32_MAX)};
+    client_send(c, frame_new(pa_num, packet, sizeof(packet), NULL, 0));
+}
+
+uint32_t room_id(struct room *room) {
+    return room == NULL ? LOBBY_ROOM : room->id;
+}
+
+/*
+ * Send a packet to the clients of all reactors, or to the members of a room. The sending reactor handles its own copy
+ * at the end of its loop iteration, other reactors are woken up. A packet for a room only goes to the reactors with
+ * members in it. Takes over the reference to the frame.
+ */
+void publish(struct reactor *from, struct room *room, struct frame *f, uint32_t client_id, uint64_t seq) {
 
-        // Send client id
-        uint32_t id_packet[2] = {htonl(PA_USERID), htonl(conn_id)};
-        SSL_write(client_sock, id_packet, sizeof(id_packet));
+    uint64_t shards = room == NULL ? UINT64_MAX : atomic_load_explicit(&room->shards, memory_order_relaxed);
 
-        // Send client list
+    for (int i = 0; i < nb_reactors; i++) {
 
-        pthread_mutex_lock(&clients_lock);
+        if (!(shards & ((uint64_t) 1 << i))) continue;
 
-        pa_num = htonl(PA_USRLIST);
-        uint32_t num_clients = htonl(nb_clients);
-        SSL_write(client_sock, &pa_num, sizeof(uint32_t));
-        SSL_write(client_sock, &num_clients, sizeof(uint32_t));
+        struct bus_msg *m = malloc(sizeof(struct bus_msg));
+        m->frame = frame_ref(f);
+        m->room = room;
+        m->from = client_id;
+        m->to = 0;
+        m->seq = seq;
+        if (room != NULL) room_ref(room, 1);
+        bus_push(&reactors[i].bus, &m->node, &reactors[i] != from);
 
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            
-            if (clients[i].sock == NULL) continue;
+    }
 
-            uint32_t usr_packet[2] = {htonl(clients[i].id), htonl(strlen(clients[i].name) + 1)};
-            SSL_write(client_sock, usr_packet, sizeof(uint32_t) * 2);
-            SSL_write(client_sock, clients[i].name, strlen(clients[i].name) + 1);
+    frame_release(f);
 
-        }
+}
 
-        // Add client to list;
-        free(clients[conn_id].name);
-        clients[conn_id].name = username;
-        clients[conn_id].sock = client_sock;
-        clients[conn_id].sock_fd = client_sock_fd;
-        nb_clients++;
+/*
+ * Broadcast a message from a client to the lobby, or to the members of a room, and keep it in the history of the room.
+ * Clients whose replay of the history ended before the position of the message get it, others got it with the history.
+ */
+void broadcast_msg(struct client *c, struct room *room, const char *buff, uint32_t len) {
 
-        pthread_mutex_unlock(&clients_lock);
+    uint32_t header[4] = {htonl(PA_MSG), htonl(room_id(room)), htonl(c->id), htonl(len)};
+    struct frame *f = frame_new(PA_MSG, header, sizeof(header), buff, len);
 
-        pthread_create(&client_threads[conn_id], NULL, handle_client, &clients[conn_id]);
-        
-        broadcast_join_message(conn_id);
+    uint64_t pos;
+    epoch_enter(&c->reactor->epoch);
+    struct history_entry *old = history_add(room == NULL ? &lobby_history : &room->history, f, c->name, &pos);
+    epoch_exit(&c->reactor->epoch);
+    if (old != NULL) epoch_retire(&c->reactor->epoch, old, history_free_entry);
 
-    }
+    if (log_dir != NULL) msglog_append(&msglog, room_id(room), c->id, c->name, buff, len);
 
-}
\ No newline at end of file
+    // A member that read the history before the message was added to it joined before : its reactor must be found
+    atomic_thread_fence(memory_order_seq_cst);
+    publish(c->reactor, room, f, c->id, pos);
+
+}
+
+struct frame *join_message(struct client *c, struct room *room) {
+    uint32_t username_len = strlen(c->name) + 1;
+    uint32_t header[4] = {htonl(PA_USRJOIN), htonl(room_id(room)), htonl(c->id), htonl(username_len)};
+    return frame_new(PA_USRJOIN, header, sizeof(header), c->name, username_len);
+}
+
+struct frame *leave_message(struct room *room, uint32_t client_id) {
+    uint32_t packet[3] = {htonl(PA_USRLEAVE), htonl(room_id(room)), htonl(client_id)};
+    return frame_new(PA_USRLEAVE, packet, sizeof(packet), NULL, 0);
+}
+
+void broadcast_join_message(struct client *c, struct room *room, uint64_t seq) {
+    publish(c->reactor, room, join_message(c, room), c->id, seq);
+}
+
+void broadcast_leave_message(struct reactor *r, struct room *room, uint32_t client_id, uint64_t seq) {
+    publish(r, room, leave_message(room, client_id), client_id, seq);
+}
+
+// Joins and leaves of the lobby are sent to everyone and batched together, the ones of the rooms are not
+bool is_presence(struct bus_msg *m) {
+    return m->room == NULL && (m->frame->pa_num == PA_USRJOIN || m->frame->pa_num == PA_USRLEAVE);
+}
+
+// Number of clients of the reactor a broadcast may go to : the members of its room, or all the connected clients
+uint32_t nb_recipients(struct reactor *r, struct room *room) {
+    return room == NULL ? r->registry.count : room->local[r->id].count;
+}
+
+/*
+ * Get the i-th client of the reactor a broadcast may go to, the sequence number from which it gets joins and leaves :
+ * the one of the list of users it received, and the position in the history from which it gets messages.
+ */
+struct client *get_recipient(struct reactor *r, struct room *room, uint32_t i, uint64_t *since, uint64_t *history_pos) {
+
+    if (room == NULL) {
+        struct client *c = r->registry.active[i];
+        *since = c->list_seq;
+        *history_pos = c->history_pos;
+        return c;
+    }
+
+    *since = room->local[r->id].members[i].since;
+    *history_pos = room->local[r->id].members[i].history_pos;
+    return room->local[r->id].members[i].client;
+
+}
+
+bool wants_broadcast(struct client *c, struct bus_msg *m, uint64_t since, uint64_t history_pos) {
+
+    // The sender does not get its own message back
+    if (c->id == m->from) return false;
+
+    // Clients only get the messages that were not replayed to them with the history
+    if (m->frame->pa_num == PA_MSG) return m->seq >= history_pos;
+
+    // Presence updates that happened before the client received the list of users are already in the list
+    return m->seq > since;
+
+}
+
+// Send a direct message to its recipient, owned by the reactor, if it is still connected
+void send_direct(struct reactor *r, struct bus_msg *m) {
+    struct client *c = registry_get(&r->registry, m->to);
+    if (c != NULL) client_send(c, frame_ref(m->frame));
+}
+
+// Send a broadcast to the clients of the reactor
+void send_broadcast(struct reactor *r, struct bus_msg *m) {
+
+    uint32_t count = nb_recipients(r, m->room);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t since, history_pos;
+        struct client *c = get_recipient(r, m->room, i, &since, &history_pos);
+        if (wants_broadcast(c, m, since, history_pos)) client_send(c, frame_ref(m->frame));
+    }
+
+}
+
+/*
+ * Send consecutive messages of the same room as a single frame, so that each recipient gets them in one write and one
+ * TLS record. A client that sent one of the messages, or that was replayed one with the history, gets the messages
+ * one by one instead, as it must not get them all.
+ */
+void send_batch(struct reactor *r, struct bus_node *first, struct bus_node *end, uint32_t count, size_t len) {
+
+    struct room *room = ((struct bus_msg *) first)->room;
+    struct frame *batch = frame_alloc(PA_MSG, len);
+    batch->count = count;
+    r->batch_id++;
+
+    uint64_t first_pos = UINT64_MAX;
+    char *p = batch->data;
+    for (struct bus_node *n = first; n != end; n = n->next) {
+
+        struct bus_msg *m = (struct bus_msg *) n;
+        memcpy(p, m->frame->data, m->frame->len);
+        p += m->frame->len;
+
+        // Messages of different reactors are not ordered by their position in the history
+        if (m->seq < first_pos) first_pos = m->seq;
+
+        if (registry_shard(m->from) == (uint32_t) r->id) {
+            struct client *sender = registry_get(&r->registry, m->from);
+            if (sender != NULL) sender->batch_id = r->batch_id;
+        }
+
+    }
+
+    uint32_t nb = nb_recipients(r, room);
+
+    for (uint32_t i = 0; i < nb; i++) {
+
+        uint64_t since, history_pos;
+        struct client *c = get_recipient(r, room, i, &since, &history_pos);
+
+        if (c->batch_id != r->batch_id && history_pos <= first_pos) {
+            client_send(c, frame_ref(batch));
+            continue;
+        }
+
+        for (struct bus_node *n = first; n != end; n = n->next) {
+            struct bus_msg *m = (struct bus_msg *) n;
+            if (wants_broadcast(c, m, since, history_pos)) client_send(c, frame_ref(m->frame));
+        }
+
+    }
+
+    frame_release(batch);
+
+}
+
+/*
+ * Send consecutive joins and leaves of the lobby as a single PA_USRUPDATE packet, so that each client updates its list
+ * of users once. Users who joined and left among them are left out. A client that joined during these events, or whose
+ * list of users already has some of them, gets an update of its own.
+ */
+void send_presence_batch(struct reactor *r, struct bus_node *first, struct bus_node *end, uint32_t count) {
+
+    struct frame **events = malloc(count * sizeof(struct frame *));
+    r->batch_id++;
+
+    uint64_t first_seq = UINT64_MAX;
+    uint32_t n = 0;
+    for (struct bus_node *node = first; node != end; node = node->next) {
+
+        struct bus_msg *m = (struct bus_msg *) node;
+        events[n++] = m->frame;
+
+        // Joins and leaves of different reactors are not ordered by their sequence number
+        if (m->seq < first_seq) first_seq = m->seq;
+
+        if (registry_shard(m->from) == (uint32_t) r->id) {
+            struct client *c = registry_get(&r->registry, m->from);
+            if (c != NULL) c->batch_id = r->batch_id;
+        }
+
+    }
+
+    struct frame *update = presence_update(events, n, 0);
+    uint32_t nb = nb_recipients(r, NULL);
+
+    for (uint32_t i = 0; i < nb; i++) {
+
+        uint64_t since, history_pos;
+        struct client *c = get_recipient(r, NULL, i, &since, &history_pos);
+
+        if (c->batch_id != r->batch_id && since < first_seq) {
+            if (update != NULL) client_send(c, frame_ref(update));
+            continue;
+        }
+
+        n = 0;
+        for (struct bus_node *node = first; node != end; node = node->next) {
+            struct bus_msg *m = (struct bus_msg *) node;
+            if (wants_broadcast(c, m, since, history_pos)) events[n++] = m->frame;
+        }
+
+        struct frame *own = presence_update(events, n, 0);
+        if (own != NULL) client_send(c, own);
+
+    }
+
+    if (update != NULL) frame_release(update);
+    free(events);
+
+}
+
+// Send the broadcasts held back, merging consecutive messages of the same room into batches of at most batch_bytes,
+// and consecutive joins and leaves of the lobby into a single update
+void send_pending(struct reactor *r) {
+
+    struct bus_node *n = r->pending;
+
+    r->pending = NULL;
+    r->pending_last = NULL;
+    r->pending_bytes = 0;
+    r->batch_deadline = 0;
+
+    while (n != NULL) {
+
+        struct bus_msg *m = (struct bus_msg *) n;
+        struct bus_node *end = n->next;
+        uint32_t count = 1;
+        size_t len = m->frame->len;
+
+        if (batch_window > 0 && m->frame->pa_num == PA_MSG) {
+            while (end != NULL) {
+                struct bus_msg *next = (struct bus_msg *) end;
+                if (next->frame->pa_num != PA_MSG || next->room != m->room || len + next->frame->len > batch_bytes) break;
+                len += next->frame->len;
+                count++;
+                end = end->next;
+            }
+        } else if (presence_window > 0 && is_presence(m)) {
+            while (end != NULL && is_presence((struct bus_msg *) end)) {
+                count++;
+                end = end->next;
+            }
+        }
+
+        uint64_t start = now_ns();
+
+        if (m->frame->pa_num == PA_DM) {
+            send_direct(r, m);
+        } else if (count == 1) {
+            send_broadcast(r, m);
+        } else if (is_presence(m)) {
+            send_presence_batch(r, n, end, count);
+        } else {
+            send_batch(r, n, end, count, len);
+        }
+
+        metrics_record(&r->metrics, H_FANOUT, now_ns() - start);
+
+        while (n != end) {
+            m = (struct bus_msg *) n;
+            n = n->next;
+            frame_release(m->frame);
+            if (m->room != NULL) room_release(m->room);
+            free(m);
+        }
+
+    }
+
+}
+
+/*
+ * Time a new batch may wait for more messages (microseconds). At low rates a message would likely wait alone, so it is
+ * sent right away. At higher rates, the window is just long enough to fill a batch, up to batch_window.
+ * A batch starting with joins or leaves of the lobby waits for the whole presence_window during a storm of them.
+ */
+long next_batch_window(struct reactor *r, bool presence) {
+
+    long window = 0;
+
+    if (batch_window > 0 && r->msg_rate * batch_window >= 1) {
+        double fill_time = batch_bytes / r->byte_rate;
+        window = fill_time < batch_window ? (long) fill_time : batch_window;
+    }
+
+    if (presence && presence_window > window && r->presence_rate * presence_window >= 1) window = presence_window;
+
+    return window;
+
+}
+
+// Move the broadcasts received by the reactor to its pending broadcasts, and open a batching window if needed
+void take_broadcasts(struct reactor *r) {
+
+    struct bus_node *n = bus_take(&r->bus);
+    if (n == NULL) return;
+
+    bool was_empty = r->pending == NULL;
+    if (was_empty) {
+        r->pending = n;
+    } else {
+        r->pending_last->next = n;
+    }
+
+    size_t msgs = 0;
+    size_t bytes = 0;
+    size_t presence = 0;
+    for (; n != NULL; n = n->next) {
+        struct bus_msg *m = (struct bus_msg *) n;
+        if (m->frame->pa_num == PA_MSG) {
+            msgs++;
+            bytes += m->frame->len;
+        } else if (is_presence(m)) {
+            presence++;
+        }
+        r->pending_last = n;
+    }
+    r->pending_bytes += bytes;
+
+    if (batch_window == 0 && presence_window == 0) return;
+
+    uint64_t now = now_us();
+
+    r->rate_msgs += msgs;
+    r->rate_bytes += bytes;
+    r->rate_presence += presence;
+    if (now - r->rate_start >= RATE_PERIOD) {
+        r->msg_rate = (double) r->rate_msgs / (now - r->rate_start);
+        r->byte_rate = (double) r->rate_bytes / (now - r->rate_start);
+        r->presence_rate = (double) r->rate_presence / (now - r->rate_start);
+        r->rate_start = now;
+        r->rate_msgs = 0;
+        r->rate_bytes = 0;
+        r->rate_presence = 0;
+    }
+
+    long window = was_empty ? next_batch_window(r, presence > 0) : 0;
+    if (window > 0) {
+        r->batch_deadline = now + window;
+        struct itimerspec timer = {0};
+        timer.it_value.tv_sec = window / 1000000;
+        timer.it_value.tv_nsec = (window % 1000000) * 1000;
+        timerfd_settime(r->batch_timer, 0, &timer, NULL);
+    }
+
+}
+
+// Send the broadcasts received by the reactor, unless they are waiting for a batch to fill
+void dispatch_broadcasts(struct reactor *r) {
+
+    take_broadcasts(r);
+
+    if (r->pending == NULL) return;
+    if (r->batch_deadline != 0 && r->pending_bytes < batch_bytes && now_us() < r->batch_deadline) return;
+
+    send_pending(r);
+
+}
+
+// Free a client once no other reactor can be reading it
+void free_client(void *ptr) {
+    struct client *c = ptr;
+    free(c->name);
+    free(c);
+}
+
+/*
+ * Remove a client from the list of clients and close its connection.
+ */
+void remove_client(struct client *c) {
+
+    struct reactor *r = c->reactor;
+
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->sock_fd, NULL);
+    close_socket(c->sock_fd, c->sock);
+    timer_cancel(&r->timers, &c->timer);
+
+    if (c->state == CL_CONNECTED) {
+
+        struct frame *leave = leave_message(NULL, c->id);
+
+        lock_presence(r);
+        uint64_t seq = atomic_load_explicit(&presence_seq, memory_order_relaxed);
+        registry_remove(&r->registry, c->id);
+        atomic_store_explicit(&presence_seq, seq + 2, memory_order_release);
+        presence_add(&presence, &r->epoch, seq + 2, frame_ref(leave));
+
+        // Leaving the lobby tells everyone the client left its rooms too
+        uint64_t now = now_ms();
+        for (uint32_t i = 0; i < c->nb_rooms; i++) rooms_leave(&rooms, c->rooms[i], r->id, c, now);
+        rooms_expire(&rooms, now);
+
+        pthread_mutex_unlock(&presence_lock);
+
+        for (uint32_t i = 0; i < c->nb_rooms; i++) room_release(c->rooms[i]);
+        c->nb_rooms = 0;
+
+        atomic_fetch_add(&available_connections, 1);
+        names_remove(&names, c->name);
+        metrics_gauge(&r->metrics, G_CLIENTS, -1);
+
+        publish(r, NULL, leave, c->id, seq + 2);
+        presence_compact(&presence, &r->epoch);
+
+    } else if (c->has_permit) {
+        // Refused clients are closing when removed, whatever the state they were refused in
+        atomic_fetch_add(&available_connections, 1);
+    }
+
+    for (size_t i = 0; i < c->queue_len; i++) {
+        frame_release(c->queue[(c->queue_head + i) % c->queue_cap]);
+    }
+    metrics_gauge(&r->metrics, G_QUEUED_BYTES, -(int64_t) c->queue_bytes);
+    free(c->queue);
+    parser_destroy(&c->in);
+
+    // Other reactors may still be reading the name of a connected client
+    if (c->state == CL_CONNECTED) {
+        epoch_retire(&r->epoch, c, free_client);
+    } else {
+        free_client(c);
+    }
+
+}
+
+// Remove all the clients scheduled for removal. Removing a client may schedule new removals.
+void reap_clients(struct reactor *r) {
+    while (r->dead_clients != NULL) {
+        struct client *c = r->dead_clients;
+        r->dead_clients = c->next_dead;
+        remove_client(c);
+    }
+}
+
+// Called once the TLS handshake with a new client is done
+void accept_client(struct client *c) {
+
+    // Test if new connections are available
+    long available = atomic_load(&available_connections);
+    while (available > 0 && !atomic_compare_exchange_weak(&available_connections, &available, available - 1));
+
+    if (available <= 0) {
+        printf("Refused connection from %s : max number of connections reached\n", c->addr);
+        refuse_client(c, PA_ERRMAXCONN);
+        return;
+    }
+    c->has_permit = true;
+
+    if (use_ktls) {
+
+        c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->sock));
+
+        // Usually the kernel module is missing or the cipher is not supported, which applies to most connections
+        if (!c->ktls_send && !atomic_flag_test_and_set(&ktls_warned)) {
+            printf("kTLS is not available for %s (%s), using user space TLS for such connections\n", c->addr, SSL_get_cipher(c->sock));
+        }
+
+    }
+
+    // Accept connection
+    c->state = CL_USERNAME;
+    timer_schedule(&c->reactor->timers, &c->timer, now_ms() + username_timeout);
+    uint32_t packet[2] = {htonl(PA_CONNACCEPT), htonl(compress_threshold > 0 ? CAP_DEFLATE | CAP_DICT : 0)};
+    client_send(c, frame_new(PA_CONNACCEPT, packet, sizeof(packet), NULL, 0));
+
+}
+
+/*
+ * Send a client that just joined a room the last messages of its history. Returns the position in the history of the
+ * first message it was not sent, the following ones being sent to it live.
+ */
+uint64_t send_history(struct client *c, struct room *room) {
+
+    struct history *h = room == NULL ? &lobby_history : &room->history;
+    struct history_entry **entries = h->size == 0 ? NULL : malloc(h->size * sizeof(struct history_entry *));
+
+    // The client must be seen as a member by the senders of the messages after the ones it reads
+    atomic_thread_fence(memory_order_seq_cst);
+    epoch_enter(&c->reactor->epoch);
+
+    uint64_t head;
+    uint32_t count = history_read(h, entries, &head);
+    size_t len = 3 * sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < count; i++) {
+        len += 2 * sizeof(uint32_t) + strlen(entries[i]->name) + 1 + entries[i]->frame->len - 3 * sizeof(uint32_t);
+    }
+
+    struct frame *f = NULL;
+
+    if (count > 0) {
+
+        f = frame_alloc(PA_HISTORY, len);
+        uint32_t header[3] = {htonl(PA_HISTORY), htonl(room_id(room)), htonl(count)};
+        memcpy(f->data, header, sizeof(header));
+        char *p = f->data + sizeof(header);
+
+        for (uint32_t i = 0; i < count; i++) {
+
+            // The PA_MSG frame holds the packet number, the room and the client id, then the length and the text
+            const char *msg = entries[i]->frame->data;
+            size_t msg_len = entries[i]->frame->len - 3 * sizeof(uint32_t);
+            uint32_t name_len = strlen(entries[i]->name) + 1;
+            uint32_t name_header = htonl(name_len);
+
+            memcpy(p, msg + 2 * sizeof(uint32_t), sizeof(uint32_t));
+            memcpy(p + sizeof(uint32_t), &name_header, sizeof(uint32_t));
+            memcpy(p + 2 * sizeof(uint32_t), entries[i]->name, name_len);
+            p += 2 * sizeof(uint32_t) + name_len;
+
+            memcpy(p, msg + 3 * sizeof(uint32_t), msg_len);
+            p += msg_len;
+
+        }
+
+    }
+
+    epoch_exit(&c->reactor->epoch);
+    free(entries);
+
+    if (f != NULL) send_bulk(c, f);
+    return head;
+
+}
+
+// Add a client to the chat once it sent its username
+void join_client(struct client *c, char *username) {
+
+    printf("New connection from %s : %s%s\n", c->addr, username, c->ktls_send ? " (kTLS)" : "");
+
+    // Reserve the username, the lock-free lookup avoids taking the index lock for names that are obviously taken
+    if (names_lookup(&names, username) != NAMES_NONE || !names_add(&names, username, NAMES_RESERVED)) {
+        refuse_client(c, PA_ERRNAME);
+        return;
+    }
+
+    // The client gets the presence updates that happened after the version of the list it is sent
+    struct frame *list = NULL;
+    struct frame *delta;
+
+    epoch_enter(&c->reactor->epoch);
+    struct presence_snapshot *snapshot = presence_read(&presence, c->known_version, &delta, &c->list_seq);
+    if (snapshot != NULL) list = snapshot_frame(c, snapshot);
+    epoch_exit(&c->reactor->epoch);
+
+    // Add client to its reactor registry. Its name must be set before it is published.
+    c->name = strdup(username);
+
+    lock_presence(c->reactor);
+    uint64_t seq = atomic_load_explicit(&presence_seq, memory_order_relaxed);
+    c->id = registry_add(&c->reactor->registry, c);
+
+    struct frame *join = NULL;
+    if (c->id != REGISTRY_NO_SLOT) {
+        join = join_message(c, NULL);
+        atomic_store_explicit(&presence_seq, seq + 2, memory_order_release);
+        presence_add(&presence, &c->reactor->epoch, seq + 2, frame_ref(join));
+    }
+
+    pthread_mutex_unlock(&presence_lock);
+
+    if (c->id == REGISTRY_NO_SLOT) {
+        free(c->name);
+        c->name = NULL;
+        names_remove(&names, username);
+        if (list != NULL) frame_release(list);
+        frame_release(delta);
+        refuse_client(c, PA_ERRMAXCONN);
+        return;
+    }
+
+    c->state = CL_CONNECTED;
+    c->join_seq = seq + 2;
+
+    names_set_id(&names, username, c->id);
+
+    // Send client id and client list, or only the changes since the version of the list the client had
+    uint32_t id_packet[2] = {htonl(PA_USERID), htonl(c->id)};
+    client_send(c, frame_new(PA_USERID, id_packet, sizeof(id_packet), NULL, 0));
+    if (list != NULL) client_send(c, list);
+    send_bulk(c, delta);
+    c->history_pos = send_history(c, NULL);
+
+    rate_limit_init(&c->limit, &flood_limits, now_us());
+    metrics_gauge(&c->reactor->metrics, G_CLIENTS, 1);
+    schedule_timeout(c);
+
+    publish(c->reactor, NULL, join, c->id, c->join_seq);
+    presence_compact(&presence, &c->reactor->epoch);
+
+}
+
+// Build the PA_USRLIST packet listing the members of a room, except `self`. presence_lock must be held.
+struct frame *build_room_list(struct room *room, struct client *self) {
+
+    size_t len = 3 * sizeof(uint32_t);
+    for (uint32_t s = 0; s < room->nb_shards; s++) {
+        for (uint32_t i = 0; i < room->local[s].count; i++) {
+            struct client *c = room->local[s].members[i].client;
+            if (c != self) len += 2 * sizeof(uint32_t) + strlen(c->name) + 1;
+        }
+    }
+
+    struct frame *list = frame_alloc(PA_USRLIST, len);
+    char *p = list->data + 3 * sizeof(uint32_t);
+    uint32_t count = 0;
+
+    for (uint32_t s = 0; s < room->nb_shards; s++) {
+        for (uint32_t i = 0; i < room->local[s].count; i++) {
+
+            struct client *c = room->local[s].members[i].client;
+            if (c == self) continue;
+
+            uint32_t name_len = strlen(c->name) + 1;
+            uint32_t usr_packet[2] = {htonl(c->id), htonl(name_len)};
+            memcpy(p, usr_packet, sizeof(usr_packet));
+            memcpy(p + sizeof(usr_packet), c->name, name_len);
+            p += sizeof(usr_packet) + name_len;
+            count++;
+
+        }
+    }
+
+    uint32_t list_header[3] = {htonl(PA_USRLIST), htonl(room->id), htonl(count)};
+    memcpy(list->data, list_header, sizeof(list_header));
+    return list;
+
+}
+
+// Index of a room in the rooms of a client, or -1 if the client is not in it
+int find_room(struct client *c, uint32_t id) {
+    for (uint32_t i = 0; i < c->nb_rooms; i++) {
+        if (c->rooms[i]->id == id) return i;
+    }
+    return -1;
+}
+
+/*
+ * Send a message to a single user. Its id gives the reactor owning it, which is the only one to get the message.
+ * The sender is told if the recipient is not connected, but not if it leaves before getting the message.
+ */
+void direct_msg(struct client *c, uint32_t to, const char *buff, uint32_t len) {
+
+    // The registry of another reactor may be looked up from any thread
+    uint32_t shard = registry_shard(to);
+    if (shard >= (uint32_t) nb_reactors || registry_get(&reactors[shard].registry, to) == NULL) {
+        send_system_msg(c, "This user is not connected, your message was not sent.");
+        return;
+    }
+
+    struct reactor *r = &reactors[shard];
+    uint32_t header[3] = {htonl(PA_DM), htonl(c->id), htonl(len)};
+
+    struct bus_msg *m = malloc(sizeof(struct bus_msg));
+    m->frame = frame_new(PA_DM, header, sizeof(header), buff, len);
+    m->room = NULL;
+    m->from = c->id;
+    m->to = to;
+    m->seq = 0;
+    bus_push(&r->bus, &m->node, r != c->reactor);
+
+}
+
+// Add a client to a room, send it the other members and tell them it joined
+void join_room(struct client *c, uint32_t id) {
+
+    // Everyone is already in the lobby
+    if (id == LOBBY_ROOM || find_room(c, id) >= 0) return;
+
+    if (c->nb_rooms == MAX_CLIENT_ROOMS) {
+        char msg[MAX_MSG_LENGTH];
+        snprintf(msg, sizeof(msg), "You cannot be in more than %d rooms at once.", MAX_CLIENT_ROOMS);
+        send_system_msg(c, msg);
+        return;
+    }
+
+    // The list is built along with the join, so the client gets exactly the updates with a greater sequence number
+    uint64_t now = now_ms();
+    lock_presence(c->reactor);
+    rooms_expire(&rooms, now);
+    uint64_t seq = atomic_load_explicit(&room_seq, memory_order_relaxed) + 1;
+    struct room *room = rooms_join(&rooms, id, c->reactor->id, c, seq, now);
+    struct frame *list = build_room_list(room, c);
+    atomic_store_explicit(&room_seq, seq, memory_order_release);
+    pthread_mutex_unlock(&presence_lock);
+
+    c->rooms[c->nb_rooms++] = room;
+    send_bulk(c, list);
+    rooms_member(room, c->reactor->id, c)->history_pos = send_history(c, room);
+
+    broadcast_join_message(c, room, seq);
+
+}
+
+// Remove a client from a room and tell the other members
+void leave_room(struct client *c, uint32_t id) {
+
+    int i = find_room(c, id);
+    if (i < 0) return;
+
+    struct room *room = c->rooms[i];
+    c->rooms[i] = c->rooms[--c->nb_rooms];
+
+    // The room is kept for a while with its history once its last member left
+    uint64_t now = now_ms();
+    lock_presence(c->reactor);
+    uint64_t seq = atomic_load_explicit(&room_seq, memory_order_relaxed) + 1;
+    rooms_leave(&rooms, room, c->reactor->id, c, now);
+    atomic_store_explicit(&room_seq, seq, memory_order_release);
+    rooms_expire(&rooms, now);
+    pthread_mutex_unlock(&presence_lock);
+
+    broadcast_leave_message(c->reactor, room, c->id, seq);
+    room_release(room);
+
+}
+
+/*
+ * Extract the username of a PA_USERNAME packet in `username`. The username must not be empty, must be at most
+ * MAX_USERNAME_LENGTH characters long, and must not contain a null character or a newline.
+ * Returns false if the username is invalid.
+ */
+bool parse_username(const char *buff, uint32_t len, char *username) {
+
+    // The null terminator is optional
+    if (len > 0 && buff[len - 1] == '\0') len--;
+
+    if (len == 0 || len > MAX_USERNAME_LENGTH) return false;
+    if (memchr(buff, '\0', len) != NULL || memchr(buff, '\n', len) != NULL) return false;
+
+    memcpy(username, buff, len);
+    username[len] = '\0';
+    return true;
+
+}
+
+/*
+ * Charge a packet of a client to its rate limits. Returns false if the packet must not be handled because the client
+ * is sending too much.
+ */
+bool check_flood(struct client *c, struct packet *p) {
+
+    // Once in debt, the client is paused before its next packet
+    if (flood_policy == FLOOD_DELAY) {
+        rate_limit_take(&c->limit, &flood_limits, p->len, now_us(), true);
+        return true;
+    }
+
+    if (rate_limit_take(&c->limit, &flood_limits, p->len, now_us(), false)) {
+        c->throttled = false;
+        return true;
+    }
+
+    if (flood_policy == FLOOD_DISCONNECT) {
+        printf("[ERROR] '%s' is sending too many messages, closing connection.\n", c->name);
+        metrics_add(&c->reactor->metrics, M_FLOOD_DISCONNECTED, 1);
+        kill_client(c);
+        return false;
+    }
+
+    metrics_add(&c->reactor->metrics, M_FLOOD_DROPPED, 1);
+
+    // Warn the client once, not for each packet dropped
+    if (!c->throttled) {
+        send_system_msg(c, "You are sending messages too fast, some of them were not sent.");
+        c->throttled = true;
+    }
+
+    return false;
+
+}
+
+/*
+ * Stop reading from a connected client that sent more than it may until it is within its limits again.
+ * Returns true if the client is paused.
+ */
+bool pause_flooding(struct client *c) {
+
+    if (c->resume_at != 0) return true;
+    if (flood_policy != FLOOD_DELAY || c->state != CL_CONNECTED) return false;
+
+    uint64_t wait = rate_limit_wait(&c->limit, &flood_limits, now_us());
+    if (wait == 0) return false;
+
+    c->resume_at = now_ms() + (wait + 999) / 1000;
+    metrics_add(&c->reactor->metrics, M_FLOOD_PAUSED, 1);
+    schedule_timeout(c);
+    update_events(c);
+    return true;
+
+}
+
+void handle_packet(struct client *c, struct packet *p) {
+
+    if (c->state == CL_USERNAME) {
+
+        // The client may choose its capabilities before sending its username
+        if (p->pa_num == PA_CAPS) {
+            c->caps = compress_threshold > 0 ? p->id & (CAP_DEFLATE | CAP_DICT) : 0;
+            return;
+        }
+
+        // ... and the version of the list of users it had, if it reconnects to the same instance of the server
+        if (p->pa_num == PA_PRESENCE) {
+            c->known_version = p->id == presence.instance ? p->version : PRESENCE_NONE;
+            return;
+        }
+
+        if (p->pa_num != PA_USERNAME || p->len == 0 || p->len > MAX_USERNAME_LENGTH + 1) {
+            fprintf(stderr, "Error while reading username packet from %s\n", c->addr);
+            refuse_client(c, PA_ERRNAME);
+            return;
+        }
+
+        char username[MAX_USERNAME_LENGTH + 1];
+
+        if (!parse_username(p->data, p->len, username)) {
+            fprintf(stderr, "Invalid username from %s\n", c->addr);
+            refuse_client(c, PA_ERRNAME);
+            return;
+        }
+
+        join_client(c, username);
+        return;
+
+    }
+
+    if (p->pa_num == PA_PING) {
+        send_ping(c, PA_PONG, p->version);
+        return;
+    }
+
+    // Receiving the answer to a ping is enough to know the client is alive
+    if (p->pa_num == PA_PONG) return;
+
+    // Other packets may be sent to many clients, so a client must not send too many of them
+    if (!check_flood(c, p)) return;
+
+    if (p->pa_num == PA_JOINROOM) {
+        join_room(c, p->room);
+        return;
+    }
+
+    if (p->pa_num == PA_LEAVEROOM) {
+        leave_room(c, p->room);
+        return;
+    }
+
+    if (p->pa_num != PA_MSG && p->pa_num != PA_DM) {
+        printf("[ERROR] Invalid packet %d from '%s', closing connection.\n", p->pa_num, c->name);
+        kill_client(c);
+        return;
+    }
+
+    // The client_id of a PA_MSG is ignored, the one of a PA_DM is its recipient
+    if (p->len == 0 || p->len > MAX_MSG_LENGTH + 1) {
+        printf("[ERROR] Error reading packet from '%s' : packet too large\n", c->name);
+        kill_client(c);
+        return;
+    }
+
+    p->data[p->len - 1] = '\0';
+    metrics_add(&c->reactor->metrics, M_MESSAGES_IN, 1);
+
+    if (p->pa_num == PA_DM) {
+        direct_msg(c, p->id, p->data, strlen(p->data) + 1);
+        return;
+    }
+
+    struct room *room = NULL;
+    if (p->room != LOBBY_ROOM) {
+        int i = find_room(c, p->room);
+        if (i < 0) {
+            send_system_msg(c, "You are not in this room, your message was not sent.");
+            return;
+        }
+        room = c->rooms[i];
+    }
+
+    broadcast_msg(c, room, p->data, strlen(p->data) + 1);
+
+}
+
+// Handle the complete packets received from a client, unless it is paused for sending too much
+void handle_packets(struct client *c) {
+
+    struct packet p;
+    int res;
+
+    while (!c->dead && c->state != CL_CLOSING && !pause_flooding(c) && (res = parser_next(&c->in, &p)) != 0) {
+
+        if (res > 0) {
+            handle_packet(c, &p);
+            continue;
+        }
+
+        if (c->state == CL_USERNAME) {
+            fprintf(stderr, "Error while reading username packet from %s\n", c->addr);
+            refuse_client(c, PA_ERRNAME);
+        } else {
+            printf("[ERROR] Invalid packet from '%s', closing connection.\n", c->name);
+            kill_client(c);
+        }
+
+    }
+
+}
+
+/*
+ * Read from a connection handed off by a previous process, which has no TLS state in user space : the kernel decrypts
+ * the records. Anything but data, such as an alert, makes the read fail.
+ * Returns the number of bytes read, 0 if there is nothing to read, or -1 if the connection is closed or failed.
+ */
+ssize_t read_ktls(struct client *c, char *buff, size_t len) {
+
+    ssize_t n = read(c->sock_fd, buff, len);
+
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+    return n == 0 ? -1 : n;
+
+}
+
+void read_client(struct client *c) {
+
+    // The rest is read on the next event, as epoll reports the socket again, unless OpenSSL already holds it
+    for (int reads = 0; !c->dead && c->state != CL_CLOSING && c->resume_at == 0
+         && (reads < READ_BUDGET || (c->sock != NULL && SSL_pending(c->sock) > 0)); reads++) {
+
+        size_t space;
+        char *buff = parser_space(&c->in, &space);
+
+        ssize_t nread;
+
+        if (c->sock == NULL) {
+
+            nread = read_ktls(c, buff, space);
+            if (nread < 0) {
+                kill_client(c);
+                return;
+            }
+            if (nread == 0) break;
+
+        } else {
+
+            // SSL_get_error only works if the error queue of the thread is empty before the call
+            ERR_clear_error();
+            nread = SSL_read(c->sock, buff, space);
+
+            if (nread <= 0) {
+                switch (SSL_get_error(c->sock, nread)) {
+                    case SSL_ERROR_WANT_READ:
+                        break;
+                    case SSL_ERROR_WANT_WRITE:
+                        c->want_write = true;
+                        break;
+                    default:
+                        // Stop communicating with the client
+                        kill_client(c);
+                        return;
+                }
+                break;
+            }
+
+        }
+
+        parser_commit(&c->in, nread);
+        metrics_add(&c->reactor->metrics, M_BYTES_IN, nread);
+        c->last_read = now_ms();
+        c->pinged = false;
+
+        handle_packets(c);
+
+    }
+
+    parser_release(&c->in);
+
+}
+
+// Continue the TLS handshake with a new client
+void handshake_client(struct client *c) {
+
+    ERR_clear_error();
+    int ret = SSL_accept(c->sock);
+
+    if (ret == 1) {
+        metrics_add(&c->reactor->metrics, M_HANDSHAKES, 1);
+        metrics_record(&c->reactor->metrics, H_HANDSHAKE, now_us() - c->accepted_at);
+        accept_client(c);
+        return;
+    }
+
+    switch (SSL_get_error(c->sock, ret)) {
+        case SSL_ERROR_WANT_READ:
+            c->want_write = false;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            c->want_write = true;
+            break;
+        default:
+            ERR_print_errors_fp(stderr);
+            metrics_add(&c->reactor->metrics, M_HANDSHAKE_FAILURES, 1);
+            kill_client(c);
+            return;
+    }
+
+}
+
+void handle_client_event(struct client *c, uint32_t events) {
+
+    if (c->dead) return;
+
+    if (events & EPOLLERR) {
+        kill_client(c);
+        return;
+    }
+
+    if (c->state == CL_HANDSHAKE) {
+        handshake_client(c);
+    } else if (flush_client(c) != 0) {
+        kill_client(c);
+        return;
+    }
+
+    // A peer closing its connection is detected when reading
+    if (!c->dead && c->state != CL_HANDSHAKE && c->state != CL_CLOSING) read_client(c);
+
+    if (!c->dead) update_events(c);
+
+}
+
+// Start the TLS handshake of a newly accepted connection
+void add_connection(struct reactor *r, int client_sock_fd, struct sockaddr_storage *client_addr, socklen_t addr_length) {
+
+    // Packets are small and latency sensitive
+    int nodelay = 1;
+    setsockopt(client_sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    struct client *c = calloc(1, sizeof(struct client));
+    c->sock_fd = client_sock_fd;
+    c->state = CL_HANDSHAKE;
+    c->reactor = r;
+    c->known_version = PRESENCE_NONE;
+    c->accepted_at = now_us();
+    parser_init(&c->in, MAX_IN_PACKET);
+    metrics_add(&r->metrics, M_CONNECTIONS, 1);
+
+    getnameinfo((struct sockaddr*)client_addr, addr_length, c->addr, sizeof(c->addr), NULL, 0, NI_NUMERICHOST);
+
+    /* Create server SSL structure using newly accepted client socket */
+    c->sock = SSL_new(ssl_ctx);
+    if (c->sock == NULL || !SSL_set_fd(c->sock, client_sock_fd)) {
+        ERR_print_errors_fp(stderr);
+        close_socket(client_sock_fd, c->sock);
+        free(c);
+        return;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_sock_fd, &ev) != 0) {
+        perror("Error while registering client connection");
+        close_socket(client_sock_fd, c->sock);
+        free(c);
+        return;
+    }
+    c->events = EPOLLIN;
+
+    timer_schedule(&r->timers, &c->timer, now_ms() + handshake_timeout);
+
+    /* Start the SSL handshake with the client */
+    handle_client_event(c, 0);
+
+}
+
+// Accept all the pending TCP connections of a listening socket
+void accept_connections(struct reactor *r, int listen_fd) {
+
+    while (true) {
+
+        struct sockaddr_storage client_addr = {0};
+        socklen_t addr_length = sizeof(client_addr);
+
+        int client_sock_fd = accept4(listen_fd, (struct sockaddr*)&client_addr, &addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_sock_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error while accepting client connection");
+            switch (errno) {
+
+                case ECONNABORTED:
+                    fprintf(stderr, " : connection aborted\n");
+                    continue;
+
+                case EMFILE:
+                case ENFILE:
+                    fprintf(stderr, " : open file descriptors limit reached\n");
+                    break;
+
+                case ENOBUFS:
+                case ENOMEM:
+                    fprintf(stderr, " : not enough memory\n");
+                    break;
+
+                case EPERM:
+                    fprintf(stderr, " : firewall rules forbid connection\n");
+                    continue;
+
+                case ETIMEDOUT:
+                    fprintf(stderr, " : timed out\n");
+                    continue;
+
+                default:
+                    fprintf(stderr, " : ERRNO %d\n", errno);
+                    break;
+            }
+            return;
+        }
+
+        add_connection(r, client_sock_fd, &client_addr, addr_length);
+
+    }
+
+}
+
+// Print the metrics of the server, on SIGUSR1
+void dump_stats() {
+
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+
+    metrics_print(stdout);
+    fflush(stdout);
+
+}
+
+// Time until the next timeout, as expected by epoll_wait
+int next_timeout(struct reactor *r) {
+
+    int64_t timeout = timer_next(&r->timers, now_ms());
+
+    // Come back to free the removed clients even if the reactor stays idle
+    if (r->epoch.garbage != NULL && (timeout < 0 || timeout > EPOCH_POLL_INTERVAL)) timeout = EPOCH_POLL_INTERVAL;
+
+    return (int) timeout;
+
+}
+
+// Called when the timer of a connection expires
+void client_timeout(struct timer *t, void *arg) {
+
+    (void) arg;
+    struct client *c = (struct client *) ((char *) t - offsetof(struct client, timer));
+
+    if (c->dead) return;
+
+    switch (c->state) {
+        case CL_HANDSHAKE:
+            printf("Connection from %s timed out during handshake\n", c->addr);
+            metrics_add(&c->reactor->metrics, M_TIMEOUTS, 1);
+            kill_client(c);
+            return;
+        case CL_USERNAME:
+            printf("Connection from %s timed out during username negotiation\n", c->addr);
+            metrics_add(&c->reactor->metrics, M_TIMEOUTS, 1);
+            kill_client(c);
+            return;
+        case CL_CLOSING:
+            // The last packet could not be written in time
+            metrics_add(&c->reactor->metrics, M_TIMEOUTS, 1);
+            kill_client(c);
+            return;
+        case CL_CONNECTED:
+            break;
+    }
+
+    uint64_t now = now_ms();
+
+    // Handle the packets of a paused client already received, the next ones being read on the next events
+    if (c->resume_at != 0 && now >= c->resume_at) {
+        c->resume_at = 0;
+        handle_packets(c);
+        if (c->dead) return;
+        update_events(c);
+        if (c->resume_at != 0) return;
+    }
+
+    if (write_timeout > 0 && c->queue_len > 0 && now >= c->last_write + write_timeout) {
+        printf("[ERROR] '%s' did not read what was sent to it for %d ms, closing connection.\n", c->name, write_timeout);
+        metrics_add(&c->reactor->metrics, M_TIMEOUTS, 1);
+        kill_client(c);
+        return;
+    }
+
+    if (idle_timeout > 0 && now >= c->last_read + idle_timeout) {
+        printf("[ERROR] '%s' did not send anything for %d ms, closing connection.\n", c->name, idle_timeout);
+        metrics_add(&c->reactor->metrics, M_TIMEOUTS, 1);
+        kill_client(c);
+        return;
+    }
+
+    // Half-open connections only show up when trying to write to them, and the client must answer
+    if (idle_timeout > 0 && !c->pinged && now >= c->last_read + idle_timeout / 2) {
+        send_ping(c, PA_PING, now);
+        c->pinged = true;
+        if (c->dead) return;
+    }
+
+    schedule_timeout(c);
+
+}
+
+// A new process connected to take over the server : stop the reactors, the main thread then hands the server off
+void accept_handoff() {
+
+    int conn = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) return;
+
+    // The new process sends its version right after connecting
+    struct timeval timeout = {1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct handoff_hello hello;
+    int fd;
+    ssize_t len = handoff_recv(conn, &hello, sizeof(hello), &fd);
+    if (fd != -1) close(fd);
+
+    if (len != sizeof(hello) || hello.type != HO_HELLO || hello.version != HANDOFF_VERSION) {
+        fprintf(stderr, "Refused to hand the server off to a process of another version\n");
+        close(conn);
+        return;
+    }
+
+    printf("Handing the server off to a new process\n");
+    handoff_conn = conn;
+    atomic_store_explicit(&stopping, true, memory_order_release);
+    for (int i = 1; i < nb_reactors; i++) bus_wake(&reactors[i].bus);
+
+}
+
+/*
+ * Stop a reactor to hand the server off. Once every reactor stopped reading from its clients, nothing is published
+ * anymore : the broadcasts left on the bus are queued to the clients, and written as much as they can be without
+ * waiting. Clients failing meanwhile are not removed, as it would publish their leave.
+ */
+void stop_reactor(struct reactor *r) {
+
+    // The last reactor to stop wakes up the others
+    if (atomic_fetch_add(&stopped_reactors, 1) + 1 == nb_reactors) {
+        for (int i = 0; i < nb_reactors; i++) bus_wake(&reactors[i].bus);
+    }
+
+    bool all_stopped;
+    do {
+
+        all_stopped = atomic_load(&stopped_reactors) == nb_reactors;
+
+        bus_clear_wakeup(&r->bus);
+        take_broadcasts(r);
+        if (r->pending != NULL) send_pending(r);
+
+        if (!all_stopped) {
+            struct pollfd wakeup = {r->bus.event_fd, POLLIN, 0};
+            poll(&wakeup, 1, -1);
+        }
+
+    } while (!all_stopped);
+
+}
+
+// Initialize a reactor accepting the connections of its own listening socket
+void init_reactor(struct reactor *r, int id, int listen_fd) {
+
+    r->id = id;
+    r->dead_clients = NULL;
+    registry_init(&r->registry, id);
+    timer_wheel_init(&r->timers, now_ms());
+    metrics_register(&r->metrics);
+    epoch_register(&r->epoch);
+    r->listen_fd = listen_fd;
+
+    compress_init(&r->deflate);
+
+    r->epoll_fd = epoll_create1(0);
+    r->batch_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (r->epoll_fd == -1 || r->batch_timer == -1 || bus_init(&r->bus) != 0) {
+        perror("Error while creating reactor");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listening socket, the bus and the batching timer are registered without a client
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &r->listen_fd;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev);
+
+    ev.data.ptr = &r->bus;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->bus.event_fd, &ev);
+
+    ev.data.ptr = &r->batch_timer;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->batch_timer, &ev);
+
+}
+
+void *reactor_loop(void *args) {
+
+    struct reactor *r = args;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(!atomic_load_explicit(&stopping, memory_order_acquire)) {
+
+        int nevents = epoll_wait(r->epoll_fd, events, MAX_EVENTS, next_timeout(r));
+
+        if (nevents < 0) {
+            if (errno == EINTR) continue;
+            perror("Error while waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            if (events[i].data.ptr == &r->listen_fd) {
+                accept_connections(r, r->listen_fd);
+            } else if (events[i].data.ptr == &r->bus) {
+                bus_clear_wakeup(&r->bus);
+            } else if (events[i].data.ptr == &signal_fd) {
+                dump_stats();
+            } else if (events[i].data.ptr == &stats_fd) {
+                metrics_serve(stats_fd);
+            } else if (events[i].data.ptr == &handoff_fd) {
+                accept_handoff();
+            } else if (events[i].data.ptr == &r->batch_timer) {
+                // The pending broadcasts are sent below
+                uint64_t expirations;
+                if (read(r->batch_timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("Error while reading batching timer");
+                }
+            } else {
+                handle_client_event(events[i].data.ptr, events[i].events);
+            }
+        }
+
+        timer_advance(&r->timers, now_ms(), client_timeout, NULL);
+
+        // Removing clients and sending broadcasts may fail connections, do it until everything is handled
+        do {
+            dispatch_broadcasts(r);
+            reap_clients(r);
+        } while (atomic_load_explicit(&r->bus.head, memory_order_relaxed) != NULL || r->dead_clients != NULL);
+
+        // The reactor is outside of any critical section, the clients it removed can be freed once the others are
+        epoch_poll(&r->epoch);
+
+    }
+
+    stop_reactor(r);
+    return NULL;
+
+}
+
+// Fill the histories with the last messages of the log, before the reactors start
+void restore_history() {
+
+    struct msglog_cursor cur;
+    const struct msglog_record *rec;
+    unsigned long count = 0;
+    uint64_t now = now_ms();
+
+    msglog_seek_back(&msglog, &cur, LOG_RESTORE_BYTES);
+
+    // Records are read in place, only the frames replayed to the clients are built
+    while ((rec = msglog_next(&msglog, &cur)) != NULL) {
+
+        uint32_t header[4] = {htonl(PA_MSG), htonl(rec->room), htonl(rec->client_id), htonl(rec->msg_len)};
+        struct frame *f = frame_new(PA_MSG, header, sizeof(header), msglog_msg(rec), rec->msg_len);
+        struct history *h = rec->room == LOBBY_ROOM ? &lobby_history : &rooms_get(&rooms, rec->room, now)->history;
+
+        uint64_t pos;
+        struct history_entry *old = history_add(h, f, msglog_name(rec), &pos);
+        if (old != NULL) history_free_entry(old);
+        frame_release(f);
+        count++;
+
+    }
+
+    printf("Restored %lu messages from the message log\n", count);
+
+}
+
+/*
+ * Initialize the reactors, on the listening sockets handed off by a previous process if any. Extra reactors listen on
+ * the same port with new sockets. The connections waiting on the sockets left over are accepted by the first reactor
+ * before closing them.
+ */
+void start_reactors(int port, int *listeners, int nb_listeners) {
+
+    // The port of the previous process is kept
+    if (nb_listeners > 0) {
+        struct sockaddr_storage addr;
+        socklen_t addr_length = sizeof(addr);
+        if (getsockname(listeners[0], (struct sockaddr *) &addr, &addr_length) == 0) {
+            port = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &addr)->sin6_port
+                                                    : ((struct sockaddr_in *) &addr)->sin_port);
+        }
+    }
+
+    for (int i = 0; i < nb_reactors; i++) {
+        init_reactor(&reactors[i], i, i < nb_listeners ? listeners[i] : init_socket(port, backlog_size));
+    }
+
+    for (int i = nb_reactors; i < nb_listeners; i++) {
+        accept_connections(&reactors[0], listeners[i]);
+        close(listeners[i]);
+    }
+
+}
+
+// Whether the connection of a client can go on in another process : OpenSSL must not hold any of its state
+bool can_hand_off(struct client *c) {
+    if (c->dead || !c->ktls_send) return false;
+    return c->sock == NULL || (BIO_get_ktls_recv(SSL_get_rbio(c->sock)) && !SSL_has_pending(c->sock));
+}
+
+/*
+ * Send a connected client to the process taking over the server, or only its id if its connection cannot be handed
+ * off, then close the connection. Returns whether the connection was handed off.
+ */
+bool hand_off_client(struct client *c) {
+
+    bool handed = can_hand_off(c);
+
+    size_t len = sizeof(struct handoff_client) + c->nb_rooms * sizeof(uint32_t);
+    struct handoff_client *rec = calloc(1, len);
+    rec->type = handed ? HO_CLIENT : HO_GONE;
+    rec->id = c->id;
+    rec->caps = c->caps;
+    strcpy(rec->name, c->name);
+    rec->nb_rooms = c->nb_rooms;
+    for (uint32_t i = 0; i < c->nb_rooms; i++) rec->rooms[i] = c->rooms[i]->id;
+
+    int err = handoff_send(handoff_conn, rec, len, handed ? c->sock_fd : -1);
+    free(rec);
+
+    // Data read but not handled yet, and data queued but not written yet
+    if (handed && err == 0 && parser_pending(&c->in) > 0) {
+        err = handoff_send_data(handoff_conn, HO_INPUT, c->in.buff + c->in.start, parser_pending(&c->in));
+    }
+    for (size_t i = 0; handed && err == 0 && i < c->queue_len; i++) {
+        struct frame *f = c->queue[(c->queue_head + i) % c->queue_cap];
+        size_t off = i == 0 ? c->out_off : 0;
+        err = handoff_send_data(handoff_conn, HO_OUTPUT, f->data + off, f->len - off);
+    }
+
+    if (err != 0) {
+        perror("Error while handing off a connection");
+        exit(EXIT_FAILURE);
+    }
+
+    // The connection belongs to the new process : the TLS state is dropped without telling the client
+    if (handed) {
+        SSL_free(c->sock);
+        close(c->sock_fd);
+    } else {
+        close_socket(c->sock_fd, c->sock);
+    }
+
+    return handed;
+
+}
+
+/*
+ * Send the state of the server to the process taking it over, once all the reactors stopped : the keys of the session
+ * tickets, the listening sockets and the connected clients. Clients whose connection cannot be handed off are closed,
+ * and resume their TLS session with the new process when reconnecting. Connections that did not join yet are closed.
+ */
+void hand_off() {
+
+    // The new process reads the log once it is complete
+    if (log_dir != NULL) msglog_stop(&msglog);
+
+    struct handoff_tickets tickets = {.type = HO_TICKETS};
+    tickets_export(tickets.keys);
+    int err = handoff_send(handoff_conn, &tickets, sizeof(tickets), -1);
+
+    for (int i = 0; i < nb_reactors && err == 0; i++) {
+        uint32_t type = HO_LISTENER;
+        err = handoff_send(handoff_conn, &type, sizeof(type), reactors[i].listen_fd);
+    }
+
+    if (err != 0) {
+        perror("Error while handing off the server");
+        exit(EXIT_FAILURE);
+    }
+
+    // Clients are sent in the order of their slots, which the new process restores them in the fastest
+    unsigned long handed = 0;
+    unsigned long closed = 0;
+
+    for (int i = 0; i < nb_reactors; i++) {
+        struct registry *reg = &reactors[i].registry;
+        for (uint32_t slot = 0; slot < registry_nb_slots(reg); slot++) {
+            uint32_t id;
+            struct client *c = registry_slot_client(reg, slot, &id);
+            if (c == NULL) continue;
+            if (hand_off_client(c)) {
+                handed++;
+            } else {
+                closed++;
+            }
+        }
+    }
+
+    uint32_t type = HO_END;
+    if (handoff_send(handoff_conn, &type, sizeof(type), -1) != 0) {
+        perror("Error while handing off the server");
+        exit(EXIT_FAILURE);
+    }
+    close(handoff_conn);
+
+    printf("Handed off %lu connections, closed %lu\n", handed, closed);
+
+}
+
+/*
+ * Add a connection handed off by the previous process to the reactor of its id. The client keeps its id, so that the
+ * lists of users of the others stay valid, and is not sent again what it already got, such as the list of users.
+ * Returns NULL if the client cannot be restored, its connection being closed.
+ */
+struct client *restore_client(struct handoff_client *rec, int fd) {
+
+    uint32_t shard = registry_shard(rec->id);
+    long available = atomic_fetch_sub(&available_connections, 1);
+
+    if (shard >= (uint32_t) nb_reactors || available <= 0 || !names_add(&names, rec->name, rec->id)) {
+        atomic_fetch_add(&available_connections, 1);
+        close(fd);
+        return NULL;
+    }
+
+    struct reactor *r = &reactors[shard];
+    struct client *c = calloc(1, sizeof(struct client));
+    c->id = rec->id;
+    c->name = strdup(rec->name);
+    c->sock_fd = fd;
+    c->state = CL_CONNECTED;
+    c->reactor = r;
+    c->ktls_send = true;
+    c->has_permit = true;
+    c->caps = rec->caps;
+    c->known_version = PRESENCE_NONE;
+    c->accepted_at = now_us();
+    c->last_read = now_ms();
+    parser_init(&c->in, MAX_IN_PACKET);
+
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *) &addr, &addr_length) == 0) {
+        getnameinfo((struct sockaddr *) &addr, addr_length, c->addr, sizeof(c->addr), NULL, 0, NI_NUMERICHOST);
+    }
+
+    // The client is only added to the list of users of this process, the others already know it
+    lock_presence(r);
+    uint64_t seq = atomic_load_explicit(&presence_seq, memory_order_relaxed);
+    bool restored = registry_restore(&r->registry, c->id, c);
+
+    if (restored) {
+        atomic_store_explicit(&presence_seq, seq + 2, memory_order_release);
+        presence_add(&presence, &r->epoch, seq + 2, join_message(c, NULL));
+        for (uint32_t i = 0; i < rec->nb_rooms; i++) {
+            uint64_t room = atomic_load_explicit(&room_seq, memory_order_relaxed) + 1;
+            c->rooms[c->nb_rooms++] = rooms_join(&rooms, rec->rooms[i], r->id, c, room, now_ms());
+            atomic_store_explicit(&room_seq, room, memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&presence_lock);
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+
+    if (!restored || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        fprintf(stderr, "Could not restore the connection of '%s'\n", c->name);
+        if (!restored) {
+            names_remove(&names, c->name);
+            atomic_fetch_add(&available_connections, 1);
+            close(fd);
+            parser_destroy(&c->in);
+            free_client(c);
+        } else {
+            kill_client(c);
+        }
+        return NULL;
+    }
+
+    c->events = EPOLLIN;
+    c->join_seq = seq + 2;
+    c->list_seq = seq + 2;
+    c->history_pos = atomic_load_explicit(&lobby_history.head, memory_order_acquire);
+
+    rate_limit_init(&c->limit, &flood_limits, now_us());
+    metrics_gauge(&r->metrics, G_CLIENTS, 1);
+    schedule_timeout(c);
+
+    return c;
+
+}
+
+/*
+ * Take over the server from the process connected to with `conn` (see handoff.h) : the reactors use its listening
+ * sockets, and its connections are restored. Users whose connection was not handed off are told to have left.
+ */
+void take_over(int conn, int port) {
+
+    struct handoff_hello hello = {HO_HELLO, HANDOFF_VERSION};
+    if (handoff_send(conn, &hello, sizeof(hello), -1) != 0) {
+        perror("Error while taking over the server");
+        exit(EXIT_FAILURE);
+    }
+
+    char *buff = malloc(HANDOFF_MAX_RECORD);
+    int listeners[REGISTRY_MAX_SHARDS];
+    int nb_listeners = 0;
+    bool started = false;
+    struct client *last = NULL;
+    unsigned long restored = 0;
+
+    uint32_t *gone = NULL;
+    size_t nb_gone = 0;
+    size_t gone_cap = 0;
+
+    uint32_t type;
+    do {
+
+        int fd;
+        ssize_t len = handoff_recv(conn, buff, HANDOFF_MAX_RECORD, &fd);
+
+        if (len <= 0) {
+            if (len == 0) {
+                fprintf(stderr, "The running server refused the hand-off, or stopped before its end\n");
+            } else {
+                perror("Error while taking over the server");
+            }
+            exit(EXIT_FAILURE);
+        }
+
+        if ((size_t) len < sizeof(type)) continue;
+        memcpy(&type, buff, sizeof(type));
+
+        // The reactors start once all the listening sockets are received
+        if (!started && type != HO_TICKETS && type != HO_LISTENER) {
+            start_reactors(port, listeners, nb_listeners);
+            started = true;
+        }
+
+        struct handoff_client *rec = (struct handoff_client *) buff;
+
+        switch (type) {
+
+            case HO_TICKETS:
+                if ((size_t) len == sizeof(struct handoff_tickets)) {
+                    tickets_import(((struct handoff_tickets *) buff)->keys);
+                }
+                break;
+
+            case HO_LISTENER:
+                if (fd != -1 && nb_listeners < (int) REGISTRY_MAX_SHARDS) {
+                    listeners[nb_listeners++] = fd;
+                    fd = -1;
+                }
+                break;
+
+            case HO_CLIENT:
+            case HO_GONE:
+
+                last = NULL;
+                if ((size_t) len < sizeof(struct handoff_client) || rec->nb_rooms > MAX_CLIENT_ROOMS
+                    || (size_t) len != sizeof(struct handoff_client) + rec->nb_rooms * sizeof(uint32_t)) {
+                    break;
+                }
+                rec->name[MAX_USERNAME_LENGTH] = '\0';
+
+                if (type == HO_CLIENT && fd != -1) {
+                    last = restore_client(rec, fd);
+                    fd = -1;
+                }
+
+                if (last != NULL) {
+                    restored++;
+                } else {
+                    if (nb_gone == gone_cap) {
+                        gone_cap = gone_cap == 0 ? 64 : gone_cap * 2;
+                        gone = realloc(gone, gone_cap * sizeof(uint32_t));
+                    }
+                    gone[nb_gone++] = rec->id;
+                }
+                break;
+
+            case HO_INPUT:
+                if (last != NULL) {
+                    memcpy(parser_reserve(&last->in, len - sizeof(type)), buff + sizeof(type), len - sizeof(type));
+                    parser_commit(&last->in, len - sizeof(type));
+                }
+                break;
+
+            case HO_OUTPUT:
+                // Kept whatever the size of the queue, as it may end in the middle of a packet
+                if (last != NULL) queue_push(last, frame_new(PA_SYS, buff + sizeof(type), len - sizeof(type), NULL, 0));
+                break;
+
+        }
+
+        // Sockets of unexpected records
+        if (fd != -1) close(fd);
+
+    } while (type != HO_END);
+
+    close(conn);
+    free(buff);
+
+    // Users who left with the previous process, no one else knows about them anymore
+    for (size_t i = 0; i < nb_gone; i++) {
+        lock_presence(&reactors[0]);
+        uint64_t seq = atomic_load_explicit(&presence_seq, memory_order_relaxed);
+        atomic_store_explicit(&presence_seq, seq + 2, memory_order_release);
+        pthread_mutex_unlock(&presence_lock);
+        broadcast_leave_message(NULL, NULL, gone[i], seq + 2);
+    }
+    free(gone);
+
+    presence_compact(&presence, &reactors[0].epoch);
+
+    printf("Took over %lu connections from the previous process, %lu were closed\n", restored, nb_gone);
+
+}
+
+/*
+ * Handle what the clients taken over sent to the previous process but it did not handle yet, and write what it did
+ * not write yet. Called once messages can be logged, before the reactors run.
+ */
+void resume_clients() {
+
+    for (int i = 0; i < nb_reactors; i++) {
+
+        struct reactor *r = &reactors[i];
+
+        for (uint32_t j = 0; j < r->registry.count; j++) {
+            struct client *c = r->registry.active[j];
+            if (parser_pending(&c->in) > 0) handle_packets(c);
+            if (!c->dead) update_events(c);
+        }
+
+    }
+
+    // Removing clients publishes their leave, whose reactors may not have been looked at yet
+    for (int i = 0; i < nb_reactors; i++) reap_clients(&reactors[i]);
+
+}
+
+int main(int argc, char* argv[]) {
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:m:b:H:N:I:T:q:p:r:R:f:c:k:Kw:W:P:l:E:L:F:M:z:S:U:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                max_clients = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                backlog_size = strtol(optarg, NULL, 10);
+                break;
+            case 'H':
+                handshake_timeout = strtol(optarg, NULL, 10);
+                break;
+            case 'N':
+                username_timeout = strtol(optarg, NULL, 10);
+                break;
+            case 'I':
+                idle_timeout = strtol(optarg, NULL, 10);
+                break;
+            case 'T':
+                write_timeout = strtol(optarg, NULL, 10);
+                break;
+            case 'q':
+                max_queue_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                if (!strcmp(optarg, "drop")) {
+                    slow_policy = SLOW_DROP;
+                } else if (!strcmp(optarg, "coalesce")) {
+                    slow_policy = SLOW_COALESCE;
+                } else if (!strcmp(optarg, "disconnect")) {
+                    slow_policy = SLOW_DISCONNECT;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                flood_limits.msg_rate = strtod(optarg, NULL);
+                break;
+            case 'R':
+                flood_limits.byte_rate = strtod(optarg, NULL);
+                break;
+            case 'f':
+                if (!strcmp(optarg, "drop")) {
+                    flood_policy = FLOOD_DROP;
+                } else if (!strcmp(optarg, "delay")) {
+                    flood_policy = FLOOD_DELAY;
+                } else if (!strcmp(optarg, "disconnect")) {
+                    flood_policy = FLOOD_DISCONNECT;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                session_cache_size = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                ticket_key_lifetime = strtol(optarg, NULL, 10);
+                break;
+            case 'K':
+                use_ktls = true;
+                break;
+            case 'w':
+                batch_window = strtol(optarg, NULL, 10);
+                break;
+            case 'W':
+                batch_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                presence_window = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                history_length = strtol(optarg, NULL, 10);
+                break;
+            case 'E':
+                room_idle_timeout = strtol(optarg, NULL, 10);
+                break;
+            case 'L':
+                log_dir = optarg;
+                break;
+            case 'F':
+                log_sync_interval = strtol(optarg, NULL, 10);
+                break;
+            case 'M':
+                log_max_segments = strtol(optarg, NULL, 10);
+                break;
+            case 'z':
+                compress_threshold = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'U':
+                handoff_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (threads <= 0 || threads > (long) REGISTRY_MAX_SHARDS) {
+        printf("Invalid number of threads (max %u)\n", REGISTRY_MAX_SHARDS);
+        return EXIT_FAILURE;
+    }
+
+    if (max_clients < 0 || backlog_size <= 0 || handshake_timeout <= 0 || username_timeout <= 0 || idle_timeout < 0
+        || write_timeout < 0 || max_queue_bytes == 0 || flood_limits.msg_rate < 0 || flood_limits.byte_rate < 0
+        || session_cache_size < 0 || ticket_key_lifetime <= 0 || batch_window < 0 || batch_bytes == 0
+        || presence_window < 0
+        || history_length < 0 || history_length > UINT32_MAX || room_idle_timeout < 0 || log_sync_interval < 0
+        || log_max_segments < 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    long port = DEFAULT_PORT;
+    if (optind < argc) {
+        char *endptr;
+        port = strtol(argv[optind], &endptr, 10);
+        if (endptr == argv[optind] || port < 0 || port > 65536) {
+            printf("Invalid port number\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Writing to a closed connection must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    long fd_limit = raise_fd_limit();
+
+    // By default, accept as many clients as there are file descriptors available
+    if (max_clients == 0) max_clients = fd_limit > 2 * RESERVED_FDS ? fd_limit - RESERVED_FDS : RESERVED_FDS;
+    if (max_clients > (long) threads * REGISTRY_MAX_SLOTS) max_clients = threads * REGISTRY_MAX_SLOTS;
+    available_connections = max_clients;
+    names_init(&names, max_clients);
+
+    init_ssl_ctx();
+
+    nb_reactors = threads;
+    reactors = calloc(nb_reactors, sizeof(struct reactor));
+    rooms_init(&rooms, nb_reactors, history_length, (uint64_t) room_idle_timeout * 1000);
+    history_init(&lobby_history, history_length);
+    presence_init(&presence, PRESENCE_KEPT_EVENTS);
+
+    // A server already running hands its sockets and connections off to this one, and stops writing the log
+    int handoff = handoff_path != NULL ? handoff_connect(handoff_path) : -1;
+    if (handoff != -1) {
+        take_over(handoff, port);
+    } else {
+        start_reactors(port, NULL, 0);
+    }
+
+    if (log_dir != NULL) {
+        msglog_open(&msglog, log_dir, log_sync_interval, log_max_segments);
+        if (history_length > 0) restore_history();
+        msglog_start(&msglog);
+    }
+
+    if (handoff != -1) resume_clients();
+
+    // SIGUSR1 is only received through signal_fd, which needs it blocked in every thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("Error while creating signal fd");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &signal_fd;
+    epoll_ctl(reactors[0].epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+    if (stats_path != NULL) {
+        stats_fd = metrics_listen(stats_path);
+        if (stats_fd == -1) {
+            perror("Error while creating stats socket");
+            exit(EXIT_FAILURE);
+        }
+        ev.data.ptr = &stats_fd;
+        epoll_ctl(reactors[0].epoll_fd, EPOLL_CTL_ADD, stats_fd, &ev);
+    }
+
+    // Listen for the next process, once this one took over
+    if (handoff_path != NULL) {
+        handoff_fd = handoff_listen(handoff_path);
+        if (handoff_fd == -1) {
+            perror("Error while creating hand-off socket");
+            exit(EXIT_FAILURE);
+        }
+        ev.data.ptr = &handoff_fd;
+        epoll_ctl(reactors[0].epoll_fd, EPOLL_CTL_ADD, handoff_fd, &ev);
+    }
+
+    for (int i = 1; i < nb_reactors; i++) {
+        pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i]);
+    }
+
+    // The main thread runs the first reactor
+    reactor_loop(&reactors[0]);
+
+    // The reactors only stop to hand the server off
+    for (int i = 1; i < nb_reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    hand_off();
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,143 @@
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tickets.h"
+
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;     // 0 if the key is not set
+};
+
+// Most recent key first
+static struct ticket_key keys[TICKET_KEYS];
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static long key_lifetime;
+
+static void new_key(struct ticket_key *k, time_t now) {
+    if (RAND_bytes(k->name, sizeof(k->name)) != 1 || RAND_bytes(k->aes_key, sizeof(k->aes_key)) != 1
+        || RAND_bytes(k->hmac_key, sizeof(k->hmac_key)) != 1) {
+        fprintf(stderr, "Could not generate session ticket key\n");
+        exit(EXIT_FAILURE);
+    }
+    k->created = now;
+}
+
+// Replace the current key once it is too old. Must be called with keys_lock held.
+static void rotate_keys(time_t now) {
+    if (now - keys[0].created < key_lifetime) return;
+    memmove(&keys[1], &keys[0], sizeof(struct ticket_key) * (TICKET_KEYS - 1));
+    new_key(&keys[0], now);
+}
+
+static int set_key(const struct ticket_key *k, unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc) {
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *) k->hmac_key, sizeof(k->hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+
+    if (!EVP_CipherInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, k->aes_key, iv, enc)) return -1;
+    if (!EVP_MAC_CTX_set_params(mac_ctx, params)) return -1;
+
+    return 0;
+
+}
+
+/*
+ * Called by OpenSSL to encrypt a new ticket (enc = 1) or decrypt a ticket offered by a client (enc = 0).
+ * Returns 1 if the ticket is valid, 2 if it is valid but should be renewed, 0 if the key is unknown and -1 on error.
+ */
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx,
+                         EVP_MAC_CTX *mac_ctx, int enc) {
+
+    (void) ssl;
+    int ret;
+
+    pthread_mutex_lock(&keys_lock);
+
+    time_t now = time(NULL);
+    rotate_keys(now);
+
+    if (enc) {
+
+        ret = 1;
+        memcpy(name, keys[0].name, sizeof(keys[0].name));
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1 || set_key(&keys[0], iv, cipher_ctx, mac_ctx, 1) != 0) ret = -1;
+
+    } else {
+
+        ret = 0;
+        for (int i = 0; i < TICKET_KEYS; i++) {
+            if (keys[i].created == 0 || memcmp(name, keys[i].name, sizeof(keys[i].name)) != 0) continue;
+            ret = set_key(&keys[i], iv, cipher_ctx, mac_ctx, 0) != 0 ? -1 : (i == 0 ? 1 : 2);
+            break;
+        }
+
+    }
+
+    pthread_mutex_unlock(&keys_lock);
+
+    return ret;
+
+}
+
+void tickets_init(SSL_CTX *ctx, long lifetime) {
+
+    key_lifetime = lifetime;
+    new_key(&keys[0], time(NULL));
+
+    // Tickets are issued with the current key, which is kept for TICKET_KEYS - 1 rotations after being replaced
+    SSL_CTX_set_timeout(ctx, lifetime * (TICKET_KEYS - 1));
+
+    if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb)) {
+        fprintf(stderr, "Could not set session ticket key callback\n");
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+void tickets_export(unsigned char *buff) {
+
+    pthread_mutex_lock(&keys_lock);
+
+    for (int i = 0; i < TICKET_KEYS; i++) {
+        int64_t created = keys[i].created;
+        memcpy(buff, keys[i].name, sizeof(keys[i].name));
+        memcpy(buff + 16, keys[i].aes_key, sizeof(keys[i].aes_key));
+        memcpy(buff + 48, keys[i].hmac_key, sizeof(keys[i].hmac_key));
+        memcpy(buff + 80, &created, sizeof(created));
+        buff += TICKET_KEYS_SIZE / TICKET_KEYS;
+    }
+
+    pthread_mutex_unlock(&keys_lock);
+
+}
+
+void tickets_import(const unsigned char *buff) {
+
+    pthread_mutex_lock(&keys_lock);
+
+    for (int i = 0; i < TICKET_KEYS; i++) {
+        int64_t created;
+        memcpy(keys[i].name, buff, sizeof(keys[i].name));
+        memcpy(keys[i].aes_key, buff + 16, sizeof(keys[i].aes_key));
+        memcpy(keys[i].hmac_key, buff + 48, sizeof(keys[i].hmac_key));
+        memcpy(&created, buff + 80, sizeof(created));
+        keys[i].created = created;
+        buff += TICKET_KEYS_SIZE / TICKET_KEYS;
+    }
+
+    // The current key of the other process may be too old for the lifetime of this one
+    rotate_keys(time(NULL));
+
+    pthread_mutex_unlock(&keys_lock);
+
+}
@@ -0,0 +1,31 @@
+#ifndef DEF_TICKETS
+#define DEF_TICKETS
+
+#include <openssl/ssl.h>
+#include <stdint.h>
+
+/*
+ * Keys protecting the TLS session tickets issued by the server.
+ *
+ * A new key is generated every `lifetime` seconds and used to encrypt new tickets. The previous keys are kept to
+ * decrypt the tickets they issued, which are renewed with the current key when used. Keys only live in memory :
+ * tickets issued before a restart are rejected and the client falls back to a full handshake, unless the keys are
+ * handed off to the new process.
+ */
+
+// Number of keys kept, including the current one
+#define TICKET_KEYS 3
+
+// Size of the keys once exported : the name, AES and HMAC keys, and the creation time of each key
+#define TICKET_KEYS_SIZE (TICKET_KEYS * (16 + 32 + 32 + sizeof(int64_t)))
+
+// Install the ticket keys on a context. Sessions are valid as long as their key is kept.
+void tickets_init(SSL_CTX *ctx, long lifetime);
+
+// Copy the keys to `buff`, of TICKET_KEYS_SIZE bytes
+void tickets_export(unsigned char *buff);
+
+// Replace the keys with the ones exported by another process, so that the tickets it issued are still accepted
+void tickets_import(const unsigned char *buff);
+
+#endif
@@ -0,0 +1,122 @@
+#include <stddef.h>
+#include "timer.h"
+
+// Ticks covered by the slots of a level
+#define LEVEL_SPAN(level) ((uint64_t) 1 << (TIMER_BITS * (level)))
+
+static void unlink_timer(struct timer *t) {
+    *t->prev = t->next;
+    if (t->next != NULL) t->next->prev = t->prev;
+    t->prev = NULL;
+}
+
+// Put a timer in the slot of the lowest level covering its expiry, which must not be before the current tick
+static void place(struct timer_wheel *w, struct timer *t) {
+
+    uint64_t delta = t->expires - w->tick;
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= LEVEL_SPAN(level + 1)) level++;
+
+    struct timer **slot = &w->slots[level][(t->expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    t->next = *slot;
+    t->prev = slot;
+    if (*slot != NULL) (*slot)->prev = &t->next;
+    *slot = t;
+
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+    w->tick = now / TIMER_TICK;
+    w->count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int i = 0; i < TIMER_SLOTS; i++) w->slots[level][i] = NULL;
+    }
+}
+
+void timer_schedule(struct timer_wheel *w, struct timer *t, uint64_t when) {
+
+    if (t->prev != NULL) unlink_timer(t);
+    else w->count++;
+
+    // Round up so that the timer never expires early, and at least to the next tick as the current one is handled
+    t->expires = (when + TIMER_TICK - 1) / TIMER_TICK;
+    if (t->expires <= w->tick) t->expires = w->tick + 1;
+    if (t->expires - w->tick >= LEVEL_SPAN(TIMER_LEVELS)) t->expires = w->tick + LEVEL_SPAN(TIMER_LEVELS) - 1;
+
+    place(w, t);
+
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+    if (t->prev == NULL) return;
+    unlink_timer(t);
+    w->count--;
+}
+
+// Move the timers of the slots reached by the current tick to the lower levels
+static void cascade(struct timer_wheel *w) {
+
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+
+        // A level is reached each time the levels below wrap around
+        if (w->tick & (LEVEL_SPAN(level) - 1)) return;
+
+        struct timer **slot = &w->slots[level][(w->tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+        struct timer *t = *slot;
+        *slot = NULL;
+
+        while (t != NULL) {
+            struct timer *next = t->next;
+            place(w, t);
+            t = next;
+        }
+
+    }
+
+}
+
+void timer_advance(struct timer_wheel *w, uint64_t now, void (*fn)(struct timer *t, void *arg), void *arg) {
+
+    uint64_t target = now / TIMER_TICK;
+
+    while (w->tick < target) {
+
+        // Nothing to expire on the way
+        if (w->count == 0) {
+            w->tick = target;
+            return;
+        }
+
+        w->tick++;
+        cascade(w);
+
+        // The expired timers are moved to a list of their own, so that `fn` may cancel any of them
+        struct timer **slot = &w->slots[0][w->tick & (TIMER_SLOTS - 1)];
+        struct timer *expired = *slot;
+        *slot = NULL;
+        if (expired != NULL) expired->prev = &expired;
+
+        while (expired != NULL) {
+            struct timer *t = expired;
+            unlink_timer(t);
+            w->count--;
+            fn(t, arg);
+        }
+
+    }
+
+}
+
+int64_t timer_next(struct timer_wheel *w, uint64_t now) {
+
+    if (w->count == 0) return -1;
+
+    // Next tick with an expired timer, or at which timers of the upper levels are moved down
+    uint64_t tick = w->tick + 1;
+    while (w->slots[0][tick & (TIMER_SLOTS - 1)] == NULL && (tick & (TIMER_SLOTS - 1)) != 0) tick++;
+
+    uint64_t when = tick * TIMER_TICK;
+    return when <= now ? 0 : (int64_t) (when - now);
+
+}
@@ -0,0 +1,53 @@
+#ifndef DEF_TIMER
+#define DEF_TIMER
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Time is divided in ticks of TIMER_TICK milliseconds. The first level has a slot for each of the next TIMER_SLOTS
+ * ticks, and each following level a slot for TIMER_SLOTS slots of the level below. A timer is put in the slot of the
+ * lowest level covering its expiry, and moved down a level each time the wheel reaches its slot, until it expires.
+ * Scheduling and cancelling a timer are O(1), and so is advancing the wheel by a tick, whatever the number of timers.
+ *
+ * Timers expire at most a tick late, never early. Timers further than the wheel can hold expire at its end.
+ */
+
+#define TIMER_TICK 10
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+// Embedded in the structure it is the timer of
+struct timer {
+    uint64_t expires;           // Tick at which the timer expires
+    struct timer *next;
+    struct timer **prev;        // Pointer to this timer in its slot, NULL if it is not scheduled
+};
+
+struct timer_wheel {
+    uint64_t tick;              // Last tick handled
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t count;             // Number of timers scheduled
+};
+
+// Create an empty wheel, starting at time `now` (milliseconds)
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+// Schedule a timer to expire at time `when` (milliseconds), replacing its previous expiry if it was scheduled
+void timer_schedule(struct timer_wheel *w, struct timer *t, uint64_t when);
+
+// Unschedule a timer, if it is scheduled
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+/*
+ * Expire the timers up to time `now` (milliseconds), calling `fn` with each of them once it is unscheduled. `fn` may
+ * schedule or cancel any timer.
+ */
+void timer_advance(struct timer_wheel *w, uint64_t now, void (*fn)(struct timer *t, void *arg), void *arg);
+
+// Time from `now` until the wheel must be advanced (milliseconds), or -1 if no timer is scheduled
+int64_t timer_next(struct timer_wheel *w, uint64_t now);
+
+#endif